@@ -0,0 +1,111 @@
+// =============================================================================
+// log.h: Compile-time log levels for each part of the PicoUSB stack
+//
+// Every category has its own level, which defaults to LOG_LEVEL. Messages
+// above the level of their category compile to nothing (even at -O0), so their
+// format strings and arguments cost nothing at run time, but the compiler still
+// checks them. For example:
+//
+//   -DLOG_LEVEL=LOG_ERROR                     Release build, errors only
+//   -DLOG_LEVEL=LOG_INFO -DLOG_ISR=LOG_DEBUG  Trace interrupts, less of the rest
+// =============================================================================
+
+#ifndef _LOG_H
+#define _LOG_H
+
+#define LOG_NONE  0 // Nothing at all
+#define LOG_ERROR 1 // Something went wrong
+#define LOG_INFO  2 // Milestones (connect, enumeration, drivers)
+#define LOG_DEBUG 3 // Step by step details, register and data dumps
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_DEBUG // Everything, as before log levels were added
+#endif
+
+// ==[ Categories ]=============================================================
+
+#ifndef LOG_ENUM
+#define LOG_ENUM LOG_LEVEL // Enumeration, descriptors and control requests
+#endif
+
+#ifndef LOG_XFER
+#define LOG_XFER LOG_LEVEL // Transfers and tasks
+#endif
+
+#ifndef LOG_ISR
+#define LOG_ISR  LOG_LEVEL // Interrupt handler
+#endif
+
+#ifndef LOG_DRV
+#define LOG_DRV  LOG_LEVEL // Class drivers
+#endif
+
+// ==[ Messages ]===============================================================
+
+#define log_none(...) do { if (0) printf(__VA_ARGS__); } while (0)
+
+#if LOG_ENUM >= LOG_ERROR
+#define enum_error(...) printf(__VA_ARGS__)
+#else
+#define enum_error log_none
+#endif
+#if LOG_ENUM >= LOG_INFO
+#define enum_info(...)  printf(__VA_ARGS__)
+#else
+#define enum_info  log_none
+#endif
+#if LOG_ENUM >= LOG_DEBUG
+#define enum_debug(...) printf(__VA_ARGS__)
+#else
+#define enum_debug log_none
+#endif
+
+#if LOG_XFER >= LOG_ERROR
+#define xfer_error(...) printf(__VA_ARGS__)
+#else
+#define xfer_error log_none
+#endif
+#if LOG_XFER >= LOG_INFO
+#define xfer_info(...)  printf(__VA_ARGS__)
+#else
+#define xfer_info  log_none
+#endif
+#if LOG_XFER >= LOG_DEBUG
+#define xfer_debug(...) printf(__VA_ARGS__)
+#else
+#define xfer_debug log_none
+#endif
+
+#if LOG_ISR >= LOG_ERROR
+#define isr_error(...)  printf(__VA_ARGS__)
+#else
+#define isr_error  log_none
+#endif
+#if LOG_ISR >= LOG_INFO
+#define isr_info(...)   printf(__VA_ARGS__)
+#else
+#define isr_info   log_none
+#endif
+#if LOG_ISR >= LOG_DEBUG
+#define isr_debug(...)  printf(__VA_ARGS__)
+#else
+#define isr_debug  log_none
+#endif
+
+#if LOG_DRV >= LOG_ERROR
+#define drv_error(...)  printf(__VA_ARGS__)
+#else
+#define drv_error  log_none
+#endif
+#if LOG_DRV >= LOG_INFO
+#define drv_info(...)   printf(__VA_ARGS__)
+#else
+#define drv_info   log_none
+#endif
+#if LOG_DRV >= LOG_DEBUG
+#define drv_debug(...)  printf(__VA_ARGS__)
+#else
+#define drv_debug  log_none
+#endif
+
+#endif
@@ -0,0 +1,62 @@
+// =============================================================================
+// drain.h: Console output streamed through a UART by DMA (src/host/drain.c)
+//
+// printf at 115200 baud keeps the CPU waiting while each line trickles out,
+// long enough to hold up USB handling. With USER_DRAIN set to a baud rate,
+// the host's console output goes into a ring instead (lines that don't fit
+// are dropped and counted, nothing ever waits), and drain_task(), called from
+// loop(), has a DMA channel send it out a UART in frames, at several Mbaud.
+// The tools/drainread reader checks the frames on Linux and prints the text
+// again.
+//
+// This header is shared by the firmware and the reader, so it only depends on
+// the C library. Every frame is a header, up to DRAIN_CHUNK bytes of text and
+// a CRC-8 of both (polynomial 0x07, starting from 0).
+// =============================================================================
+
+#ifndef _DRAIN_H
+#define _DRAIN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum {
+    DRAIN_SYNC0   = 0xa5, // Every frame starts with these two bytes
+    DRAIN_SYNC1   = 0x5a,
+    DRAIN_CHUNK   =  255, // Most text bytes in a frame
+};
+
+typedef struct __attribute__ ((packed)) {
+    uint8_t  sync[2]; // DRAIN_SYNC0, DRAIN_SYNC1
+    uint8_t  seq    ; // Frame number, so the reader sees frames go missing
+    uint8_t  len    ; // Text bytes that follow
+    uint16_t lost   ; // Lines dropped since the last frame (little-endian)
+} drain_header_t;
+
+_Static_assert(sizeof(drain_header_t) == 6, "drain_header_t size");
+
+typedef struct {
+    uint32_t bytes ; // Text bytes sent
+    uint32_t frames; // Frames sent
+    uint32_t lost  ; // Lines dropped because the ring was full
+} drain_stats_t;
+
+extern drain_stats_t drain_stats;
+
+// Fill in the table for a byte at a time CRC: crc = table[crc ^ byte]
+static inline void drain_crc_table(uint8_t table[256]) {
+    for (int i = 0; i < 256; i++) {
+        uint8_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 0x80 ? (uint8_t) (crc << 1) ^ 0x07 : crc << 1;
+        table[i] = crc;
+    }
+}
+
+void drain_init  (uint8_t uart_num, uint8_t tx_pin, uint32_t baud,
+                  uint16_t ring_size);
+int  drain_printf(const char *fmt, ...) __attribute__ ((format(__printf__, 1, 2)));
+bool drain_task  (void); // Start the next frame, true while there is work
+void drain_flush (void); // Wait until everything is out
+
+#endif
@@ -0,0 +1,160 @@
+// =============================================================================
+// ring.h: Ring buffers of bytes (src/host/ring.c)
+//
+// ring_t takes a spin lock for every call, so any number of producers and
+// consumers on either core (or in interrupt handlers) can share it. Blocked
+// readers are only woken once the ring fills to its high watermark, and
+// blocked writers once it drains to its low one, so a reader can sleep until
+// N bytes have built up (or a timeout passes) instead of waking per packet.
+//
+// spsc_t is for exactly one producer and one consumer, such as an interrupt
+// handler feeding usb_task(), or core0 feeding core1. Each side only writes
+// its own index, so no lock is needed. The indexes run freely through all 32
+// bits and wrap on their own. The size is a power of 2, so a mask finds the
+// position, and used = wptr - rptr is right even after they wrap. Barriers
+// keep the data and the index that publishes it in order between the cores.
+// =============================================================================
+
+#ifndef _RING_H
+#define _RING_H
+
+#include "pico.h"
+#include "hardware/sync.h"
+#include "pico/lock_core.h"
+
+// ==[ Locked ]=================================================================
+
+typedef struct {
+    lock_core_t core;
+    uint8_t    *data;
+    uint16_t    size;
+    uint16_t    wptr;
+    uint16_t    rptr;
+    uint16_t    low   ; // Wake writers when used drops to this (default size - 2)
+    uint16_t    high  ; // Wake readers when used reaches this (default 1)
+    bool        framed; // Holds records, not a byte stream (ring_new_framed)
+} ring_t;
+
+void     ring_init_with_spin_lock(ring_t *r, uint size, uint spin_lock_num);
+ring_t  *ring_new    (uint size);
+ring_t  *ring_new_framed(uint size);
+void     ring_reset  (ring_t *r);
+void     ring_destroy(ring_t *r);
+void     ring_set_watermarks(ring_t *r, uint16_t low, uint16_t high);
+
+uint16_t ring_try_write     (ring_t *r, const void *ptr, uint16_t len);
+uint16_t ring_try_read      (ring_t *r, void *ptr, uint16_t len);
+uint16_t ring_write_blocking(ring_t *r, const void *ptr, uint16_t len);
+uint16_t ring_read_blocking (ring_t *r, void *ptr, uint16_t len);
+uint16_t ring_read_timeout_us(ring_t *r, void *ptr, uint16_t len,
+                              uint32_t timeout_us);
+uint16_t ring_printf        (ring_t *r, const char *fmt, ...);
+bool     ring_try_write_all (ring_t *r, const void *ptr, uint16_t len);
+
+// Deferred printing, for interrupt handlers and other hot paths: ring_log
+// stores the format pointer and each argument as one word in a framed ring,
+// without formatting anything, and the consumer calls ring_format to turn
+// the next record into text. Arguments must each fit a word (integers up to
+// 32 bits, chars, pointers, no floats), and strings must outlive the record
+// (such as literals). Up to RING_LOG_ARGS are supported. Each record goes in
+// under one lock, so thread code and interrupt handlers can share the ring.
+enum {
+    RING_LOG_ARGS = 8,
+};
+
+#define ring_log(r, fmt, ...) ring_log_words(r, (const uintptr_t []) { \
+    (uintptr_t) (fmt) RING_LOG_WORDS(__VA_ARGS__) }, \
+    1 + RING_LOG_COUNT(__VA_ARGS__))
+
+#define RING_LOG_COUNT(...) RING_LOG_NTH(_, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define RING_LOG_NTH(_, a, b, c, d, e, f, g, h, n, ...) n
+#define RING_LOG_WORDS(...) RING_LOG_CAT(RING_LOG_W, RING_LOG_COUNT(__VA_ARGS__))(__VA_ARGS__)
+#define RING_LOG_CAT(a, b)  RING_LOG_CAT2(a, b)
+#define RING_LOG_CAT2(a, b) a##b
+#define RING_LOG_W0(...)
+#define RING_LOG_W1(a)      , (uintptr_t) (a)
+#define RING_LOG_W2(a, ...) , (uintptr_t) (a) RING_LOG_W1(__VA_ARGS__)
+#define RING_LOG_W3(a, ...) , (uintptr_t) (a) RING_LOG_W2(__VA_ARGS__)
+#define RING_LOG_W4(a, ...) , (uintptr_t) (a) RING_LOG_W3(__VA_ARGS__)
+#define RING_LOG_W5(a, ...) , (uintptr_t) (a) RING_LOG_W4(__VA_ARGS__)
+#define RING_LOG_W6(a, ...) , (uintptr_t) (a) RING_LOG_W5(__VA_ARGS__)
+#define RING_LOG_W7(a, ...) , (uintptr_t) (a) RING_LOG_W6(__VA_ARGS__)
+#define RING_LOG_W8(a, ...) , (uintptr_t) (a) RING_LOG_W7(__VA_ARGS__)
+
+uint16_t ring_log_words(ring_t *r, const uintptr_t *words, uint8_t count);
+uint16_t ring_format   (ring_t *r, char *buf, uint16_t size);
+
+// Zero-copy access hands out the ring's own storage as up to two spans (the
+// second one is where it wraps to the start, len 0 when it doesn't). A writer
+// reserves free space, fills it in place and commits what it filled, and a
+// reader peeks at the used bytes, parses them in place and consumes them.
+// Reserve/commit must only be used by one writer at a time, and peek/consume
+// by one reader, since the lock is only held inside each call.
+typedef struct {
+    uint8_t *ptr;
+    uint16_t len;
+} ring_span_t;
+
+uint16_t ring_reserve(ring_t *r, ring_span_t span[2], uint16_t len);
+void     ring_commit (ring_t *r, uint16_t len);
+uint16_t ring_peek   (ring_t *r, ring_span_t span[2], uint16_t len);
+void     ring_consume(ring_t *r, uint16_t len);
+
+// Framed rings keep records whole, so boundaries (such as USB packets) are not
+// lost. Each record is a 16-bit length (little-endian) and that many bytes,
+// and a record is written or read entirely or not at all, under one lock. The
+// byte calls above must not be used on them. ring_read_records takes as many
+// whole records as fit in buf (and max), back to back, with their lengths.
+// ring_reserve_record and ring_commit_record fill a record in place instead,
+// but like ring_reserve they only hold the lock inside each call, so they are
+// for a ring with a single writer (such as an endpoint's, see endpoint_ring).
+enum {
+    RING_RECORD_HEADER = 2, // Bytes in front of each record
+};
+
+bool     ring_write_record  (ring_t *r, const void *ptr, uint16_t len);
+uint16_t ring_read_record   (ring_t *r, void *ptr, uint16_t size);
+uint16_t ring_read_records  (ring_t *r, void *buf, uint16_t size,
+                             uint16_t *lens, uint16_t max);
+bool     ring_reserve_record(ring_t *r, ring_span_t span[2], uint16_t len);
+void     ring_commit_record (ring_t *r, uint16_t len);
+
+// ==[ Lock-free ]==============================================================
+
+typedef struct {
+    uint8_t          *data;
+    uint32_t          size; // Power of 2
+    uint32_t          mask; // size - 1
+    volatile uint32_t wptr; // Bytes ever written (only the producer changes it)
+    volatile uint32_t rptr; // Bytes ever read    (only the consumer changes it)
+} spsc_t;
+
+void     spsc_init   (spsc_t *r, uint32_t size);
+spsc_t  *spsc_new    (uint32_t size);
+void     spsc_reset  (spsc_t *r); // Only while neither side is using it
+void     spsc_destroy(spsc_t *r);
+
+uint32_t spsc_try_write     (spsc_t *r, const void *ptr, uint32_t len);
+uint32_t spsc_try_read      (spsc_t *r, void *ptr, uint32_t len);
+uint32_t spsc_write_blocking(spsc_t *r, const void *ptr, uint32_t len);
+uint32_t spsc_read_blocking (spsc_t *r, void *ptr, uint32_t len);
+
+// Either side can ask, the answer may be stale by the time it's used (but
+// only in the safe direction for the side that asked)
+static inline uint32_t spsc_used(spsc_t *r) {
+    return r->wptr - r->rptr;
+}
+
+static inline uint32_t spsc_free(spsc_t *r) {
+    return r->size - spsc_used(r);
+}
+
+static inline bool spsc_is_empty(spsc_t *r) {
+    return spsc_used(r) == 0;
+}
+
+static inline bool spsc_is_full(spsc_t *r) {
+    return spsc_free(r) == 0;
+}
+
+#endif
@@ -0,0 +1,69 @@
+// =============================================================================
+// trace.h: Binary trace records written by the PicoUSB host interrupt handler
+//
+// Formatting the register boxes in the ISR costs milliseconds of UART time per
+// interrupt, which is long enough to change what happens on the bus. Instead,
+// the ISR fills fixed-size records in a ring and usb_task() sends them out as
+// "#T" lines of hex words. The tools/tracedump decoder turns those lines back
+// into the usual box-drawn output on Linux.
+//
+// This header is shared by the firmware and the decoder, so it only depends on
+// the C library. Records are little-endian on both sides.
+// =============================================================================
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+enum {
+    TRACE_RECORDS =  64, // Records in the ring (must be a power of 2)
+    TRACE_REGS    =   8, // Register snapshot words per record
+    TRACE_BYTES   =  32, // Data bytes per record
+    TRACE_WORDS   =  12, // Record size in 32-bit words
+    TRACE_SHOW    = 256, // Most data bytes recorded for a completed transfer
+};
+
+enum { // Events (what the record describes)
+    TRACE_ISR,     // Interrupt handler entered  (reg: INTR INTS DAR SSR SCR ECR BCR)
+    TRACE_START,   // Transfer started           (reg: DAR SSR SCR ECR BCR, arg: setup)
+    TRACE_CONNECT, // Device connected           (num: task)
+    TRACE_STALL,   // Stall detected
+    TRACE_BUFFERS, // Buffers ready              (reg: BUF_STATUS, arg: double buffered)
+    TRACE_DATA,    // Data bytes                 (arg: label, num: offset)
+    TRACE_XFER,    // Transfer complete          (reg: bytes, num: task, arg: status)
+    TRACE_TIMEOUT, // Receive timeout
+    TRACE_RESUME,  // Device initiated resume
+    TRACE_END,     // End of a box               (arg: flat bottom line)
+    TRACE_LOST,    // Records dropped while full (num: count)
+    TRACE_SEQ,     // Wrong DATA0/DATA1 from the device
+    TRACE_RETRY,   // Transfer sent again        (arg: status, num: retry)
+};
+
+enum { // Labels for TRACE_DATA
+    TRACE_IN1,
+    TRACE_IN2,
+    TRACE_OUT1,
+    TRACE_OUT2,
+    TRACE_SETUP,
+    TRACE_XDATA,
+};
+
+typedef struct {
+    uint32_t time    ; // Timer (µs) when recorded
+    uint16_t frame   ; // SOF_RD frame number
+    uint8_t  event   ; // TRACE_ISR, TRACE_START, ...
+    uint8_t  arg     ; // Event specific
+    uint8_t  dev_addr; // Device address
+    uint8_t  ep_addr ; // Endpoint address
+    uint16_t len     ; // Data bytes in the record, or transfer length
+    uint32_t num     ; // ISR or task number, or offset of the data
+    union {
+        uint32_t reg [TRACE_REGS]; // Register snapshot
+        uint8_t  data[TRACE_BYTES]; // Data bytes
+    };
+} trace_t;
+
+_Static_assert(sizeof(trace_t) == TRACE_WORDS * 4, "trace_t size");
+
+#endif
@@ -15,6 +15,7 @@
 #define USB_REQ_TYPE_RECIPIENT_DEVICE    0x00
 #define USB_REQ_TYPE_RECIPIENT_INTERFACE 0x01
 #define USB_REQ_TYPE_RECIPIENT_ENDPOINT  0x02
+#define USB_REQ_TYPE_RECIPIENT_OTHER     0x03
 #define USB_REQ_TYPE_RECIPIENT_MASK      0x1f
 
 #define USB_TRANSFER_TYPE_CONTROL        0x00
@@ -220,4 +221,45 @@ typedef enum {
     USB_SUBCLASS_CDC_NETWORK_CONTROL_MODEL          = 0x0d, // Network Control Model
 } usb_cdc_subclass_t;
 
+// ==[ Minimal Hub Class support ]==============================================
+
+#define USB_DT_HUB                       0x29
+
+// 11.24.2 - Class-specific Requests (features for SET_FEATURE/CLEAR_FEATURE)
+typedef enum {
+    USB_HUB_PORT_CONNECTION     =  0, // Port status bits
+    USB_HUB_PORT_ENABLE         =  1,
+    USB_HUB_PORT_SUSPEND        =  2,
+    USB_HUB_PORT_OVER_CURRENT   =  3,
+    USB_HUB_PORT_RESET          =  4,
+    USB_HUB_PORT_POWER          =  8,
+    USB_HUB_PORT_LOW_SPEED      =  9,
+    USB_HUB_C_PORT_CONNECTION   = 16, // Port change bits (add 16)
+    USB_HUB_C_PORT_ENABLE       = 17,
+    USB_HUB_C_PORT_SUSPEND      = 18,
+    USB_HUB_C_PORT_OVER_CURRENT = 19,
+    USB_HUB_C_PORT_RESET        = 20,
+} usb_hub_feature_t;
+
+// 11.23.2.1 - Hub Descriptor (up to 7 ports, so the bitmaps are one byte)
+struct usb_hub_descriptor {
+    uint8_t  bDescLength;
+    uint8_t  bDescriptorType;
+    uint8_t  bNbrPorts;
+    uint16_t wHubCharacteristics;
+    uint8_t  bPwrOn2PwrGood;
+    uint8_t  bHubContrCurrent;
+    uint8_t  DeviceRemovable;
+    uint8_t  PortPwrCtrlMask;
+} __packed;
+
+// 11.24.2.7 - Port Status (wPortStatus and wPortChange)
+struct usb_hub_port_status {
+    uint16_t wPortStatus;
+    uint16_t wPortChange;
+} __packed;
+
+typedef struct usb_hub_descriptor  usb_hub_descriptor_t;
+typedef struct usb_hub_port_status usb_hub_port_status_t;
+
 #endif
@@ -0,0 +1,64 @@
+// =============================================================================
+// hardware/dma.h: Pico SDK DMA for the simulated rp2040 (Linux build)
+//
+// Channels can only feed a UART (paced by its TX DREQ). The bytes are sent
+// when the transfer is triggered, and the channel stays busy as long as the
+// UART takes to shift them out at its baud rate (8N1), without costing the
+// CPU any time.
+// =============================================================================
+
+#ifndef _HARDWARE_DMA_H
+#define _HARDWARE_DMA_H
+
+#include "pico.h"
+
+#define NUM_DMA_CHANNELS 12
+
+enum dma_channel_transfer_size {
+    DMA_SIZE_8  = 0,
+    DMA_SIZE_16 = 1,
+    DMA_SIZE_32 = 2,
+};
+
+typedef struct {
+    uint8_t size ; // DMA_SIZE_8, ...
+    bool    read_inc;
+    bool    write_inc;
+    uint8_t dreq ;
+} dma_channel_config;
+
+int  dma_claim_unused_channel(bool required);
+bool dma_channel_is_busy(uint channel);
+void dma_channel_configure(uint channel, const dma_channel_config *config,
+                           volatile void *write_addr,
+                           const volatile void *read_addr,
+                           uint transfer_count, bool trigger);
+void dma_channel_transfer_from_buffer_now(uint channel,
+                                          const volatile void *read_addr,
+                                          uint32_t transfer_count);
+
+static inline dma_channel_config dma_channel_get_default_config(uint channel) {
+    (void) channel;
+    return (dma_channel_config) { DMA_SIZE_32, true, false, 0x3f };
+}
+
+static inline void channel_config_set_transfer_data_size(
+        dma_channel_config *c, enum dma_channel_transfer_size size) {
+    c->size = size;
+}
+
+static inline void channel_config_set_read_increment(dma_channel_config *c,
+                                                     bool incr) {
+    c->read_inc = incr;
+}
+
+static inline void channel_config_set_write_increment(dma_channel_config *c,
+                                                      bool incr) {
+    c->write_inc = incr;
+}
+
+static inline void channel_config_set_dreq(dma_channel_config *c, uint dreq) {
+    c->dreq = dreq;
+}
+
+#endif
@@ -0,0 +1,28 @@
+// =============================================================================
+// hardware/flash.h: Pico SDK flash programming for the simulated rp2040 (Linux)
+//
+// The 2 MB flash is an array that starts out erased, and XIP_BASE points at
+// it so code reads it through pointers like on the Pico. As with NOR flash,
+// programming only clears bits, so a sector is erased before it is rewritten.
+// Erasing and programming cost the CPU time they take on a W25Q16.
+// =============================================================================
+
+#ifndef _HARDWARE_FLASH_H
+#define _HARDWARE_FLASH_H
+
+#include <stddef.h>
+
+#include "pico.h"
+
+#define FLASH_PAGE_SIZE       (1u << 8)
+#define FLASH_SECTOR_SIZE     (1u << 12)
+#define PICO_FLASH_SIZE_BYTES (2 * 1024 * 1024)
+
+extern uint8_t sim_flash[PICO_FLASH_SIZE_BYTES];
+
+#define XIP_BASE ((uintptr_t) sim_flash)
+
+void flash_range_erase(uint32_t offset, size_t count);
+void flash_range_program(uint32_t offset, const uint8_t *data, size_t count);
+
+#endif
@@ -0,0 +1,18 @@
+// =============================================================================
+// hardware/gpio.h: Pico SDK GPIO for the simulated rp2040 (Linux build)
+// =============================================================================
+
+#ifndef _HARDWARE_GPIO_H
+#define _HARDWARE_GPIO_H
+
+#include "pico.h"
+
+enum gpio_function {
+    GPIO_FUNC_UART = 2,
+};
+
+static inline void gpio_set_function(uint gpio, enum gpio_function fn) {
+    (void) gpio, (void) fn; // Pins are not modeled
+}
+
+#endif
@@ -0,0 +1,15 @@
+// =============================================================================
+// hardware/irq.h: Pico SDK interrupts for the simulated rp2040 (Linux build)
+// =============================================================================
+
+#ifndef _HARDWARE_IRQ_H
+#define _HARDWARE_IRQ_H
+
+#include "pico.h"
+
+#define USBCTRL_IRQ 5
+
+void irq_set_enabled(uint num, bool enabled);
+bool irq_is_enabled (uint num);
+
+#endif
@@ -0,0 +1,168 @@
+// =============================================================================
+// hardware/regs/usb.h: USB controller register bits, as in the Pico SDK
+//
+// Only the registers and fields used by PicoUSB and the simulator are listed.
+// Values follow the RP2040 datasheet, § 4.1.4 (List of Registers).
+// =============================================================================
+
+#ifndef _HARDWARE_REGS_USB_H
+#define _HARDWARE_REGS_USB_H
+
+// ==[ ADDR_ENDP, ADDR_ENDP1..15 ]==============================================
+
+#define USB_ADDR_ENDP_ADDRESS_BITS            0x0000007fu
+#define USB_ADDR_ENDP_ADDRESS_LSB             0
+#define USB_ADDR_ENDP_ENDPOINT_BITS           0x000f0000u
+#define USB_ADDR_ENDP_ENDPOINT_LSB            16
+
+#define USB_ADDR_ENDP1_ADDRESS_BITS           0x0000007fu
+#define USB_ADDR_ENDP1_ADDRESS_LSB            0
+#define USB_ADDR_ENDP1_ENDPOINT_BITS          0x000f0000u
+#define USB_ADDR_ENDP1_ENDPOINT_LSB           16
+#define USB_ADDR_ENDP1_INTEP_DIR_BITS         0x02000000u
+#define USB_ADDR_ENDP1_INTEP_PREAMBLE_BITS    0x04000000u
+
+// ==[ MAIN_CTRL ]==============================================================
+
+#define USB_MAIN_CTRL_CONTROLLER_EN_BITS      0x00000001u
+#define USB_MAIN_CTRL_HOST_NDEVICE_BITS       0x00000002u
+#define USB_MAIN_CTRL_SIM_TIMING_BITS         0x80000000u
+
+// ==[ SOF_RD ]=================================================================
+
+#define USB_SOF_RD_BITS                       0x000007ffu
+
+// ==[ SIE_CTRL ]===============================================================
+
+#define USB_SIE_CTRL_START_TRANS_BITS         0x00000001u
+#define USB_SIE_CTRL_SEND_SETUP_BITS          0x00000002u
+#define USB_SIE_CTRL_SEND_DATA_BITS           0x00000004u
+#define USB_SIE_CTRL_RECEIVE_DATA_BITS        0x00000008u
+#define USB_SIE_CTRL_STOP_TRANS_BITS          0x00000010u
+#define USB_SIE_CTRL_PREAMBLE_EN_BITS         0x00000040u
+#define USB_SIE_CTRL_SOF_SYNC_BITS            0x00000100u
+#define USB_SIE_CTRL_SOF_EN_BITS              0x00000200u
+#define USB_SIE_CTRL_KEEP_ALIVE_EN_BITS       0x00000400u
+#define USB_SIE_CTRL_VBUS_EN_BITS             0x00000800u
+#define USB_SIE_CTRL_RESUME_BITS              0x00001000u
+#define USB_SIE_CTRL_RESET_BUS_BITS           0x00002000u
+#define USB_SIE_CTRL_PULLDOWN_EN_BITS         0x00008000u
+#define USB_SIE_CTRL_PULLUP_EN_BITS           0x00010000u
+#define USB_SIE_CTRL_RPU_OPT_BITS             0x00020000u
+#define USB_SIE_CTRL_TRANSCEIVER_PD_BITS      0x00040000u
+#define USB_SIE_CTRL_DIRECT_DM_BITS           0x01000000u
+#define USB_SIE_CTRL_DIRECT_DP_BITS           0x02000000u
+#define USB_SIE_CTRL_DIRECT_EN_BITS           0x04000000u
+#define USB_SIE_CTRL_EP0_INT_NAK_BITS         0x08000000u
+#define USB_SIE_CTRL_EP0_INT_2BUF_BITS        0x10000000u
+#define USB_SIE_CTRL_EP0_INT_1BUF_BITS        0x20000000u
+#define USB_SIE_CTRL_EP0_DOUBLE_BUF_BITS      0x40000000u
+#define USB_SIE_CTRL_EP0_INT_STALL_BITS       0x80000000u
+
+// ==[ SIE_STATUS ]=============================================================
+
+#define USB_SIE_STATUS_VBUS_DETECTED_BITS     0x00000001u
+#define USB_SIE_STATUS_LINE_STATE_BITS        0x0000000cu
+#define USB_SIE_STATUS_LINE_STATE_LSB         2
+#define USB_SIE_STATUS_SUSPENDED_BITS         0x00000010u
+#define USB_SIE_STATUS_SPEED_BITS             0x00000300u
+#define USB_SIE_STATUS_SPEED_LSB              8
+#define USB_SIE_STATUS_VBUS_OVER_CURR_BITS    0x00000400u
+#define USB_SIE_STATUS_RESUME_BITS            0x00000800u
+#define USB_SIE_STATUS_CONNECTED_BITS         0x00010000u
+#define USB_SIE_STATUS_SETUP_REC_BITS         0x00020000u
+#define USB_SIE_STATUS_TRANS_COMPLETE_BITS    0x00040000u
+#define USB_SIE_STATUS_BUS_RESET_BITS         0x00080000u
+#define USB_SIE_STATUS_CRC_ERROR_BITS         0x01000000u
+#define USB_SIE_STATUS_BIT_STUFF_ERROR_BITS   0x02000000u
+#define USB_SIE_STATUS_RX_OVERFLOW_BITS       0x04000000u
+#define USB_SIE_STATUS_RX_TIMEOUT_BITS        0x08000000u
+#define USB_SIE_STATUS_NAK_REC_BITS           0x10000000u
+#define USB_SIE_STATUS_STALL_REC_BITS         0x20000000u
+#define USB_SIE_STATUS_ACK_REC_BITS           0x40000000u
+#define USB_SIE_STATUS_DATA_SEQ_ERROR_BITS    0x80000000u
+
+// ==[ INT_EP_CTRL ]============================================================
+
+#define USB_INT_EP_CTRL_INT_EP_ACTIVE_BITS    0x0000fffeu
+#define USB_INT_EP_CTRL_INT_EP_ACTIVE_LSB     1
+
+// ==[ USB_MUXING, USB_PWR ]====================================================
+
+#define USB_USB_MUXING_TO_PHY_BITS                0x00000001u
+#define USB_USB_MUXING_TO_EXTPHY_BITS             0x00000002u
+#define USB_USB_MUXING_TO_DIGITAL_PAD_BITS        0x00000004u
+#define USB_USB_MUXING_SOFTCON_BITS               0x00000008u
+
+#define USB_USB_PWR_VBUS_EN_BITS                  0x00000001u
+#define USB_USB_PWR_VBUS_EN_OVERRIDE_EN_BITS      0x00000002u
+#define USB_USB_PWR_VBUS_DETECT_BITS              0x00000004u
+#define USB_USB_PWR_VBUS_DETECT_OVERRIDE_EN_BITS  0x00000008u
+
+// ==[ INTR, INTE, INTF, INTS ]=================================================
+
+#define USB_INTR_HOST_CONN_DIS_BITS           0x00000001u
+#define USB_INTR_HOST_RESUME_BITS             0x00000002u
+#define USB_INTR_HOST_SOF_BITS                0x00000004u
+#define USB_INTR_TRANS_COMPLETE_BITS          0x00000008u
+#define USB_INTR_BUFF_STATUS_BITS             0x00000010u
+#define USB_INTR_ERROR_DATA_SEQ_BITS          0x00000020u
+#define USB_INTR_ERROR_RX_TIMEOUT_BITS        0x00000040u
+#define USB_INTR_ERROR_RX_OVERFLOW_BITS       0x00000080u
+#define USB_INTR_ERROR_BIT_STUFF_BITS         0x00000100u
+#define USB_INTR_ERROR_CRC_BITS               0x00000200u
+#define USB_INTR_STALL_BITS                   0x00000400u
+#define USB_INTR_VBUS_DETECT_BITS             0x00000800u
+#define USB_INTR_BUS_RESET_BITS               0x00001000u
+#define USB_INTR_DEV_CONN_DIS_BITS            0x00002000u
+#define USB_INTR_DEV_SUSPEND_BITS             0x00004000u
+#define USB_INTR_DEV_RESUME_FROM_HOST_BITS    0x00008000u
+#define USB_INTR_SETUP_REQ_BITS               0x00010000u
+#define USB_INTR_DEV_SOF_BITS                 0x00020000u
+#define USB_INTR_ABORT_DONE_BITS              0x00040000u
+#define USB_INTR_EP_STALL_NAK_BITS            0x00080000u
+#define USB_INTR_BITS                         0x000fffffu
+
+#define USB_INTE_HOST_CONN_DIS_BITS           USB_INTR_HOST_CONN_DIS_BITS
+#define USB_INTE_HOST_RESUME_BITS             USB_INTR_HOST_RESUME_BITS
+#define USB_INTE_HOST_SOF_BITS                USB_INTR_HOST_SOF_BITS
+#define USB_INTE_TRANS_COMPLETE_BITS          USB_INTR_TRANS_COMPLETE_BITS
+#define USB_INTE_BUFF_STATUS_BITS             USB_INTR_BUFF_STATUS_BITS
+#define USB_INTE_ERROR_DATA_SEQ_BITS          USB_INTR_ERROR_DATA_SEQ_BITS
+#define USB_INTE_ERROR_RX_TIMEOUT_BITS        USB_INTR_ERROR_RX_TIMEOUT_BITS
+#define USB_INTE_ERROR_RX_OVERFLOW_BITS       USB_INTR_ERROR_RX_OVERFLOW_BITS
+#define USB_INTE_ERROR_BIT_STUFF_BITS         USB_INTR_ERROR_BIT_STUFF_BITS
+#define USB_INTE_ERROR_CRC_BITS               USB_INTR_ERROR_CRC_BITS
+#define USB_INTE_STALL_BITS                   USB_INTR_STALL_BITS
+#define USB_INTE_VBUS_DETECT_BITS             USB_INTR_VBUS_DETECT_BITS
+#define USB_INTE_BUS_RESET_BITS               USB_INTR_BUS_RESET_BITS
+#define USB_INTE_DEV_CONN_DIS_BITS            USB_INTR_DEV_CONN_DIS_BITS
+#define USB_INTE_DEV_SUSPEND_BITS             USB_INTR_DEV_SUSPEND_BITS
+#define USB_INTE_DEV_RESUME_FROM_HOST_BITS    USB_INTR_DEV_RESUME_FROM_HOST_BITS
+#define USB_INTE_SETUP_REQ_BITS               USB_INTR_SETUP_REQ_BITS
+#define USB_INTE_DEV_SOF_BITS                 USB_INTR_DEV_SOF_BITS
+#define USB_INTE_ABORT_DONE_BITS              USB_INTR_ABORT_DONE_BITS
+#define USB_INTE_EP_STALL_NAK_BITS            USB_INTR_EP_STALL_NAK_BITS
+
+#define USB_INTS_HOST_CONN_DIS_BITS           USB_INTR_HOST_CONN_DIS_BITS
+#define USB_INTS_HOST_RESUME_BITS             USB_INTR_HOST_RESUME_BITS
+#define USB_INTS_HOST_SOF_BITS                USB_INTR_HOST_SOF_BITS
+#define USB_INTS_TRANS_COMPLETE_BITS          USB_INTR_TRANS_COMPLETE_BITS
+#define USB_INTS_BUFF_STATUS_BITS             USB_INTR_BUFF_STATUS_BITS
+#define USB_INTS_ERROR_DATA_SEQ_BITS          USB_INTR_ERROR_DATA_SEQ_BITS
+#define USB_INTS_ERROR_RX_TIMEOUT_BITS        USB_INTR_ERROR_RX_TIMEOUT_BITS
+#define USB_INTS_ERROR_RX_OVERFLOW_BITS       USB_INTR_ERROR_RX_OVERFLOW_BITS
+#define USB_INTS_ERROR_BIT_STUFF_BITS         USB_INTR_ERROR_BIT_STUFF_BITS
+#define USB_INTS_ERROR_CRC_BITS               USB_INTR_ERROR_CRC_BITS
+#define USB_INTS_STALL_BITS                   USB_INTR_STALL_BITS
+#define USB_INTS_VBUS_DETECT_BITS             USB_INTR_VBUS_DETECT_BITS
+#define USB_INTS_BUS_RESET_BITS               USB_INTR_BUS_RESET_BITS
+#define USB_INTS_DEV_CONN_DIS_BITS            USB_INTR_DEV_CONN_DIS_BITS
+#define USB_INTS_DEV_SUSPEND_BITS             USB_INTR_DEV_SUSPEND_BITS
+#define USB_INTS_DEV_RESUME_FROM_HOST_BITS    USB_INTR_DEV_RESUME_FROM_HOST_BITS
+#define USB_INTS_SETUP_REQ_BITS               USB_INTR_SETUP_REQ_BITS
+#define USB_INTS_DEV_SOF_BITS                 USB_INTR_DEV_SOF_BITS
+#define USB_INTS_ABORT_DONE_BITS              USB_INTR_ABORT_DONE_BITS
+#define USB_INTS_EP_STALL_NAK_BITS            USB_INTR_EP_STALL_NAK_BITS
+
+#endif
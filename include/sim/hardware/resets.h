@@ -0,0 +1,16 @@
+// =============================================================================
+// hardware/resets.h: Pico SDK resets for the simulated rp2040 (Linux build)
+// =============================================================================
+
+#ifndef _HARDWARE_RESETS_H
+#define _HARDWARE_RESETS_H
+
+#include "pico.h"
+
+#define RESETS_RESET_USBCTRL_BITS 0x01000000u
+
+void reset_block       (uint32_t bits);
+void unreset_block     (uint32_t bits);
+void unreset_block_wait(uint32_t bits);
+
+#endif
@@ -0,0 +1,133 @@
+// =============================================================================
+// hardware/structs/usb.h: USB controller and DPSRAM layout, as in the Pico SDK
+//
+// On the Pico, usb_hw and usb_dpram are fixed addresses. Here they are inside
+// a simulated controller (see sim.h), so a host and a device can each see
+// their own registers and DPSRAM in one Linux process.
+// =============================================================================
+
+#ifndef _HARDWARE_STRUCTS_USB_H
+#define _HARDWARE_STRUCTS_USB_H
+
+#include "pico.h"
+#include "hardware/regs/usb.h"
+
+#define USB_NUM_ENDPOINTS            16
+#define USB_HOST_INTERRUPT_ENDPOINTS (USB_NUM_ENDPOINTS - 1)
+#define USB_DPRAM_MAX                4096
+
+// ==[ Buffer and endpoint control ]============================================
+
+#define USB_BUF_CTRL_FULL                   0x00008000u
+#define USB_BUF_CTRL_LAST                   0x00004000u
+#define USB_BUF_CTRL_DATA0_PID              0x00000000u
+#define USB_BUF_CTRL_DATA1_PID              0x00002000u
+#define USB_BUF_CTRL_SEL                    0x00001000u
+#define USB_BUF_CTRL_STALL                  0x00000800u
+#define USB_BUF_CTRL_AVAIL                  0x00000400u
+#define USB_BUF_CTRL_LEN_MASK               0x000003ffu
+#define USB_BUF_CTRL_LEN_LSB                0
+
+#define EP_CTRL_ENABLE_BITS                 (1u << 31u)
+#define EP_CTRL_DOUBLE_BUFFERED_BITS        (1u << 30u)
+#define EP_CTRL_INTERRUPT_PER_BUFFER        (1u << 29u)
+#define EP_CTRL_INTERRUPT_PER_DOUBLE_BUFFER (1u << 28u)
+#define EP_CTRL_INTERRUPT_ON_NAK            (1u << 16u)
+#define EP_CTRL_INTERRUPT_ON_STALL          (1u << 17u)
+#define EP_CTRL_BUFFER_TYPE_LSB             26u
+#define EP_CTRL_HOST_INTERRUPT_INTERVAL_LSB 16u
+
+// ==[ DPSRAM ]=================================================================
+
+typedef struct {
+    volatile uint8_t setup_packet[8]; // First 8 bytes are always for setup
+
+    // Starts at EP1
+    struct usb_device_dpram_ep_ctrl {
+        io_rw_32 in;
+        io_rw_32 out;
+    } ep_ctrl[USB_NUM_ENDPOINTS - 1];
+
+    // Starts at EP0
+    struct usb_device_dpram_ep_buf_ctrl {
+        io_rw_32 in;
+        io_rw_32 out;
+    } ep_buf_ctrl[USB_NUM_ENDPOINTS];
+
+    // EP0 buffers are fixed (EP0 is single buffered)
+    uint8_t ep0_buf_a[0x40];
+    uint8_t ep0_buf_b[0x40];
+
+    // Rest of DPSRAM can be carved up as needed
+    uint8_t epx_data[USB_DPRAM_MAX - 0x180];
+} usb_device_dpram_t;
+
+typedef struct {
+    volatile uint8_t setup_packet[8]; // First 8 bytes are always for setup
+
+    // Interrupt endpoint control 1 -> 15
+    struct usb_host_dpram_ep_ctrl {
+        io_rw_32 ctrl;
+        io_rw_32 spare;
+    } int_ep_ctrl[USB_HOST_INTERRUPT_ENDPOINTS];
+
+    io_rw_32 epx_buf_ctrl;
+    io_rw_32 _spare0;
+
+    // Interrupt endpoint buffer control 1 -> 15
+    struct usb_host_dpram_ep_buf_ctrl {
+        io_rw_32 ctrl;
+        io_rw_32 spare;
+    } int_ep_buffer_ctrl[USB_HOST_INTERRUPT_ENDPOINTS];
+
+    io_rw_32 epx_ctrl;
+
+    uint8_t _spare1[124];
+
+    // Should start at 0x180
+    uint8_t epx_data[USB_DPRAM_MAX - 0x180];
+} usb_host_dpram_t;
+
+// ==[ Registers ]==============================================================
+
+typedef struct {
+    io_rw_32 dev_addr_ctrl;
+    io_rw_32 int_ep_addr_ctrl[USB_HOST_INTERRUPT_ENDPOINTS];
+    io_rw_32 main_ctrl;
+    io_wo_32 sof_wr;
+    io_ro_32 sof_rd;
+    io_rw_32 sie_ctrl;
+    io_rw_32 sie_status;
+    io_rw_32 int_ep_ctrl;
+    io_rw_32 buf_status;
+    io_ro_32 buf_cpu_should_handle;
+    io_rw_32 abort;
+    io_rw_32 abort_done;
+    io_rw_32 ep_stall_arm;
+    io_rw_32 nak_poll;
+    io_rw_32 ep_nak_stall_status;
+    io_rw_32 muxing;
+    io_rw_32 pwr;
+    io_rw_32 phy_direct;
+    io_rw_32 phy_direct_override;
+    io_rw_32 phy_trim;
+    uint32_t _pad0;
+    io_rw_32 intr;
+    io_rw_32 inte;
+    io_rw_32 intf;
+    io_rw_32 ints;
+} usb_hw_t;
+
+// Each side of a co-simulation is bound to its own controller at compile time,
+// just like the fixed addresses on the Pico (define SIM_CTRL to pick another)
+#ifndef SIM_CTRL
+#define SIM_CTRL sim_host
+#endif
+
+#include "sim.h"
+
+#define usb_hw     (&SIM_CTRL.regs.alias[0].hw)
+#define usb_dpram  ((usb_device_dpram_t *) SIM_CTRL.dpram)
+#define usbh_dpram ((usb_host_dpram_t   *) SIM_CTRL.dpram)
+
+#endif
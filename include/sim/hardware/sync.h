@@ -0,0 +1,76 @@
+// =============================================================================
+// hardware/sync.h: Pico SDK synchronization for the simulated rp2040 (Linux)
+//
+// Simulated interrupts are only delivered while a CPU waits, so code between
+// these calls already runs without being interrupted.
+//
+// Spin locks and barriers are real, so code that shares memory between the two
+// cores (such as src/host/ring.c) also works between Linux threads. Waiting
+// for an event gives the simulated hardware (or other threads) a chance to run.
+// =============================================================================
+
+#ifndef _HARDWARE_SYNC_H
+#define _HARDWARE_SYNC_H
+
+#include "pico.h"
+
+typedef volatile uint32_t spin_lock_t;
+
+enum {
+    NUM_SPIN_LOCKS                 = 32,
+    PICO_SPINLOCK_ID_STRIPED_FIRST = 16,
+    PICO_SPINLOCK_ID_STRIPED_LAST  = 23,
+};
+
+extern spin_lock_t sim_spin_locks[NUM_SPIN_LOCKS];
+extern uint64_t    sim_events; // Times __sev() was called
+
+static inline void __compiler_memory_barrier(void) {
+    __asm volatile ("" : : : "memory");
+}
+
+static inline void __dmb(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void __sev(void) {
+    sim_events++;
+}
+
+static inline void __wfe(void) {
+    tight_loop_contents();
+}
+
+static inline uint32_t save_and_disable_interrupts(void) {
+    return 0;
+}
+
+static inline void restore_interrupts(uint32_t status) {
+    (void) status;
+}
+
+static inline spin_lock_t *spin_lock_instance(uint lock_num) {
+    return &sim_spin_locks[lock_num];
+}
+
+static inline uint next_striped_spin_lock_num(void) {
+    static uint next = PICO_SPINLOCK_ID_STRIPED_FIRST;
+    uint num = next;
+    if (++next > PICO_SPINLOCK_ID_STRIPED_LAST)
+        next = PICO_SPINLOCK_ID_STRIPED_FIRST;
+    return num;
+}
+
+static inline uint32_t spin_lock_blocking(spin_lock_t *lock) {
+    uint32_t save = save_and_disable_interrupts();
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+        tight_loop_contents();
+    return save;
+}
+
+static inline void spin_unlock(spin_lock_t *lock, uint32_t saved_irq) {
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+    restore_interrupts(saved_irq);
+}
+
+#endif
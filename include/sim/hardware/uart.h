@@ -0,0 +1,52 @@
+// =============================================================================
+// hardware/uart.h: Pico SDK UARTs for the simulated rp2040 (Linux build)
+//
+// Only transmitting is modeled, and only by DMA (see hardware/dma.h). What is
+// sent goes to the console of the CPU that started it.
+// =============================================================================
+
+#ifndef _HARDWARE_UART_H
+#define _HARDWARE_UART_H
+
+#include "pico.h"
+
+#define NUM_UARTS 2
+
+typedef struct {
+    io_rw_32 dr; // Data register (the DMA writes bytes here)
+} uart_hw_t;
+
+typedef struct uart_inst uart_inst_t;
+
+extern uart_hw_t sim_uart_hw[NUM_UARTS];
+
+#define uart0 ((uart_inst_t *) &sim_uart_hw[0])
+#define uart1 ((uart_inst_t *) &sim_uart_hw[1])
+
+enum {
+    DREQ_UART0_TX = 20,
+    DREQ_UART0_RX = 21,
+    DREQ_UART1_TX = 22,
+    DREQ_UART1_RX = 23,
+};
+
+static inline uart_hw_t *uart_get_hw(uart_inst_t *uart) {
+    return (uart_hw_t *) uart;
+}
+
+static inline uint uart_get_index(uart_inst_t *uart) {
+    return uart_get_hw(uart) - sim_uart_hw;
+}
+
+static inline uart_inst_t *uart_get_instance(uint num) {
+    return (uart_inst_t *) &sim_uart_hw[num];
+}
+
+static inline uint uart_get_dreq(uart_inst_t *uart, bool is_tx) {
+    return DREQ_UART0_TX + uart_get_index(uart) * 2 + !is_tx;
+}
+
+uint uart_init(uart_inst_t *uart, uint baudrate);
+void uart_tx_wait_blocking(uart_inst_t *uart);
+
+#endif
@@ -0,0 +1,48 @@
+// =============================================================================
+// pico.h: Pico SDK platform definitions for the simulated rp2040 (Linux build)
+// =============================================================================
+
+#ifndef _PICO_H
+#define _PICO_H
+
+#include <assert.h>
+
+#include "pico/types.h"
+
+#ifndef MIN
+#define MIN(a, b) ((b) < (a) ? (b) : (a))
+#endif
+
+#ifndef MAX
+#define MAX(a, b) ((a) < (b) ? (b) : (a))
+#endif
+
+#define count_of(a) (sizeof(a) / sizeof((a)[0]))
+
+#define __not_in_flash_func(name) name
+#define __time_critical_func(name) name
+
+#define REG_ALIAS_RW_BITS  0x0000u
+#define REG_ALIAS_XOR_BITS 0x1000u
+#define REG_ALIAS_SET_BITS 0x2000u
+#define REG_ALIAS_CLR_BITS 0x3000u
+
+#define hw_xor_alias_untyped(addr) ((void *) (REG_ALIAS_XOR_BITS | (uintptr_t) (addr)))
+#define hw_set_alias_untyped(addr) ((void *) (REG_ALIAS_SET_BITS | (uintptr_t) (addr)))
+#define hw_clear_alias_untyped(addr) ((void *) (REG_ALIAS_CLR_BITS | (uintptr_t) (addr)))
+
+#define NUM_CORES 2
+
+void __attribute__ ((noreturn)) panic(const char *fmt, ...);
+
+// Core of the simulated CPU that is running (the host and device CPUs are
+// on rp2040s of their own, the host's can be core 1 with core 0 beside it)
+uint get_core_num(void);
+
+// Exception number being handled (0 in thread mode)
+uint __get_current_exception(void);
+
+// Busy loops give the simulated hardware a chance to run
+void tight_loop_contents(void);
+
+#endif
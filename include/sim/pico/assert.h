@@ -0,0 +1,10 @@
+// =============================================================================
+// pico/assert.h: Pico SDK assertions for the simulated rp2040 (Linux build)
+// =============================================================================
+
+#ifndef _PICO_ASSERT_H
+#define _PICO_ASSERT_H
+
+#include <assert.h>
+
+#endif
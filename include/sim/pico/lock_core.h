@@ -0,0 +1,31 @@
+// =============================================================================
+// pico/lock_core.h: Pico SDK lock core for the simulated rp2040 (Linux build)
+// =============================================================================
+
+#ifndef _PICO_LOCK_CORE_H
+#define _PICO_LOCK_CORE_H
+
+#include "pico.h"
+#include "hardware/sync.h"
+#include "pico/time.h"
+
+typedef struct {
+    spin_lock_t *spin_lock;
+} lock_core_t;
+
+static inline void lock_init(lock_core_t *core, uint lock_num) {
+    core->spin_lock = spin_lock_instance(lock_num);
+}
+
+#define lock_internal_spin_unlock_with_wait(lock, save) \
+    ({ spin_unlock((lock)->spin_lock, save); __wfe(); })
+
+#define lock_internal_spin_unlock_with_notify(lock, save) \
+    ({ spin_unlock((lock)->spin_lock, save); __sev(); })
+
+// True when until has passed (checked after waiting, as the SDK does)
+#define lock_internal_spin_unlock_with_best_effort_wait_or_timeout(lock, save, \
+                                                                   until) \
+    ({ spin_unlock((lock)->spin_lock, save); __wfe(); time_reached(until); })
+
+#endif
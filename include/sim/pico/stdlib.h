@@ -0,0 +1,27 @@
+// =============================================================================
+// pico/stdlib.h: Pico SDK stdlib for the simulated rp2040 (Linux build)
+//
+// Time is virtual and only moves when the simulated bus does work, when code
+// sleeps, or when console output is charged at the simulated UART baud rate.
+// =============================================================================
+
+#ifndef _PICO_STDLIB_H
+#define _PICO_STDLIB_H
+
+#include <stdio.h>
+
+#include "pico.h"
+
+uint64_t time_us_64(void);
+uint32_t time_us_32(void);
+
+void sleep_us(uint64_t us);
+void sleep_ms(uint32_t ms);
+void busy_wait_us(uint64_t us);
+
+// Console output costs virtual time, like printf over Serial1 on the Pico
+int sim_printf(const char *fmt, ...) __attribute__ ((format(printf, 1, 2)));
+
+#define printf sim_printf
+
+#endif
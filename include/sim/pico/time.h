@@ -0,0 +1,34 @@
+// =============================================================================
+// pico/time.h: Pico SDK timestamps for the simulated rp2040 (Linux build)
+//
+// An absolute_time_t is simply the timer in µs (time_us_64).
+// =============================================================================
+
+#ifndef _PICO_TIME_H
+#define _PICO_TIME_H
+
+#include "pico.h"
+
+#define nil_time           ((absolute_time_t) 0)
+#define at_the_end_of_time ((absolute_time_t) UINT64_MAX)
+
+uint64_t time_us_64(void);
+
+static inline absolute_time_t get_absolute_time(void) {
+    return time_us_64();
+}
+
+static inline absolute_time_t make_timeout_time_us(uint64_t us) {
+    uint64_t now = time_us_64();
+    return us < UINT64_MAX - now ? now + us : at_the_end_of_time;
+}
+
+static inline bool is_nil_time(absolute_time_t t) {
+    return t == nil_time;
+}
+
+static inline bool time_reached(absolute_time_t t) {
+    return time_us_64() >= t;
+}
+
+#endif
@@ -0,0 +1,32 @@
+// =============================================================================
+// pico/types.h: Pico SDK types for the simulated rp2040 (Linux build)
+// =============================================================================
+
+#ifndef _PICO_TYPES_H
+#define _PICO_TYPES_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef unsigned int uint;
+
+typedef volatile uint32_t       io_rw_32;
+typedef const volatile uint32_t io_ro_32;
+typedef volatile uint32_t       io_wo_32;
+typedef volatile uint16_t       io_rw_16;
+typedef const volatile uint16_t io_ro_16;
+typedef volatile uint8_t        io_rw_8;
+typedef const volatile uint8_t  io_ro_8;
+
+typedef uint64_t absolute_time_t;
+
+#ifndef __packed
+#define __packed __attribute__ ((packed))
+#endif
+
+#ifndef __aligned
+#define __aligned(x) __attribute__ ((aligned(x)))
+#endif
+
+#endif
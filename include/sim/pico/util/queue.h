@@ -0,0 +1,41 @@
+// =============================================================================
+// pico/util/queue.h: Pico SDK queue for the simulated rp2040 (Linux build)
+//
+// The simulation is single threaded, so no locking is needed. An empty queue
+// lets the simulated hardware run, since that is where new entries come from.
+// =============================================================================
+
+#ifndef _PICO_UTIL_QUEUE_H
+#define _PICO_UTIL_QUEUE_H
+
+#include "pico.h"
+
+typedef struct {
+    uint8_t  *data;
+    uint16_t  wptr;
+    uint16_t  rptr;
+    uint16_t  element_size;
+    uint16_t  element_count;
+} queue_t;
+
+void queue_init(queue_t *q, uint element_size, uint element_count);
+void queue_free(queue_t *q);
+
+uint queue_get_level(queue_t *q);
+
+bool queue_try_add   (queue_t *q, const void *data);
+bool queue_try_remove(queue_t *q, void *data);
+bool queue_try_peek  (queue_t *q, void *data);
+
+void queue_add_blocking   (queue_t *q, const void *data);
+void queue_remove_blocking(queue_t *q, void *data);
+
+static inline bool queue_is_empty(queue_t *q) {
+    return queue_get_level(q) == 0;
+}
+
+static inline bool queue_is_full(queue_t *q) {
+    return queue_get_level(q) == q->element_count;
+}
+
+#endif
@@ -0,0 +1,216 @@
+// =============================================================================
+// sim.h: Simulated rp2040 USB controllers for running PicoUSB on Linux
+//
+// The model keeps the USB registers and DPSRAM in ordinary memory, laid out
+// exactly like the hardware (including the XOR/SET/CLR register aliases). The
+// CPU side runs unchanged code against them. Whenever that code waits (polls
+// an empty queue, sleeps, or spins in tight_loop_contents), the model catches
+// up: it applies register writes, runs the SIE for one bus transaction, and
+// delivers USBCTRL_IRQ by calling the controller's interrupt handler.
+//
+// A host and a device can share the bus, each with its own controller and its
+// own simulated CPU (a cooperative context with a local clock). The CPU with
+// the earliest clock always runs next, so both sides make progress together.
+// The host CPU can also be core 1, with an application CPU as core 0 of the
+// same rp2040 that has no controller of its own.
+//
+// Time is virtual and deterministic. The bus is modeled at packet level with
+// 1 ms frames, so runs are repeatable and fast enough for benchmarks in CI.
+// Faults can be injected into transactions, as on a flaky cable, to see how
+// the host gets over them (the same ones each run).
+// =============================================================================
+
+#ifndef _SIM_H
+#define _SIM_H
+
+#include <stdio.h>
+
+#include "pico.h"
+#include "hardware/structs/usb.h"
+
+// ==[ Bus ]====================================================================
+
+enum { // Matches the SIE_STATUS.SPEED field in host mode
+    SIM_DISCONNECTED,
+    SIM_LOW_SPEED,
+    SIM_FULL_SPEED,
+};
+
+enum { // Outcome of a single bus transaction, as seen by the SIE
+    SIM_ACK,
+    SIM_NAK,
+    SIM_STALL,
+    SIM_TIMEOUT,
+};
+
+enum {
+    SIM_FRAME_NS = 1000000, // Full and low speed frames are 1 ms long
+};
+
+typedef struct sim_function sim_function_t;
+
+// A USB function (device) on the simulated bus
+struct sim_function {
+    const char *name;
+    uint8_t     speed  ; // SIM_LOW_SPEED or SIM_FULL_SPEED
+    uint8_t     address; // Current device address (0 until SET_ADDRESS)
+    void       *ctx    ; // Function specific state
+
+    // Bus reset and transaction handlers (return SIM_ACK, SIM_NAK, ...)
+    void    (*reset)(sim_function_t *fn);
+    uint8_t (*setup)(sim_function_t *fn, const uint8_t *pkt);
+    uint8_t (*in   )(sim_function_t *fn, uint8_t ep_num, uint8_t *buf,
+                     uint16_t *len, uint8_t *pid);
+    uint8_t (*out  )(sim_function_t *fn, uint8_t ep_num, const uint8_t *buf,
+                     uint16_t len, uint8_t pid);
+
+    // Hubs find the function behind their ports (NULL for other functions)
+    sim_function_t *(*route)(sim_function_t *fn, uint8_t dev_addr,
+                             bool preamble);
+};
+
+// ==[ Controller ]=============================================================
+
+typedef struct sim_cpu sim_cpu_t;
+
+typedef union {
+    usb_hw_t hw;
+    uint32_t word[0x400];
+} sim_regs_t;
+
+typedef struct {
+    sim_regs_t alias[4]; // Normal, XOR, SET and CLR aliases (4 KB apart)
+} __aligned(0x4000) sim_block_t;
+
+typedef struct {
+    bool     active  ; // A transaction was started with START_TRANS
+    bool     setup   ; // SETUP stage still needs to be sent
+    bool     in      ; // Data stage direction
+    uint8_t  dev_addr; // Target device address
+    uint8_t  ep_num  ; // Target endpoint number
+    uint8_t  buf_sel ; // Which half of the BCR the SIE works on next
+} sim_epx_t;
+
+typedef struct {
+    uint64_t due    ; // Frame when the endpoint is polled next
+    uint8_t  buf_sel; // Which half of the BCR gets the status (RP2040-E4)
+} sim_intep_t;
+
+typedef struct {
+    const char *name;
+    sim_cpu_t  *cpu  ; // CPU that owns this controller
+    uint64_t    valid; // CPU writes land when it next waits (bus time in ns)
+    sim_block_t regs;
+    uint8_t     dpram[USB_DPRAM_MAX] __aligned(USB_DPRAM_MAX);
+
+    // State owned by the controller (published into the registers)
+    uint32_t sie_status;
+    uint32_t buf_status;
+    uint32_t buf_cpu_should_handle;
+    uint32_t ep_nak_stall_status; // Polled slots that failed (as buf_status)
+    bool     conn_dis; // HOST_CONN_DIS is latched until SPEED is written
+
+    // Interrupts
+    bool     irq_enabled;
+    void   (*isr)(void);
+
+    // Host transaction engine
+    sim_epx_t   epx;
+    sim_intep_t intep[USB_HOST_INTERRUPT_ENDPOINTS]; // Polled endpoints
+
+    // Device controllers appear on the bus as a function
+    sim_function_t fn;
+} sim_ctrl_t;
+
+// ==[ CPU ]====================================================================
+
+struct sim_cpu {
+    const char *name;
+    sim_ctrl_t *ctrl   ; // USB controller used by this CPU
+    uint64_t    t      ; // Local clock, the CPU is busy until then
+    uint64_t    wake   ; // Waiting until then (0 = running)
+    bool        in_isr ; // Interrupt handler is running
+    uint32_t    baud   ; // Console speed for printf cost (0 = free)
+    FILE       *out    ; // Console output (NULL = discard)
+    uint64_t    console; // Characters printed
+    uint8_t     core   ; // Core number on its rp2040 (get_core_num)
+    uint64_t    isr_end; // When its interrupt handler last returned
+    uint64_t    isr_ns ; // Time spent in its interrupt handler
+
+    void      (*entry)(void); // Program for CPUs other than the host
+    void       *ctx          ; // Saved context while waiting
+};
+
+// ==[ Statistics ]=============================================================
+
+typedef struct {
+    uint64_t frames      ; // SOFs sent
+    uint64_t transactions; // Token packets sent, including retries
+    uint64_t naks        ; // Transactions answered with NAK
+    uint64_t stalls      ; // Transactions answered with STALL
+    uint64_t timeouts    ; // Transactions with no answer
+    uint64_t faults      ; // Faults injected (sim_options.faults)
+    uint64_t lost        ; // Polled transactions lost (sim_options.lossy)
+    uint64_t bytes_in    ; // Payload bytes from functions to the host
+    uint64_t bytes_out   ; // Payload bytes from the host to functions
+    uint64_t irqs        ; // Interrupt handler invocations
+    uint64_t isr_wait    ; // Time interrupts waited for their handler (ns)
+    uint64_t isr_wait_max; // Longest of those waits (ns)
+    uint64_t busiest     ; // Most transactions seen in any single frame
+    uint64_t busy_frames ; // Frames with at least one transaction
+    uint64_t console     ; // Characters printed by simulated code
+} sim_stats_t;
+
+// ==[ Options ]================================================================
+
+typedef struct {
+    uint32_t baud    ; // Default console speed for printf cost (0 = free)
+    uint32_t isr_ns  ; // CPU time charged for entering the interrupt handler
+    uint32_t poll_ns ; // CPU time charged for polling while the bus is idle
+    bool     quiet   ; // Discard console output (its cost is still charged)
+    bool     e4      ; // Emulate RP2040-E4 for single buffered endpoints
+    uint32_t faults  ; // One EPX transaction in this many goes wrong (0 = none)
+    uint32_t lossy   ; // One polled transaction in this many is lost
+} sim_options_t;
+
+extern sim_options_t sim_options;
+extern sim_stats_t   sim_stats;
+extern sim_ctrl_t    sim_host  , sim_device;
+extern sim_cpu_t     sim_host_cpu, sim_device_cpu;
+extern sim_cpu_t     sim_app_cpu; // Core 0 beside the host CPU (no controller)
+
+// ==[ API ]====================================================================
+
+void     sim_init(void);
+void     sim_reset(sim_ctrl_t *ctrl);
+void     sim_start(sim_cpu_t *cpu, void (*entry)(void));
+
+void     sim_attach(sim_function_t *fn);
+void     sim_detach(void);
+
+void     sim_poll(void);
+void     sim_run_until(uint64_t ns);
+void     sim_cpu_ns(uint64_t ns);
+void     sim_work_ns(uint64_t ns);
+
+uint64_t sim_time_ns(void);
+uint32_t sim_frame(void);
+
+void     sim_console(const void *buf, size_t len);
+
+// Functions available to attach
+enum {
+    SIM_LOOPBACK_FIFO = 65536, // Bytes the loopback holds between OUT and IN
+    SIM_HUB_PORTS     =     7, // Most ports on a hub
+};
+
+sim_function_t *sim_loopback(uint8_t speed, uint8_t maxsize0, uint16_t pad);
+sim_function_t *sim_hub(uint8_t ports);
+void            sim_hub_attach(sim_function_t *hub, uint8_t port,
+                               sim_function_t *fn);
+sim_function_t *sim_device_port(void);
+
+// Run src/device on the device CPU (attach sim_device_port() to connect it)
+void sim_device_start(void);
+
+#endif
@@ -1,3 +1,4 @@
+import os
 Import("env")
-env['PROJECT_SRC_DIR'] = env['PROJECT_DIR'] + "\\src\\" + env["PIOENV"]
-env['PROJECT_INCLUDE_DIR'] = env['PROJECT_DIR'] + "\\include\\" + env["PIOENV"]
\ No newline at end of file
+env['PROJECT_SRC_DIR'] = os.path.join(env['PROJECT_DIR'], "src", env["PIOENV"])
+env['PROJECT_INCLUDE_DIR'] = os.path.join(env['PROJECT_DIR'], "include", env["PIOENV"])
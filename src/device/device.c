@@ -97,6 +97,8 @@ static const struct usb_device_descriptor device_descriptor = {
 #include "hardware/irq.h" // For interrupt enable and numbers
 #include "hardware/resets.h" // For resetting the native USB controller
 
+#include "log.h" // Compile-time log levels
+
 #define usb_hw_set   ((usb_hw_t *) hw_set_alias_untyped  (usb_hw))
 #define usb_hw_clear ((usb_hw_t *) hw_clear_alias_untyped(usb_hw))
 
@@ -196,7 +198,7 @@ void usb_setup_endpoint(const struct usb_endpoint *ep) {
     uint8_t ep_addr = ep->descriptor->bEndpointAddress;
     uint8_t ep_num = ep_addr & 0x0f;
     bool in = ep_addr & USB_DIR_IN;
-    printf("Initialized EP%d_%s (0x%02x) with buffer address 0x%p\n",
+    xfer_debug("Initialized EP%d_%s (0x%02x) with buffer address 0x%p\n",
            ep_num, in ? "IN " : "OUT", ep_addr, ep->data_buffer);
 
     // Set ep_ctrl register for this endpoint (skip EP0 since it uses SIE_CTRL)
@@ -296,7 +298,7 @@ void usb_start_transfer(struct usb_endpoint *ep, uint8_t *buf, uint16_t len) {
 
 // Send a ZLP (zero length packet) to host
 void usb_send_zlp() {
-    printf("> ZLP\n");
+    enum_debug("> ZLP\n");
     usb_start_transfer(usb_get_endpoint(EP0_IN_ADDR), NULL, 0);
 }
 
@@ -434,20 +436,22 @@ void usb_handle_setup_packet() {
     uint8_t req = pkt->bRequest;
 
     // Log the behavior
+#if LOG_ENUM >= LOG_DEBUG
     printf("< Setup");
     hexdump((const void *) pkt, sizeof(struct usb_setup_packet), 2);
+#endif
 
     // Force a reset to DATA1 and handle the setup packet
     usb_get_endpoint(EP0_IN_ADDR)->next_datapid = 1;
     if (brt == USB_DIR_OUT) { // Standard device command
         if (req == USB_REQUEST_SET_ADDRESS) {
-            printf("Set address to %d\n", (pkt->wValue & 0xff));
+            enum_debug("Set address to %d\n", (pkt->wValue & 0xff));
             usb_set_device_address(pkt);
         } else if (req == USB_REQUEST_SET_CONFIGURATION) {
-            printf("Set configuration to %d\n", (pkt->wValue & 0xff));
+            enum_debug("Set configuration to %d\n", (pkt->wValue & 0xff));
             usb_set_device_configuration(pkt);
         } else {
-            printf("Unhandled device command\n");
+            enum_error("Unhandled device command\n");
         }
         usb_send_zlp();
     } else if (brt == USB_DIR_IN) { // Standard device request
@@ -457,28 +461,28 @@ void usb_handle_setup_packet() {
 
             switch (descriptor_type) {
                 case USB_DT_DEVICE:
-                    printf("Get device descriptor %d\n", index);
+                    enum_debug("Get device descriptor %d\n", index);
                     usb_send_device_descriptor(pkt);
                     break;
                 case USB_DT_CONFIG:
-                    printf("Get config descriptor %d\n", index);
+                    enum_debug("Get config descriptor %d\n", index);
                     usb_send_config_descriptor(pkt);
                     break;
                 case USB_DT_STRING:
-                    printf("Get string descriptor %d\n", index);
+                    enum_debug("Get string descriptor %d\n", index);
                     usb_send_string_descriptor(pkt);
                     break;
                 default:
-                    printf("Unhandled get descriptor\n");
+                    enum_error("Unhandled get descriptor\n");
             }
         } else if (req == USB_REQUEST_GET_CONFIGURATION) {
-            printf("Get configuration\n");
+            enum_debug("Get configuration\n");
             usb_send_configuration(pkt);
         } else {
-            printf("Unhandled device request\n");
+            enum_error("Unhandled device request\n");
         }
     } else {
-        printf("Unhandled setup packet\n");
+        enum_error("Unhandled setup packet\n");
     }
 }
 
@@ -489,16 +493,17 @@ inline static void usb_handle_ep_buff_done(struct usb_endpoint *ep) {
     uint32_t buffer_control = *ep->buffer_control;
     uint16_t len = buffer_control & USB_BUF_CTRL_LEN_MASK; // Get buffer length
 
-    // TODO: Logging inside an ISR is bad, fix this soon
+    // Logging inside an ISR is slow, so this is only compiled in for debug
+#if LOG_XFER >= LOG_DEBUG
     if (len) {
         uint8_t ep_addr = ep->descriptor->bEndpointAddress;
-        uint8_t ep_num = ep_addr & 0x0f;
         bool in = ep_addr & USB_DIR_IN;
 
         // Show the communication details
         printf("%c 0x%02x", in ? '>' : '<', ep_addr);
         hexdump((uint8_t *) ep->data_buffer, len, 1);
     }
+#endif
 
     ep->handler((uint8_t *) ep->data_buffer, len); // Call buffer done handler
 }
@@ -529,7 +534,7 @@ enum {
 
 // Reset USB bus
 void usb_bus_reset() {
-    printf("< Reset\n");
+    enum_info("< Reset\n");
     device_address = 0; // Set address to zero
     usb_hw->dev_addr_ctrl = 0;
     should_set_address = false;
@@ -563,7 +568,7 @@ void usb_device_reset() {
                         USB_INTE_DEV_SUSPEND_BITS                | // Suspend signal
                         USB_INTE_DEV_RESUME_FROM_HOST_BITS       ; // Resume signal
 
-    printf("\nUSB device reset\n\n");
+    xfer_info("\nUSB device reset\n\n");
     irq_set_enabled(USBCTRL_IRQ, true);
     usb_hw_set->sie_ctrl = USB_SIE_CTRL_PULLUP_EN_BITS; // "Attach" the device
 }
@@ -618,7 +623,7 @@ void setup() {
     while (!configured) { tight_loop_contents(); }
     sleep_ms(500); // brief pause
 
-    printf("\nUSB device configured\n\n");
+    enum_info("\nUSB device configured\n\n");
 
     // Prepare for up to 64 bytes from host on EP1_OUT
     usb_start_transfer(usb_get_endpoint(EP1_OUT_ADDR), NULL, 64);
@@ -0,0 +1,137 @@
+// =============================================================================
+// drain.c: Console output streamed through a UART by DMA (see drain.h)
+//
+// Lines are put together from as many printf calls as it takes, then go into
+// a ring whole, or are dropped whole when it is full, so printing never waits
+// and the reader never sees part of a line. drain_task() moves up to DRAIN_CHUNK bytes at a time into a
+// frame and hands it to the DMA channel, which is paced by the UART's TX DREQ
+// and runs on its own while the CPU gets back to USB.
+// =============================================================================
+
+#include <stdio.h>                // For vsnprintf
+#include <stdarg.h>               // For va_list
+
+#include "pico/stdlib.h"          // Pico stdlib
+#include "hardware/dma.h"         // DMA channels
+#include "hardware/uart.h"        // UART
+#include "hardware/gpio.h"        // Pin functions
+#include "hardware/sync.h"        // Spin locks
+
+#include "ring.h"                 // Rings
+#include "drain.h"                // Frames
+
+drain_stats_t drain_stats;
+
+enum {
+    DRAIN_LINE = 256, // Longest line, a longer one is cut where it fills this
+};
+
+// A line being put together, one for thread code and one for interrupt
+// handlers on each core, so they don't end up in each other's lines
+typedef struct {
+    char     buf[DRAIN_LINE];
+    uint16_t len;
+} drain_line_t;
+
+static ring_t           *drain_ring;
+static uart_inst_t      *drain_uart;
+static int               drain_dma = -1;
+static uint8_t           drain_seq;
+static spin_lock_t      *drain_lock; // Both cores count lost lines
+static volatile uint32_t drain_lost; // Lines dropped, not reported in a frame yet
+static drain_line_t      drain_lines[NUM_CORES][2];
+static uint8_t           drain_frame[sizeof(drain_header_t) + DRAIN_CHUNK + 1];
+static uint8_t           drain_crc[256];
+
+void drain_init(uint8_t uart_num, uint8_t tx_pin, uint32_t baud,
+                uint16_t ring_size) {
+    drain_uart = uart_get_instance(uart_num);
+    uart_init(drain_uart, baud);
+    gpio_set_function(tx_pin, GPIO_FUNC_UART);
+
+    // Bytes go one at a time from the frame to the UART's data register, as
+    // fast as its TX FIFO takes them
+    drain_dma = dma_claim_unused_channel(true);
+    dma_channel_config cfg = dma_channel_get_default_config(drain_dma);
+    channel_config_set_transfer_data_size(&cfg, DMA_SIZE_8);
+    channel_config_set_read_increment(&cfg, true);
+    channel_config_set_write_increment(&cfg, false);
+    channel_config_set_dreq(&cfg, uart_get_dreq(drain_uart, true));
+    dma_channel_configure(drain_dma, &cfg, &uart_get_hw(drain_uart)->dr,
+                          drain_frame, 0, false);
+
+    drain_lock = spin_lock_instance(next_striped_spin_lock_num());
+    drain_crc_table(drain_crc);
+    drain_ring = ring_new(ring_size);
+}
+
+// Add to the caller's line, which goes into the ring once its \n is in (a
+// printf can end more than one, they go together). Returns -1 if the lines
+// were dropped, like printf after an output error.
+int drain_printf(const char *fmt, ...) {
+    if (!drain_ring) return -1; // Not started
+    drain_line_t *line = &drain_lines[get_core_num()]
+                                     [__get_current_exception() != 0];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line->buf + line->len, DRAIN_LINE - line->len, fmt,
+                        args);
+    va_end(args);
+    if (len < 0) return len;
+    line->len = MIN(line->len + len, DRAIN_LINE - 1);
+    if (!line->len || (line->buf[line->len - 1] != '\n' &&
+                       line->len < DRAIN_LINE - 1)) return len;
+
+    // Count every line that doesn't fit
+    uint16_t size = line->len;
+    line->len = 0;
+    if (ring_try_write_all(drain_ring, line->buf, size)) return len;
+    uint32_t lost = 0;
+    for (uint16_t i = 0; i < size; i++) lost += line->buf[i] == '\n';
+    lost += line->buf[size - 1] != '\n'; // Cut short
+    uint32_t save = spin_lock_blocking(drain_lock);
+    drain_lost       += lost;
+    drain_stats.lost += lost;
+    spin_unlock(drain_lock, save);
+    return -1;
+}
+
+bool drain_task(void) {
+    if (drain_dma < 0) return false;
+    if (dma_channel_is_busy(drain_dma)) return true;
+
+    // Take what is waiting (or just report lines that were lost)
+    drain_header_t *hdr = (drain_header_t *) drain_frame;
+    uint8_t        *txt = drain_frame + sizeof(drain_header_t);
+    uint16_t        len = ring_try_read(drain_ring, txt, DRAIN_CHUNK);
+    if (!len && !drain_lost) return false;
+
+    uint32_t save = spin_lock_blocking(drain_lock);
+    uint16_t lost = MIN(drain_lost, UINT16_MAX);
+    drain_lost   -= lost;
+    spin_unlock(drain_lock, save);
+    *hdr = (drain_header_t) {
+        .sync = { DRAIN_SYNC0, DRAIN_SYNC1 },
+        .seq  = drain_seq++,
+        .len  = len,
+        .lost = lost,
+    };
+
+    // The CRC covers the header and the text
+    uint8_t  crc  = 0;
+    uint16_t size = sizeof(drain_header_t) + len;
+    for (uint16_t i = 0; i < size; i++) crc = drain_crc[crc ^ drain_frame[i]];
+    drain_frame[size++] = crc;
+
+    dma_channel_transfer_from_buffer_now(drain_dma, drain_frame, size);
+    drain_stats.bytes  += len;
+    drain_stats.frames += 1;
+    return true;
+}
+
+void drain_flush(void) {
+    while (drain_task()) tight_loop_contents();
+    if (drain_uart) uart_tx_wait_blocking(drain_uart);
+}
+
+// =============================================================================
@@ -13,27 +13,114 @@
 #include <string.h>               // For memcpy
 
 #include "pico/stdlib.h"          // Pico stdlib
-#include "pico/util/queue.h"      // Multicore and IRQ safe queue
 #include "hardware/regs/usb.h"    // USB hardware registers from pico-sdk
 #include "hardware/structs/usb.h" // USB hardware structs from pico-sdk
 #include "hardware/irq.h"         // Interrupts and definitions
 #include "hardware/resets.h"      // Resetting the native USB controller
+#include "hardware/sync.h"        // Interrupt masking (trace, timers)
+#include "hardware/flash.h"       // Keeping the descriptor cache in flash
 
 #include "usb_common.h"           // USB 2.0 definitions
+#include "drain.h"                // Console output through DMA
+
+// With USER_DRAIN, console output is queued for the DMA instead of waiting
+// on the UART (this comes first so the helpers print that way too)
+#if defined(USER_DRAIN) && USER_DRAIN
+#undef  printf
+#define printf drain_printf
+#endif
+
 #include "helpers.h"              // Helper functions
+#include "log.h"                  // Compile-time log levels
+#include "trace.h"                // Binary trace records
+#include "ring.h"                 // Rings that IN data can land in
 
 // ==[ PicoUSB ]================================================================
 
-// User defined limits
-#define USER_HUBS      0
-#define USER_DEVICES   2 // Not including dev0
-#define USER_ENDPOINTS 4 // Not including any EP0s
+// User defined limits (each can be overridden with a build flag)
+#ifndef USER_HUBS
+#define USER_HUBS      1 // Not including the root port
+#endif
+#ifndef USER_DEVICES
+#define USER_DEVICES   4 // Not including dev0 or hubs
+#endif
+#ifndef USER_ENDPOINTS
+#define USER_ENDPOINTS 4 // Not including any EP0s or hub status endpoints
+#endif
+#ifndef USER_CTRL_BUF
+#define USER_CTRL_BUF  1024 // Largest control transfer into ctrl_buf
+#endif
+#ifndef USER_CACHE
+#define USER_CACHE     4 // Devices kept in the descriptor cache (0 = none)
+#endif
+#ifndef USER_CACHE_FLASH
+#define USER_CACHE_FLASH 0 // Flash sector to save the cache in (0 = RAM only)
+#endif
+#ifndef USER_FAST_ENUM
+#define USER_FAST_ENUM 0 // Speculative enumeration with fewer control transfers
+#endif
+#ifndef USER_TASKS
+#define USER_TASKS     64 // Tasks the ISR can queue for usb_task (power of 2)
+#endif
+#ifndef USER_TASK_DROP
+#define USER_TASK_DROP 0 // When the task ring is full: 0 = panic, 1 = drop
+#endif
+#ifndef USER_RETRIES
+#define USER_RETRIES   3 // Retries after a timeout or DATA0/DATA1 error
+#endif
+#ifndef USER_DEADLINE
+#define USER_DEADLINE  1000 // Bulk transfers stuck this many ms end (0 = never)
+#endif
+#ifndef USER_CORE1
+#define USER_CORE1     0 // Run USB on core1 and leave core0 to the application
+#endif
+#ifndef USER_DRAIN
+#define USER_DRAIN     0 // Console baud through DMA, e.g. 3000000 (0 = printf)
+#endif
+#ifndef USER_DRAIN_UART
+#define USER_DRAIN_UART 1 // UART for USER_DRAIN (Serial1 is UART0 on GP0)
+#endif
+#ifndef USER_DRAIN_TX
+#define USER_DRAIN_TX  4 // TX pin of that UART
+#endif
+#ifndef USER_DRAIN_RING
+#define USER_DRAIN_RING 32768 // Bytes of console output the DMA can fall behind
+#endif
+
+#if USER_HUBS + USER_DEVICES > 127
+#error "USB allows at most 127 devices (including hubs)"
+#endif
+#if 1 + USER_HUBS * 2 + USER_DEVICES + USER_ENDPOINTS > 255
+#error "At most 255 endpoints (they are looked up by an 8-bit index)"
+#endif
+#if USER_CORE1 && USER_CACHE_FLASH
+#error "USER_CACHE_FLASH can't be used with USER_CORE1 (core0 runs from flash)"
+#endif
+#if USER_TASKS & (USER_TASKS - 1)
+#error "USER_TASKS must be a power of 2"
+#endif
 
 enum {
-    MAX_DEVICES   =   1 + USER_DEVICES,
-    MAX_ENDPOINTS =   1 + USER_DEVICES + USER_ENDPOINTS,
+    MAX_DEVICES   =   1 + USER_HUBS + USER_DEVICES,
+    MAX_ENDPOINTS =   1 + USER_HUBS * 2 + USER_DEVICES + USER_ENDPOINTS,
     MAX_POLLED    =  15, // Maximum polled endpoints
-    MAX_TEMP      = 255, // Must be 255 or less
+    MAX_QUEUED    =   4, // Transfers queued per endpoint behind the active one
+    MAX_CTRL_QUEUED = 4, // Control transfers queued per device (strings + hub)
+    EPX_SLICE     =  16, // Packets sent before yielding EPX to others waiting
+    RETRY_MS      =   1, // Backoff before the second retry (doubles after)
+    MAX_INTERFACES =  8, // Interfaces per device that can have a driver
+    MAX_PORTS     =   7, // Ports per hub (the status bitmap is one byte)
+    MAX_TASKS     = USER_TASKS, // Tasks waiting for usb_task
+    MAX_CTRL      = USER_CTRL_BUF, // Size of the shared control buffer
+    MAX_TEMP      = 255, // Scratch size (enough for any string descriptor)
+};
+
+enum { // USB 2.0 timing in ms (7.1.7.3 and 9.2.6)
+    ATTACH_MS     = 100, // Connect debounce before the port is reset (TATTDB)
+    RESET_MS      =  10, // Bus reset held by the hardware (TDRST)
+    RECOVERY_MS   =  10, // Reset recovery before the first request (TRSTRCY)
+    ADDRESS_MS    =   2, // SET_ADDRESS recovery before the next request
+    CTRL_DEADLINE_MS = 500, // Control transfers stuck this long end
 };
 
 #define MAKE_U16(x, y) (((x) << 8) | ((y)     ))
@@ -51,31 +138,141 @@ enum {
 #define usb_hw_clear ((usb_hw_t *) hw_clear_alias_untyped(usb_hw))
 #define usb_hw_set   ((usb_hw_t *) hw_set_alias_untyped  (usb_hw))
 
-// TODO: Add debug levels: 0=none, 1=errors, 2=info, 3=debug
 // const char *box = "┌─┬┐"  // ╔═╦╗ // ┏━┳┓ // ╭─┬╮ // 0 1 2 3
 //                   "│ ││"  // ║ ║║ // ┃ ┃┃ // │ ││ // 4 5 6 7
 //                   "├─┼┤"  // ╠═╬╣ // ┣━╋┫ // ├─┼┤ // 8 9 a b
 //                   "└─┴┘"; // ╚═╩╝ // ┗━┻┛ // ╰─┴╯ // c d e f
 
-static uint8_t ctrl_buf[MAX_TEMP]; // Buffer for control transfers (shared)
+static uint8_t ctrl_buf[MAX_CTRL]; // Buffer for control transfers (shared)
 static uint8_t temp_buf[MAX_TEMP]; // TODO: Where is this needed???
 
 void usb_task(); // Forward declaration
+bool needs_preamble(uint8_t dev_addr); // Forward declaration
+
+// ==[ Timers ]=================================================================
+
+// Everything USB waits for (retry backoffs, transfer deadlines, port resets and
+// recovery, hub delays) is a timer on a wheel of WHEEL_SLOTS lists, one per
+// tick of the 1 MHz timer shifted down by WHEEL_SHIFT (fine enough for 1 ms
+// backoffs). A timer is linked into the slot of the tick it's due, so starting
+// or cancelling one takes the same time however many are waiting, and
+// usb_task() only looks at the slots of the ticks that went by since its last
+// pass. Timers due more than a turn of the wheel away stay in their slot until
+// their turn comes. They're started from the interrupt handler too, so the
+// lists are changed with interrupts masked, but they are always called from
+// usb_task(), never from an alarm interrupt.
+
+enum {
+    WHEEL_SHIFT   =   7, // Timer µs per tick (as a shift, 128 µs)
+    WHEEL_SLOTS   = 128, // Ticks in a turn of the wheel (power of 2, 16 ms)
+};
+
+typedef struct later later_t;
+
+struct later {
+    later_t   *next      ; // Next timer in its slot
+    later_t  **pprev     ; // What points to this one (NULL = not waiting)
+    uint32_t   due       ; // Tick it's due
+    void     (*fn)(void *); // Called once it's due
+    void      *arg       ; // Passed to fn
+};
+
+static later_t *wheel[WHEEL_SLOTS];
+static uint32_t wheel_tick ; // Last tick usb_task() has seen
+static uint16_t wheel_count; // Timers waiting
+
+SDK_INLINE uint32_t tick_now() {
+    return (uint32_t) (time_us_64() >> WHEEL_SHIFT);
+}
+
+SDK_INLINE bool later_waiting(later_t *t) {
+    return t->pprev;
+}
+
+SDK_INLINE void later_unlink(later_t *t) {
+    if (t->next) t->next->pprev = t->pprev;
+    *t->pprev = t->next;
+    t->next   = NULL;
+    t->pprev  = NULL;
+    wheel_count--;
+}
+
+// Stop a timer, if it's waiting
+void cancel_later(later_t *t) {
+    uint32_t save = save_and_disable_interrupts();
+    if (later_waiting(t)) later_unlink(t);
+    restore_interrupts(save);
+}
+
+// Call fn(arg) from usb_task() once at least ms have passed, without blocking
+// until then (a timer that's waiting already starts over)
+void call_later(later_t *t, void (*fn)(void *), void *arg, uint32_t ms) {
+    uint64_t us   = time_us_64() + ms * 1000 + (1u << WHEEL_SHIFT); // Round up
+    uint32_t save = save_and_disable_interrupts();
+    if (later_waiting(t)) later_unlink(t);
+
+    t->due   = (uint32_t) (us >> WHEEL_SHIFT); // A tick that's still to come
+    t->fn    = fn;
+    t->arg   = arg;
+    t->pprev = &wheel[t->due % WHEEL_SLOTS];
+    t->next  = *t->pprev;
+    if (t->next) t->next->pprev = &t->next;
+    *t->pprev = t;
+    wheel_count++;
+    restore_interrupts(save);
+}
+
+// Call the timers that are due, in the slots of the ticks since the last pass
+// (all of them once the wheel has gone round). A call can start or cancel any
+// timer, so its slot is looked at from the start again after each one.
+SDK_INLINE void call_due() {
+    uint32_t now = tick_now();
+    uint32_t n   = MIN(now - wheel_tick, WHEEL_SLOTS);
+
+    for (uint32_t i = 1; i <= n && wheel_count; i++) {
+        later_t **slot = &wheel[(wheel_tick + i) % WHEEL_SLOTS];
+        for (;;) {
+            uint32_t save = save_and_disable_interrupts();
+            later_t *t    = *slot;
+            while (t && (int32_t) (t->due - now) > 0) t = t->next;
+            if (!t) {
+                restore_interrupts(save);
+                break;
+            }
+            later_unlink(t);
+            void (*fn)(void *) = t->fn;
+            void  *arg         = t->arg;
+            restore_interrupts(save);
+            fn(arg);
+        }
+    }
+    wheel_tick = now;
+}
 
 // ==[ Endpoints ]==============================================================
 
-typedef void (*endpoint_c)(uint8_t *buf, uint16_t len);
+typedef struct endpoint endpoint_t;
 
-typedef struct {
+// Called when a transfer is done, with its status (TRANSFER_SUCCESS, ...) and
+// the bytes transferred into or out of buf (for control, in the data stage)
+typedef void (*endpoint_c)(endpoint_t *ep, uint8_t status, uint8_t *buf,
+                           uint32_t len);
+
+// What the interrupt handler uses for every packet. It's kept small, with
+// the byte fields first, since Cortex-M0+ loads and stores only reach 32
+// bytes (or 64 for halfwords) into a struct in a single instruction.
+struct endpoint {
     uint8_t    dev_addr  ; // Device address // HOST ONLY
     uint8_t    ep_addr   ; // Endpoint address
     uint8_t    type      ; // Transfer type: control/bulk/interrupt/isochronous
-    uint16_t   maxsize   ; // Maximum packet size
-    uint16_t   interval  ; // Polling interval in ms
     uint8_t    data_pid  ; // Toggle between DATA0/DATA1 packets
-    bool       configured; // Endpoint is configured
     bool       active    ; // Transfer is active
     bool       setup     ; // Setup packet flag
+    bool       zlp       ; // Control transfer is in its status stage
+    bool       yielding  ; // Turn on EPX ends after the buffers prepared
+    uint8_t    slice     ; // Packets left in this turn on EPX
+    uint16_t   maxsize   ; // Maximum packet size
+    uint16_t   interval  ; // Polling interval in ms
 
     // Hardware registers and data buffer
     io_rw_32  *ecr       ; // Endpoint control register
@@ -85,12 +282,68 @@ typedef struct {
 
     // Shared with application code
     uint8_t   *user_buf  ; // User buffer in DPSRAM, RAM, or flash
-    uint16_t   bytes_left; // Bytes left to transfer
-    uint16_t   bytes_done; // Bytes done transferring
+    uint32_t   bytes_left; // Bytes left to transfer
+    uint32_t   bytes_done; // Bytes done transferring
+    ring_t    *ring      ; // IN data lands here instead (see endpoint_ring)
+    spsc_t    *spsc      ; // Or here, with no lock (see endpoint_spsc)
+};
+
+// The rest of an endpoint, used once per transfer or less (ep_info() has it)
+typedef struct {
+    bool       configured; // Endpoint is configured
     endpoint_c cb        ; // Callback function
-} endpoint_t;
 
-static endpoint_t eps[MAX_ENDPOINTS], *epx = eps;
+    // Transfers waiting behind the active one (bulk only)
+    struct {
+        uint8_t *buf;
+        uint32_t len;
+    }          queue[MAX_QUEUED];
+    uint8_t    queue_head;
+    uint8_t    queued    ; // Transfers in the queue
+
+    // Sharing EPX
+    bool       waiting   ; // Waiting for its turn on EPX
+    uint8_t    tries     ; // Retries of the current transfer (or its halt) so far
+    later_t    deadline  ; // Ends the transfer if it's stuck (see deadline_start)
+    uint32_t   moved     ; // Progress when the deadline was started
+    uint32_t   xfers     ; // Transfers completed (for throughput reports)
+    uint32_t   turns     ; // Turns taken on EPX
+    uint64_t   bytes     ; // Bytes transferred
+} endpoint_info_t;
+
+static endpoint_t      eps     [MAX_ENDPOINTS], *epx = eps;
+static endpoint_info_t ep_infos[MAX_ENDPOINTS];
+static endpoint_t     *polled  [MAX_POLLED]; // Endpoints by int_ep_ctrl slot
+
+// Endpoints by device address, endpoint number and direction (as an index in
+// eps, 0 = none), so finding one takes the same time with any number of them.
+// EP0 is in both directions, since control transfers use it both ways.
+static uint8_t ep_table[MAX_DEVICES][16][2];
+
+SDK_INLINE endpoint_info_t *ep_info(endpoint_t *ep) {
+    return &ep_infos[ep - eps];
+}
+
+// EPX is shared by every endpoint that is not polled, one turn at a time.
+// Endpoints that find it busy wait, and take turns in the order they started
+// waiting. A turn ends after EPX_SLICE packets when others are waiting, or at
+// the end of the transfer. Bulk transfers hand EPX on from the interrupt
+// handler, so the bus stays busy. Control transfers hand it on from usb_task()
+// after they are handled, so the data they left in ctrl_buf is used first.
+// Since the interrupt handler starts, queues and hands on transfers too, task
+// code changes all of this (and the transfers queued on an endpoint) only with
+// interrupts masked.
+static endpoint_t *epx_owner;   // Endpoint using EPX
+static uint8_t     epx_queue[MAX_ENDPOINTS]; // Endpoints waiting (eps index)
+static uint8_t     epx_head;    // Next one to have a turn
+static uint8_t     epx_waiters; // Endpoints waiting for EPX
+
+// A transfer on EPX that failed waits on this timer for its backoff to pass,
+// keeping EPX meanwhile (only the owner of EPX can fail, so there's one at most)
+static later_t retry;
+
+void epx_forget(endpoint_t *ep); // Forward declaration
+void tasks_forget(endpoint_t *ep); // Forward declaration
 
 SDK_INLINE const char *ep_dir(endpoint_t *ep) {
     return ep->ep_addr & USB_DIR_IN ? "IN" : "OUT";
@@ -110,11 +363,9 @@ SDK_INLINE void show_endpoint(endpoint_t *ep) {
 
 SDK_INLINE void clear_endpoint(endpoint_t *ep) {
     ep->active     = false;
-    ep->data_pid   = 0;
 
-    // Transfer state
+    // Transfer state (data_pid and user_buf carry over to the next transfer)
     ep->setup      = false;
-    ep->user_buf   = NULL;
     ep->bytes_left = 0;
     ep->bytes_done = 0;
 }
@@ -123,6 +374,8 @@ void setup_endpoint(endpoint_t *ep, usb_endpoint_descriptor_t *usb,
                     uint8_t *user_buf) {
 
     // Populate the endpoint (clears all fields not present)
+    epx_forget(ep);
+    *ep_info(ep) = (endpoint_info_t) { .configured = true };
     *ep = (endpoint_t) {
         .dev_addr = ep->dev_addr,
         .ep_addr  = usb->bEndpointAddress,
@@ -133,17 +386,18 @@ void setup_endpoint(endpoint_t *ep, usb_endpoint_descriptor_t *usb,
     };
 
     // Setup the necessary registers and data buffer pointer
+    int8_t slot = -1; // Polled endpoint slot
     if (ep->interval) {
         if (!ep_num(ep)) panic("EP0 cannot be polled");
-        uint8_t most = MIN(USER_ENDPOINTS, MAX_POLLED);
-        for (uint8_t i = 0; i < most; i++) {
-            if (usbh_dpram->int_ep_ctrl[i].ctrl) continue; // Skip if being used
+        for (uint8_t i = 0; i < MAX_POLLED; i++) {
+            if (polled[i]) continue; // Skip if being used
             ep->ecr = &usbh_dpram->int_ep_ctrl       [i].ctrl;
             ep->bcr = &usbh_dpram->int_ep_buffer_ctrl[i].ctrl;
             ep->buf = &usbh_dpram->epx_data[(i + 2) * 64]; // Can't do ISO?
+            slot    = i;
             break;
         }
-        if (!ep->ecr) panic("No free polled endpoints remaining");
+        if (slot < 0) panic("No free polled endpoints remaining");
     } else {
         ep->ecr = &usbh_dpram->epx_ctrl;
         ep->bcr = &usbh_dpram->epx_buf_ctrl;
@@ -165,39 +419,129 @@ void setup_endpoint(endpoint_t *ep, usb_endpoint_descriptor_t *usb,
                     | (ms ? ms - 1 : 0) << lsb            // Polling time in ms
                     | offset;                             // Data buffer offset
 
-    // Set the ECR and mark this endpoint as configured
+    // Set the ECR
    *ep->ecr = ecr;
-    ep->configured = true;
+
+    // Polled endpoints are sent by the hardware whenever their buffer is armed
+    if (slot >= 0) {
+        uint8_t  lsb = USB_ADDR_ENDP1_ENDPOINT_LSB;
+        uint32_t dir = ep_in(ep) ? 0 : USB_ADDR_ENDP1_INTEP_DIR_BITS;
+        uint32_t pre = needs_preamble(ep->dev_addr)
+                     ? USB_ADDR_ENDP1_INTEP_PREAMBLE_BITS : 0;
+        usb_hw->int_ep_addr_ctrl[slot] = ep->dev_addr | ep_num(ep) << lsb
+                                       | dir | pre;
+        usb_hw_set->int_ep_ctrl = 1u << (slot + 1); // Bit 0 is not used
+        polled[slot] = ep;
+    }
 }
 
-endpoint_t *find_endpoint(uint8_t dev_addr, uint8_t ep_addr) {
+SDK_INLINE uint8_t *ep_slot(uint8_t dev_addr, uint8_t ep_addr) {
+    if (dev_addr >= MAX_DEVICES) panic("Device %u does not exist", dev_addr);
+    return &ep_table[dev_addr][ep_addr & 0x0f][ep_addr >> 7];
+}
+
+// The endpoint at an address, or NULL if there's none (the interrupt handler
+// can see the address of one that was freed while its transaction ended)
+endpoint_t *lookup_endpoint(uint8_t dev_addr, uint8_t ep_addr) {
     bool want_ep0 = !(ep_addr & ~USB_DIR_IN);
     if (!dev_addr && want_ep0) return epx;
 
-    for (uint8_t i = 1; i < MAX_ENDPOINTS; i++) {
-        endpoint_t *ep = &eps[i];
-        if (ep->configured && ep->dev_addr == dev_addr) {
-            if (want_ep0 && !(ep->ep_addr & ~USB_DIR_IN)) return ep;
-            if (ep->ep_addr == ep_addr) return ep;
-        }
-    }
-    panic("Invalid endpoint 0x%02x for device %u", ep_addr, dev_addr);
-    return NULL;
+    uint8_t i = *ep_slot(dev_addr, ep_addr);
+    return i ? &eps[i] : NULL;
+}
+
+endpoint_t *find_endpoint(uint8_t dev_addr, uint8_t ep_addr) {
+    endpoint_t *ep = lookup_endpoint(dev_addr, ep_addr);
+    if (!ep) panic("Invalid endpoint 0x%02x for device %u", ep_addr, dev_addr);
+    return ep;
 }
 
+// Endpoints that are free are kept on a stack (eps index), taken from the top
+static uint8_t ep_free[MAX_ENDPOINTS];
+static uint8_t ep_frees;
+
 endpoint_t *next_endpoint(uint8_t dev_addr, usb_endpoint_descriptor_t *usb,
                           uint8_t *user_buf) {
+    if (!ep_frees) panic("No free endpoints remaining");
+
+    uint8_t     i  = ep_free[--ep_frees];
+    endpoint_t *ep = &eps[i];
+    ep->dev_addr = dev_addr;
+    setup_endpoint(ep, usb, user_buf);
+
+    uint8_t ep_addr = usb->bEndpointAddress;
+    *ep_slot(dev_addr, ep_addr) = i;
+    if (!(ep_addr & ~USB_DIR_IN)) *ep_slot(dev_addr, ep_addr ^ USB_DIR_IN) = i;
+    return ep;
+}
+
+// Wait for a turn on EPX
+SDK_INLINE void epx_wait(endpoint_t *ep) {
+    endpoint_info_t *info = ep_info(ep);
+    if (info->waiting) return;
+    info->waiting = true;
+    epx_queue[(epx_head + epx_waiters++) % MAX_ENDPOINTS] = ep - eps;
+}
 
-    for (uint8_t i = 1; i < MAX_ENDPOINTS; i++) {
-        endpoint_t *ep = &eps[i];
-        if (!ep->configured) {
-            ep->dev_addr = dev_addr;
-            setup_endpoint(ep, usb, user_buf);
-            return ep;
+// Forget any use of EPX by an endpoint
+void epx_forget(endpoint_t *ep) {
+    endpoint_info_t *info = ep_info(ep);
+    uint32_t         save = save_and_disable_interrupts();
+    if (epx_owner == ep) epx_owner = NULL;
+    if (retry.arg == ep) cancel_later(&retry);
+    cancel_later(&info->deadline);
+    if (info->waiting) {
+        info->waiting = false;
+
+        // Close the gap it leaves in the queue
+        uint8_t n = 0;
+        for (uint8_t k = 0; k < epx_waiters; k++) {
+            uint8_t i = epx_queue[(epx_head + k) % MAX_ENDPOINTS];
+            if (&eps[i] != ep) epx_queue[(epx_head + n++) % MAX_ENDPOINTS] = i;
         }
+        epx_waiters = n;
     }
-    panic("No free endpoints remaining");
-    return NULL;
+    restore_interrupts(save);
+}
+
+// Stop the transaction on EPX, wait until the SIE has let go of it, and drop
+// what it left for the interrupt handler about it
+void epx_stop() {
+    uint64_t limit = time_us_64() + 1000; // Transactions take much less
+    usb_hw_set->sie_ctrl = USB_SIE_CTRL_STOP_TRANS_BITS;
+    while ((usb_hw->sie_ctrl & (USB_SIE_CTRL_START_TRANS_BITS |
+                                USB_SIE_CTRL_STOP_TRANS_BITS)) &&
+           time_us_64() < limit) tight_loop_contents();
+    usb_hw_clear->sie_status = USB_SIE_STATUS_TRANS_COMPLETE_BITS;
+    usb_hw_clear->buf_status = 1u; // EPX
+}
+
+// Release an endpoint and stop polling it. One that's using EPX is stopped
+// first, so the hardware is done with it before it's gone (an interrupt for
+// it that's still pending finds no endpoint, and is ignored). A polled slot's
+// buffer status is cleared with it, in case its buffer was just done.
+void free_endpoint(endpoint_t *ep) {
+    if (ep == epx_owner && ep->active) epx_stop();
+
+    uint8_t ep_addr = ep->ep_addr;
+    *ep_slot(ep->dev_addr, ep_addr) = 0;
+    if (!(ep_addr & ~USB_DIR_IN)) *ep_slot(ep->dev_addr, ep_addr ^ USB_DIR_IN) = 0;
+    ep_free[ep_frees++] = ep - eps;
+
+    epx_forget(ep);
+    tasks_forget(ep);
+    for (uint8_t i = 0; i < MAX_POLLED; i++) {
+        if (polled[i] != ep) continue;
+        usb_hw_clear->int_ep_ctrl              = 1u << (i + 1);
+        usb_hw->int_ep_addr_ctrl[i]            = 0;
+        usbh_dpram->int_ep_ctrl[i].ctrl        = 0;
+        usbh_dpram->int_ep_buffer_ctrl[i].ctrl = 0;
+        usb_hw_clear->buf_status               = 3u << (i * 2 + 2);
+        usb_hw_clear->ep_nak_stall_status      = 3u << (i * 2 + 2);
+        polled[i] = NULL;
+    }
+    memclr(ep_info(ep), sizeof(endpoint_info_t));
+    memclr(ep, sizeof(endpoint_t));
 }
 
 void reset_epx() {
@@ -211,12 +555,119 @@ void reset_epx() {
     }), NULL);
 }
 
-// Clear out all endpoints
+// Clear out all endpoints and stop polling
 void reset_endpoints() {
+    usb_hw->int_ep_ctrl = 0;
+    for (uint8_t i = 0; i < MAX_POLLED; i++) {
+        usb_hw->int_ep_addr_ctrl[i]            = 0;
+        usbh_dpram->int_ep_ctrl[i].ctrl        = 0;
+        usbh_dpram->int_ep_buffer_ctrl[i].ctrl = 0;
+    }
+    usb_hw_clear->buf_status          = ~3u; // Anything the slots had done
+    usb_hw_clear->ep_nak_stall_status = ~3u;
+    memclr(polled, sizeof(polled));
+    for (uint8_t i = 0; i < MAX_ENDPOINTS; i++)
+        cancel_later(&ep_infos[i].deadline);
     memclr(eps, sizeof(eps));
+    memclr(ep_infos, sizeof(ep_infos));
+    memclr(ep_table, sizeof(ep_table));
+    epx_owner   = NULL;
+    epx_head    = 0;
+    epx_waiters = 0;
+    cancel_later(&retry);
     reset_epx();
+
+    // Lower indexes are handed out first
+    ep_frees = 0;
+    for (uint8_t i = MAX_ENDPOINTS - 1; i; i--) ep_free[ep_frees++] = i;
+}
+
+// ==[ Trace ]==================================================================
+
+#if LOG_ISR >= LOG_DEBUG
+
+static struct {
+    trace_t           rec[TRACE_RECORDS];
+    volatile uint32_t head; // Next record to fill (ISR and task code)
+    volatile uint32_t tail; // Next record to send (usb_task only)
+    volatile uint32_t lost; // Records dropped because the ring was full
+} trace;
+
+// Claim and stamp the next record, returns NULL when the ring is full
+trace_t *trace_new(uint8_t event, endpoint_t *ep, uint8_t arg, uint32_t num) {
+    uint32_t save = save_and_disable_interrupts(); // Task code traces too
+    uint32_t head = trace.head;
+    if (head - trace.tail >= TRACE_RECORDS) {
+        trace.lost++;
+        restore_interrupts(save);
+        return NULL;
+    }
+    trace.head = head + 1;
+    restore_interrupts(save);
+
+    trace_t *t  = &trace.rec[head & (TRACE_RECORDS - 1)];
+    t->time     = time_us_32();
+    t->frame    = usb_hw->sof_rd;
+    t->event    = event;
+    t->arg      = arg;
+    t->dev_addr = ep ? ep->dev_addr : 0;
+    t->ep_addr  = ep ? ep->ep_addr  : 0;
+    t->len      = 0;
+    t->num      = num;
+    return t;
+}
+
+// Record data bytes, using as many records as needed
+void trace_data(uint8_t label, endpoint_t *ep, const void *data, uint16_t len) {
+    for (uint16_t pos = 0; pos < len; pos += TRACE_BYTES) {
+        trace_t *t = trace_new(TRACE_DATA, ep, label, pos);
+        if (!t) return;
+        t->len = MIN(TRACE_BYTES, len - pos);
+        memcpy(t->data, (const uint8_t *) data + pos, t->len);
+    }
+}
+
+// Send one record to the console as a "#T" line of hex words
+void trace_send(const trace_t *t) {
+    const uint32_t *word = (const uint32_t *) t;
+
+    printf("#T");
+    for (uint8_t i = 0; i < TRACE_WORDS; i++) printf(" %08x", word[i]);
+    printf("\n");
+}
+
+// Send pending records to the console (decode them with tools/tracedump)
+void trace_flush() {
+    static uint32_t reported; // Dropped records already reported
+
+    uint32_t lost = trace.lost;
+    if (lost != reported) {
+        trace_send(&((trace_t) {
+            .time  = time_us_32(),
+            .event = TRACE_LOST,
+            .num   = lost - reported,
+        }));
+        reported = lost;
+    }
+
+    uint32_t head = trace.head;
+    __compiler_memory_barrier(); // Read the records only after the head
+    while (trace.tail != head) {
+        trace_send(&trace.rec[trace.tail & (TRACE_RECORDS - 1)]);
+        trace.tail++;
+    }
 }
 
+#else // Tracing is compiled out, calls are optimized away
+
+SDK_INLINE trace_t *trace_new(uint8_t event, endpoint_t *ep, uint8_t arg,
+                              uint32_t num) { return NULL; }
+SDK_INLINE void trace_data(uint8_t label, endpoint_t *ep, const void *data,
+                           uint16_t len) {}
+SDK_INLINE void trace_flush() {}
+
+#endif
+
 // ==[ Buffers ]================================================================
 
 enum { // Used to mask availability in the BCR (enum resolves at compile time)
@@ -232,11 +683,27 @@ uint16_t read_buffer(endpoint_t *ep, uint8_t buf_id, uint32_t bcr) {
     // Inbound buffers must be full and outbound buffers must be empty
     assert(in == full);
 
-    // If we are reading data, copy it from the data buffer to the user buffer
+    // If we are reading data, copy it from the data buffer to the user buffer,
+    // or straight into the ring's storage (split where the ring wraps), where
+    // a framed ring keeps each packet as a record, or into a lock-free ring
     if (in && len) {
-        uint8_t *ptr = &ep->user_buf[ep->bytes_done];
-        memcpy(ptr, (void *) (ep->buf + buf_id * 64), len);
-        hexdump(buf_id ? "│IN/2" : "│IN/1", ptr, len, 1); // ~7.5 ms
+        uint8_t *src = (uint8_t *) ep->buf + buf_id * 64;
+        if (ep->ring) { // Only armed with room for it (see ring_room)
+            ring_t     *ring = ep->ring;
+            ring_span_t span[2];
+            if (ring->framed ? !ring_reserve_record(ring, span, len)
+                             : ring_reserve(ring, span, len) < len)
+                show_endpoint(ep), panic("Ring overflow");
+            memcpy(span[0].ptr, src, span[0].len);
+            memcpy(span[1].ptr, src + span[0].len, span[1].len);
+            if (ring->framed) ring_commit_record(ring, len);
+            else              ring_commit       (ring, len);
+        } else if (ep->spsc) { // Only armed with room for it too
+            spsc_try_write(ep->spsc, src, len);
+        } else {
+            memcpy(&ep->user_buf[ep->bytes_done], src, len);
+        }
+        trace_data(buf_id ? TRACE_IN2 : TRACE_IN1, ep, src, len); // hexdump was ~7.5 ms
         ep->bytes_done += len;
     }
 
@@ -251,10 +718,40 @@ uint16_t read_buffer(endpoint_t *ep, uint8_t buf_id, uint32_t bcr) {
     return len;
 }
 
+// Count a packet against the endpoint's turn on EPX, true when it's the last
+SDK_INLINE bool turn_over(endpoint_t *ep) {
+    if (ep->interval || ep->type == USB_TRANSFER_TYPE_CONTROL) return false;
+    if (--ep->slice) return false;
+
+    ep->slice = EPX_SLICE; // Nobody waiting means another turn
+    return ep->yielding = epx_waiters;
+}
+
+// Whether the ring an IN endpoint fills has room for count more packets (and
+// their record headers when it's framed), always true without a ring
+SDK_INLINE bool ring_room(endpoint_t *ep, uint8_t count) {
+    if (ep->spsc) return spsc_free(ep->spsc) >= count * ep->maxsize;
+    if (!ep->ring) return true;
+    ring_span_t span[2];
+    uint32_t    need = count * (ep->maxsize
+                     + (ep->ring->framed ? RING_RECORD_HEADER : 0));
+    return ring_reserve(ep->ring, span, MIN(need, UINT16_MAX)) >= need;
+}
+
+// Whether the ring is too full for the packet after this buffer (counting the
+// ones armed before it), which ends the turn, so the device keeps the rest
+// until the reader has made room (see transfer)
+SDK_INLINE bool ring_backs_up(endpoint_t *ep, uint8_t buf_id) {
+    if (ring_room(ep, buf_id + 2)) return false;
+    return ep->yielding = true;
+}
+
 // Prepare a buffer and return its half of the BCR
 uint16_t prep_buffer(endpoint_t *ep, uint8_t buf_id) {
     bool     in  = ep_in(ep);                         // Buffer is inbound
-    bool     mas = ep->bytes_left > ep->maxsize;      // Any more packets?
+    bool     mas = ep->bytes_left > ep->maxsize       // Any more packets?
+                && !turn_over(ep)                     // And still our turn?
+                && !ring_backs_up(ep, buf_id);        // And room for them?
     uint8_t  pid = ep->data_pid;                      // Set DATA0/DATA1
     uint16_t len = MIN(ep->maxsize, ep->bytes_left);  // Buffer length
     uint16_t bcr = (in  ? 0 : USB_BUF_CTRL_FULL)      // IN/Recv=0, OUT/Send=1
@@ -271,7 +768,7 @@ uint16_t prep_buffer(endpoint_t *ep, uint8_t buf_id) {
     if (!in && len) {
         uint8_t *ptr = &ep->user_buf[ep->bytes_done];
         memcpy((void *) (ep->buf + buf_id * 64), ptr, len);
-        hexdump(buf_id ? "│OUT/2" : "│OUT/1", ptr, len, 1);
+        trace_data(buf_id ? TRACE_OUT2 : TRACE_OUT1, ep, ptr, len);
         ep->bytes_done += len;
     }
 
@@ -287,7 +784,7 @@ void send_buffers(endpoint_t *ep) {
     uint32_t bcr = prep_buffer(ep, 0);
 
     // Set ECR and BCR based on whether the transfer should be double buffered
-    if (~bcr & USB_BUF_CTRL_LAST) {
+    if (~bcr & USB_BUF_CTRL_LAST && !ep->interval) { // Polled are single
         ecr |= EP_CTRL_DOUBLE_BUFFERED_BITS;
         bcr |= prep_buffer(ep, 1) << 16;
     } else {
@@ -302,8 +799,8 @@ void send_buffers(endpoint_t *ep) {
     *ep->bcr = bcr;
 }
 
-// Processes buffers in ISR context
-void handle_buffers(endpoint_t *ep) {
+// Processes buffers in ISR context (bit is the endpoint's BUF_STATUS bit)
+void handle_buffers(endpoint_t *ep, uint32_t bit) {
     if (!ep->active) show_endpoint(ep), panic("Halted");
 
     // Read current buffer(s)
@@ -314,12 +811,35 @@ void handle_buffers(endpoint_t *ep) {
             read_buffer(ep, 1, bcr >> 16);            // Then, read second also
     } else {                                          // When single buffered...
         uint32_t bch = usb_hw->buf_cpu_should_handle; // Check CPU handling bits
-        if (bch & 1u) bcr >>= 16;                     // Do RP2040-E4 workaround
+        if (bch & bit) bcr >>= 16;                    // Do RP2040-E4 workaround
         read_buffer(ep, 0, bcr);                      // And read the one buffer
     }
 
     // Send next buffer(s)
-    if (ep->bytes_left) send_buffers(ep);
+    if (ep->bytes_left && !ep->yielding) send_buffers(ep);
+}
+
+// Take back the buffer(s) a failed transaction left behind. Any that went
+// through before it are kept (IN data is read), and the rest are counted as
+// not sent, so the transfer can go on from there with the DATA0/DATA1 of the
+// first packet that is sent again.
+void rewind_buffers(endpoint_t *ep) {
+    bool     in   = ep_in(ep);
+    bool     dub  = *ep->ecr & EP_CTRL_DOUBLE_BUFFERED_BITS;
+    uint32_t bcr  = *ep->bcr;
+    bool     sent = true; // Buffers go out in order
+
+    for (uint8_t i = 0; i < (dub ? 2 : 1); i++, bcr >>= 16) {
+        uint16_t len = bcr & USB_BUF_CTRL_LEN_MASK;
+        if (sent && !(bcr & USB_BUF_CTRL_AVAIL)) {   // Went through
+            if (in) read_buffer(ep, i, bcr);
+            continue;
+        }
+        if (sent) ep->data_pid = bcr & USB_BUF_CTRL_DATA1_PID ? 1 : 0;
+        sent = false;
+        ep->bytes_left += len;                       // Not sent
+        if (!in) ep->bytes_done -= len;
+    }
 }
 
 // ==[ Devices ]================================================================
@@ -351,6 +871,28 @@ typedef struct {
     uint8_t  manufacturer; // String index of manufacturer
     uint8_t  product     ; // String index of product
     uint8_t  serial      ; // String index of serial number
+    uint8_t  hub_addr    ; // Hub the device is attached to (0 = root port)
+    uint8_t  hub_port    ; // Port on that hub
+    uint8_t  itf2drv[MAX_INTERFACES]; // Driver for each interface (index + 1)
+
+    // Each device enumerates on its own (dev0 until the address is set)
+    uint8_t  step        ; // Next enumeration step
+    uint8_t  new_addr    ; // Address being assigned (dev0 only)
+    uint8_t  strings     ; // Strings looked at so far (to show them)
+    uint8_t  pending     ; // Strings still being read (fast path)
+    bool     mounting    ; // Counted by mount_begin() until enumerated
+    struct cache *cache  ; // Cache entry being used or filled (NULL = none)
+    usb_setup_packet_t setup; // Setup packet of the current control transfer
+    uint16_t ctrl_len    ; // Bytes in its data stage (reported when it's done)
+
+    // Control transfers waiting for EP0, started in order as each one is done
+    uint8_t  ctrl_head   ;
+    uint8_t  ctrl_queued ;
+    struct {
+        usb_setup_packet_t setup;
+        uint8_t           *buf;
+        endpoint_c         cb;
+    } ctrl_queue[MAX_CTRL_QUEUED];
 } device_t;
 
 static device_t devices[MAX_DEVICES], *dev0 = devices;
@@ -362,6 +904,12 @@ SDK_INLINE device_t *get_device(uint8_t dev_addr) {
     return NULL;
 }
 
+// Low speed devices behind a (full speed) hub need a PREAMBLE for each packet
+bool needs_preamble(uint8_t dev_addr) {
+    device_t *dev = get_device(dev_addr);
+    return dev->speed == LOW_SPEED && dev->hub_addr;
+}
+
 // Find the next device address
 uint8_t next_dev_addr() {
     for (uint8_t i = 1; i < MAX_DEVICES; i++) {
@@ -374,13 +922,14 @@ uint8_t next_dev_addr() {
     return 0;
 }
 
-// Reset a device
+void mount_end(); // Forward declaration
+
+// Reset a device, one that was still enumerating no longer counts as mounting
 void reset_device(uint8_t dev_addr) {
     device_t *dev = get_device(dev_addr);
-    memclr(dev, sizeof(device_t));
-    // TODO: Surely, there must be more work to do here?
-    // memset(dev->itf2drv, TUSB_INDEX_INVALID_8, sizeof(dev->itf2drv));
-    // memset(dev->ep2drv , TUSB_INDEX_INVALID_8, sizeof(dev->ep2drv ));
+    bool mounting = dev->mounting;
+    memclr(dev, sizeof(device_t)); // Also unbinds drivers (itf2drv is 0)
+    if (mounting) mount_end();
 }
 
 // Clear out all devices
@@ -391,13 +940,22 @@ void reset_devices() {
 // ==[ Transfers ]==============================================================
 
 enum {
-    TRANSFER_SUCCESS, // not used yet
-    TRANSFER_FAILED,  // not used yet
-    TRANSFER_STALLED, // not used yet
-    TRANSFER_TIMEOUT, // not used yet
-    TRANSFER_INVALID, // not used yet
+    TRANSFER_SUCCESS,
+    TRANSFER_FAILED,  // DATA0/DATA1 still wrong after every retry
+    TRANSFER_STALLED, // The device stalled (or halted the endpoint)
+    TRANSFER_TIMEOUT, // No answer after every retry
+    TRANSFER_INVALID, // The data is more than the host can take
 };
 
+// How transfers got over errors
+static struct {
+    uint32_t retries ; // Times a transfer was sent again after an error
+    uint32_t failures; // Transfers that ended with an error
+    uint32_t halts   ; // Halts cleared after them
+    uint32_t reaped  ; // Transfers ended by their deadline
+    uint32_t polled  ; // Errors not on EPX (polled ones are tried again)
+} xfer_stats;
+
 enum {
     USB_SIE_CTRL_BASE = USB_SIE_CTRL_PULLDOWN_EN_BITS   // Ready for devices
                       | USB_SIE_CTRL_VBUS_EN_BITS       // Supply VBUS
@@ -405,12 +963,46 @@ enum {
                       | USB_SIE_CTRL_SOF_EN_BITS        // Enable full speed
 };
 
-// TODO: Clear a stall and toggle data PID back to DATA0
 // TODO: Abort a transfer if not yet started and return true on success
 
+bool complete_transfer(endpoint_t *ep, uint8_t status); // Forward declaration
+
 void transfer(endpoint_t *ep) {
+
+    // Polled endpoints only need their buffer, the hardware does the rest (one
+    // whose ring is full can't wait for EPX, so its transfer ends right away)
+    if (ep->interval) {
+        ep->active   = true;
+        ep->yielding = false;
+        if (ep->bytes_left && !ring_room(ep, 1)) {
+            complete_transfer(ep, TRANSFER_INVALID);
+            return;
+        }
+        send_buffers(ep);
+        return;
+    }
+
+    // Wait for EPX if another endpoint is using it, or for the reader to make
+    // room in the endpoint's ring (epx_next() tries it again on every pass of
+    // usb_task, and meanwhile the next one in line gets EPX)
+    if ((epx_owner && epx_owner != ep) ||
+        (ep->bytes_left && !ring_room(ep, 1))) {
+        ep->active = true;
+        epx_wait(ep);
+        return;
+    }
+    epx_owner = ep;
+    if (ep->type != USB_TRANSFER_TYPE_CONTROL) ep->slice = EPX_SLICE;
+    ep->yielding = false;
+    ep_info(ep)->turns++;
+
     bool in = ep_in(ep);
     bool su = ep->setup && !ep->bytes_done; // Start of a SETUP packet
+    bool ls = needs_preamble(ep->dev_addr);  // Low speed behind a hub
+
+    // Copy the setup packet (it waited in the device while EPX was busy)
+    if (su) memcpy((void *) usbh_dpram->setup_packet,
+                   &get_device(ep->dev_addr)->setup, sizeof(usb_setup_packet_t));
 
     // If there's no data phase, flip the endpoint direction
     if (!ep->bytes_left) {
@@ -422,33 +1014,30 @@ void transfer(endpoint_t *ep) {
     uint8_t  lsb = USB_ADDR_ENDP_ENDPOINT_LSB;       // LSB for the ep_num
     uint32_t dar = ep->dev_addr | ep_num(ep) << lsb; // Has dev_addr and ep_num
     uint32_t scr = USB_SIE_CTRL_BASE                 // SIE_CTRL defaults
- //   | (ls  ? 0 : USB_SIE_CTRL_PREAMBLE_EN_BITS)    // Preamble (LS on FS hub)
+      | (!ls ? 0 : USB_SIE_CTRL_PREAMBLE_EN_BITS)    // Preamble (LS on FS hub)
       | (!su ? 0 : USB_SIE_CTRL_SEND_SETUP_BITS)     // Toggle SETUP packet
       | (in  ?     USB_SIE_CTRL_RECEIVE_DATA_BITS    // Receive bit means IN
                  : USB_SIE_CTRL_SEND_DATA_BITS)      // Send bit means OUT
       |            USB_SIE_CTRL_START_TRANS_BITS;    // Start the transfer now
 
     // Debug output
+#if LOG_XFER >= LOG_DEBUG
     if (ep->setup || (*ep->bcr & 0x3f)) {
-        printf("\n");
-        printf( "┌───────┬──────┬─────────────────────────────────────┬────────────┐\n");
-        printf( "│Frame  │ %4u │ %-35s", usb_hw->sof_rd, "Transfer started");
-        show_endpoint(ep);
-        printf( "├───────┼──────┼─────────────────────────────────────┼────────────┤\n");
-        bindump("│DAR", usb_hw->dev_addr_ctrl);
-        bindump("│SSR", usb_hw->sie_status);
-        bindump("│SCR", usb_hw->sie_ctrl);
-        bindump("│ECR", *ep->ecr);
-        bindump("│BCR", *ep->bcr);
+        trace_t *t = trace_new(TRACE_START, ep, ep->setup, 0);
+        if (t) {
+            t->reg[0] = usb_hw->dev_addr_ctrl;
+            t->reg[1] = usb_hw->sie_status;
+            t->reg[2] = usb_hw->sie_ctrl;
+            t->reg[3] = *ep->ecr;
+            t->reg[4] = *ep->bcr;
+        }
         if (ep->setup) {
             uint32_t *packet = (uint32_t *) usbh_dpram->setup_packet;
-            printf( "├───────┼──────┼─────────────────────────────────────┴────────────┤\n");
-            hexdump("│SETUP", packet, sizeof(usb_setup_packet_t), 1);
-            printf( "└───────┴──────┴──────────────────────────────────────────────────┘\n");
-        } else {
-            printf( "└───────┴──────┴─────────────────────────────────────┴────────────┘\n");
+            trace_data(TRACE_SETUP, ep, packet, sizeof(usb_setup_packet_t));
         }
+        trace_new(TRACE_END, ep, ep->setup, 0);
     }
+#endif
 
     // Mark the endpoint as active
     ep->active = true;
@@ -460,35 +1049,291 @@ void transfer(endpoint_t *ep) {
     usb_hw->sie_ctrl      = scr;
 }
 
+// Give EPX to the endpoint that has waited longest for it, if it's free (one
+// whose ring is still full goes to the back of the line)
+void epx_next() {
+    uint32_t save = save_and_disable_interrupts(); // usb_task() calls it too
+    for (uint8_t n = epx_waiters; !epx_owner && n; n--) {
+        uint8_t i = epx_queue[epx_head];
+        epx_head = (epx_head + 1) % MAX_ENDPOINTS;
+        epx_waiters--;
+        ep_infos[i].waiting = false;
+        transfer(&eps[i]);
+    }
+    restore_interrupts(save);
+}
+
+// Send a transfer again after an error, from where it stopped (transfer()
+// flips the direction of one without a data phase, so flip it back first)
+void transfer_retry(endpoint_t *ep) {
+    if (!ep->bytes_left) ep->ep_addr ^= USB_DIR_IN;
+    transfer(ep);
+}
+
+// Retry the transfer on EPX once its backoff has passed
+void retry_over(void *arg) {
+    uint32_t save = save_and_disable_interrupts();
+    transfer_retry((endpoint_t *) arg);
+    restore_interrupts(save);
+}
+
+// What a transfer has done so far (it changes with every packet)
+SDK_INLINE uint32_t ep_moved(endpoint_t *ep) {
+    endpoint_info_t *info = ep_info(ep);
+    return info->xfers + (uint32_t) info->bytes + ep->bytes_done;
+}
+
+void deadline_passed(void *arg);
+
+// Watch an endpoint's transfers, so one the device NAKs (or ignores) forever
+// can't keep EPX from the rest. Polled endpoints are left alone, since the
+// hardware only asks them at their interval.
+void deadline_start(endpoint_t *ep) {
+    endpoint_info_t *info = ep_info(ep);
+    uint32_t ms = ep->type == USB_TRANSFER_TYPE_CONTROL ? CTRL_DEADLINE_MS
+                                                        : USER_DEADLINE;
+    if (ep->interval || !ms || later_waiting(&info->deadline)) return;
+
+    info->moved = ep_moved(ep);
+    call_later(&info->deadline, deadline_passed, ep, ms);
+}
+
+// The deadline passed. A transfer that has EPX but hasn't moved since then is
+// stopped and ends with a timeout (a bulk endpoint is halted, as after any
+// failed transfer), otherwise the endpoint is watched for another period.
+void deadline_passed(void *arg) {
+    endpoint_t      *ep   = (endpoint_t *) arg;
+    endpoint_info_t *info = ep_info(ep);
+    uint32_t         save = save_and_disable_interrupts(); // ISR moves it too
+
+    if (ep == epx_owner && ep->active && ep_moved(ep) == info->moved &&
+        !later_waiting(&retry)) {
+        xfer_error("Transfer on EP%u %s of device %u is stuck\n", ep_num(ep),
+                   ep_dir(ep), ep->dev_addr);
+        epx_stop();
+        if (ep == epx_owner && ep->active) { // It may have ended meanwhile
+            rewind_buffers(ep);
+            xfer_stats.reaped++;
+            complete_transfer(ep, TRANSFER_TIMEOUT);
+        }
+    } else if (ep->active) {
+        deadline_start(ep);
+    }
+    restore_interrupts(save);
+}
+
 void transfer_zlp(void *arg) {
-    endpoint_t *ep = (endpoint_t *) arg;
+    endpoint_t *ep   = (endpoint_t *) arg;
+    uint32_t    save = save_and_disable_interrupts(); // Also a task callback
 
     // Send the ZLP transfer
     ep->data_pid = 1;
     transfer(ep);
+    restore_interrupts(save);
 }
 
-void control_transfer(endpoint_t *ep, usb_setup_packet_t *setup) {
+// Control transfer with a data stage in a caller owned buffer (wLength bytes).
+// It returns right away, and usb_task() calls cb once the status stage is done.
+// Control transfers on a device are serial, so one started while another is
+// active waits behind it and starts when usb_task() has reported that one
+void control_transfer_buf(endpoint_t *ep, usb_setup_packet_t *setup,
+                          uint8_t *buf, endpoint_c cb) {
     if ( ep_num(ep))     panic("Control transfers must use EP0");
-    if (!ep->configured) panic("Endpoint not configured");
-    if ( ep->active)     panic("Control transfers per device must be serial");
+    if (!ep_info(ep)->configured) panic("Endpoint not configured");
     if ( ep->type)       panic("Control transfers require a control endpoint");
 
-    // Copy the setup packet
-    memcpy((void*) usbh_dpram->setup_packet, setup, sizeof(usb_setup_packet_t));
+    // Queue it behind the active transfer
+    device_t *dev = get_device(ep->dev_addr);
+    if (ep->active) {
+        if (dev->ctrl_queued == MAX_CTRL_QUEUED)
+            panic("Too many control transfers queued");
+        uint8_t i = (dev->ctrl_head + dev->ctrl_queued++) % MAX_CTRL_QUEUED;
+        dev->ctrl_queue[i].setup = *setup;
+        dev->ctrl_queue[i].buf   = buf;
+        dev->ctrl_queue[i].cb    = cb;
+        return;
+    }
+
+    // Keep the setup packet until the transfer starts
+    dev->setup    = *setup;
+    dev->ctrl_len = 0;
 
     // Send the control transfer
+    ep_info(ep)->cb = cb;
     ep->setup      = true;
+    ep->zlp        = false;
     ep->data_pid   = 1;
     ep->ep_addr    = setup->bmRequestType & USB_DIR_IN;
+    ep->user_buf   = buf;
     ep->bytes_left = setup->wLength;
     ep->bytes_done = 0;
+    deadline_start(ep);
+    uint32_t save = save_and_disable_interrupts();
+    transfer(ep);
+    restore_interrupts(save);
+}
+
+// Start the next control transfer queued on a device, if there is one
+void control_next(endpoint_t *ep) {
+    device_t *dev = get_device(ep->dev_addr);
+    if (!dev->ctrl_queued || ep->active) return;
+
+    uint8_t i = dev->ctrl_head;
+    dev->ctrl_head = (i + 1) % MAX_CTRL_QUEUED;
+    dev->ctrl_queued--;
+    control_transfer_buf(ep, &dev->ctrl_queue[i].setup, dev->ctrl_queue[i].buf,
+                         dev->ctrl_queue[i].cb);
+}
+
+// Control transfer with a data stage in the shared ctrl_buf (cb must use the
+// data before it returns, since the next control transfer can overwrite it)
+void control_transfer(endpoint_t *ep, usb_setup_packet_t *setup,
+                      endpoint_c cb) {
+    if (setup->wLength > MAX_CTRL) panic("Control transfer too large");
+
+    control_transfer_buf(ep, setup, ctrl_buf, cb);
+}
+
+// Bulk transfer of any length, the ISR refills EPX buffers until it is done.
+// Transfers on an active endpoint are queued and started in order.
+void bulk_transfer(endpoint_t *ep, uint8_t *buf, uint32_t len) {
+    if (!ep_info(ep)->configured) panic("Endpoint not configured");
+    if (!len)            panic("Bulk transfers require a data phase");
+    if (ep->type != USB_TRANSFER_TYPE_BULK)
+                         panic("Bulk transfers require a bulk endpoint");
+
+    // Queue it behind the active transfer (the ISR may finish that one and
+    // take the next from the queue meanwhile, so both are done masked)
+    endpoint_info_t *info = ep_info(ep);
+    uint32_t         save = save_and_disable_interrupts();
+    if (ep->active) {
+        if (info->queued == MAX_QUEUED) panic("Too many transfers queued");
+        uint8_t i = (info->queue_head + info->queued++) % MAX_QUEUED;
+        info->queue[i].buf = buf;
+        info->queue[i].len = len;
+        restore_interrupts(save);
+        return;
+    }
+
+    // Send the bulk transfer (data_pid continues from the last transfer)
+    ep->user_buf   = buf;
+    ep->bytes_left = len;
+    ep->bytes_done = 0;
+    deadline_start(ep);
+    transfer(ep);
+    restore_interrupts(save);
+}
+
+// Have the IN data of an endpoint land in a ring as it arrives, with no copy
+// through a user buffer (NULL goes back to user buffers). Its transfers then
+// take a NULL buffer, and ep->cb gets NULL with the length that landed. Only
+// packets the ring has room for are asked for (with a framed ring, each one
+// is a record and needs room for its header too), so when the reader falls
+// behind, the data waits in the device and other endpoints have EPX until it
+// catches up (nothing is lost). A polled endpoint can't wait its turn like
+// that, so its transfer ends with TRANSFER_INVALID instead, after the packets
+// that fit.
+void endpoint_ring(endpoint_t *ep, ring_t *ring) {
+    if (!ep_in(ep))  panic("Only IN endpoints can fill a ring");
+    if (ep->active)  panic("Endpoint is busy");
+    ep->ring     = ring;
+    ep->spsc     = NULL;
+    ep->user_buf = NULL;
+}
+
+// The same, but the data lands in a lock-free ring (as bytes, there are no
+// records). The interrupt handler is its only writer and the reader must be
+// its only reader, such as the application on core0 with USER_CORE1, which
+// then never waits on a lock core1 holds, or the other way around.
+void endpoint_spsc(endpoint_t *ep, spsc_t *spsc) {
+    if (!ep_in(ep))  panic("Only IN endpoints can fill a ring");
+    if (ep->active)  panic("Endpoint is busy");
+    ep->ring     = NULL;
+    ep->spsc     = spsc;
+    ep->user_buf = NULL;
+}
+
+// Take the next transfer queued on an endpoint, returns false if there's none
+SDK_INLINE bool dequeue_transfer(endpoint_t *ep) {
+    endpoint_info_t *info = ep_info(ep);
+    if (!info->queued) return false;
+
+    ep->user_buf     = info->queue[info->queue_head].buf;
+    ep->bytes_left   = info->queue[info->queue_head].len;
+    info->queue_head = (info->queue_head + 1) % MAX_QUEUED;
+    info->queued--;
+    return true;
+}
+
+void halt_cleared(endpoint_t *ep, uint8_t status, uint8_t *buf, uint32_t len);
+
+// A failed transfer leaves its endpoint halted, with the transfers queued on
+// it waiting. Clearing ENDPOINT_HALT also sets DATA0/DATA1 back to DATA0 in
+// the device, so both sides are in step again when they go on.
+void clear_halt(endpoint_t *ep) {
+    xfer_info("Clearing halt on EP%u %s of device %u\n", ep_num(ep), ep_dir(ep),
+              ep->dev_addr);
+    control_transfer(find_endpoint(ep->dev_addr, 0), &((usb_setup_packet_t) {
+        .bmRequestType = USB_DIR_OUT
+                       | USB_REQ_TYPE_STANDARD
+                       | USB_REQ_TYPE_RECIPIENT_ENDPOINT,
+        .bRequest      = USB_REQUEST_CLEAR_FEATURE,
+        .wValue        = USB_FEAT_ENDPOINT_HALT,
+        .wIndex        = ep->ep_addr,
+        .wLength       = 0,
+    }), halt_cleared);
+}
+
+// The halt is cleared (or the device wouldn't), go on with the queued ones.
+// If the request itself got lost, the device may not have set DATA0/DATA1
+// back, so it's sent again (it does no harm twice) before giving up.
+void halt_cleared(endpoint_t *ep, uint8_t status, uint8_t *buf, uint32_t len) {
+    uint8_t i = *ep_slot(ep->dev_addr, get_device(ep->dev_addr)->setup.wIndex);
+    if (!i) return; // Freed meanwhile
+
+    endpoint_t      *halted = &eps[i];
+    endpoint_info_t *info   = ep_info(halted);
+    if (status && status != TRANSFER_STALLED && info->tries++ < USER_RETRIES) {
+        clear_halt(halted);
+        return;
+    }
+    if (status) xfer_error("Halt on EP%u %s of device %u not cleared (status"
+                           " %u)\n", ep_num(halted), ep_dir(halted),
+                           halted->dev_addr, status);
+    uint32_t save = save_and_disable_interrupts();
+    info->tries      = 0;
+    halted->active   = false;
+    halted->data_pid = 0;
+    xfer_stats.halts++;
+    if (dequeue_transfer(halted)) {
+        deadline_start(halted);
+        transfer(halted);
+    } else {
+        cancel_later(&info->deadline); // Nothing left to watch
+    }
+    restore_interrupts(save);
+}
+
+// Interrupt transfer on a polled endpoint, usb_task() calls ep->cb when done
+void interrupt_transfer(endpoint_t *ep, uint8_t *buf, uint32_t len) {
+    if (!ep_info(ep)->configured) panic("Endpoint not configured");
+    if ( ep->active)     panic("Transfers per endpoint must be serial");
+    if (!len)            panic("Interrupt transfers require a data phase");
+    if (!ep->interval)   panic("Interrupt transfers require a polled endpoint");
+
+    // Arm the buffer, the hardware polls the device every interval until done
+    uint32_t save = save_and_disable_interrupts();
+    ep->user_buf   = buf;
+    ep->bytes_left = len;
+    ep->bytes_done = 0;
     transfer(ep);
+    restore_interrupts(save);
 }
 
 // ==[ Descriptors ]============================================================
 
-SDK_INLINE void get_descriptor(endpoint_t *ep, uint8_t type, uint8_t len) {
+SDK_INLINE void get_descriptor(endpoint_t *ep, uint8_t type, uint16_t len,
+                               endpoint_c cb) {
     control_transfer(ep, &((usb_setup_packet_t) {
         .bmRequestType = USB_DIR_IN
                        | USB_REQ_TYPE_STANDARD
@@ -497,10 +1342,10 @@ SDK_INLINE void get_descriptor(endpoint_t *ep, uint8_t type, uint8_t len) {
         .wValue        = MAKE_U16(type, 0),
         .wIndex        = 0,
         .wLength       = len,
-    }));
+    }), cb);
 }
 
-void get_string_descriptor_blocking(endpoint_t *ep, uint8_t index) {
+void get_string_descriptor(endpoint_t *ep, uint8_t index, endpoint_c cb) {
     control_transfer(ep, &((usb_setup_packet_t) {
         .bmRequestType = USB_DIR_IN
                        | USB_REQ_TYPE_STANDARD
@@ -509,13 +1354,11 @@ void get_string_descriptor_blocking(endpoint_t *ep, uint8_t index) {
         .wValue        = MAKE_U16(USB_DT_STRING, index),
         .wIndex        = 0,
         .wLength       = MAX_TEMP,
-    }));
-
-    do { usb_task(); } while (ep->active); // This transfer...
-    do { usb_task(); } while (ep->active); // The ZLP...
+    }), cb);
 }
 
 void show_device_descriptor(void *ptr) {
+#if LOG_ENUM >= LOG_INFO
     usb_device_descriptor_t *d = (usb_device_descriptor_t *) ptr;
 
     printf("Connected Device:\n");
@@ -532,9 +1375,11 @@ void show_device_descriptor(void *ptr) {
     printf("  Product:      [#%u]\n" , d->iProduct);
     printf("  Serial:       [#%u]\n" , d->iSerialNumber);
     printf("\n");
+#endif
 }
 
 void show_configuration_descriptor(void *ptr) {
+#if LOG_ENUM >= LOG_INFO
     usb_configuration_descriptor_t *d = (usb_configuration_descriptor_t *) ptr;
 
     printf("Configuration Descriptor:\n");
@@ -554,22 +1399,22 @@ void show_configuration_descriptor(void *ptr) {
     }
     printf("  Max power:    %umA\n" , d->bMaxPower * 2);
     printf("\n");
+#endif
 }
 
-void show_string_blocking(endpoint_t *ep, uint8_t index) {
-    uint8_t *ptr = ep->user_buf;
-
-    // Request a string and wait for it
-    get_string_descriptor_blocking(ep, index);
+// Show a string descriptor that came back from get_string_descriptor()
+void show_string(uint8_t index, uint8_t *ptr, uint32_t size) {
 
-    // Prepare to parse Unicode string
-    uint8_t   len =              *ptr / 2 ;
+    // Prepare to parse Unicode string (skip bLength and bDescriptorType, which
+    // the device sets, so a bLength under 2 has no string at all)
+    uint8_t   len = size < 2 || *ptr < 2 ? 0 : (MIN(*ptr, size) - 2) / 2;
     uint16_t *uni = (uint16_t *) (ptr + 2);
 
-    // Convert Unicode string to UTF-8
-    char *str = (char[MAX_TEMP]) { 0 }, *utf = str;
+    // Convert Unicode string to UTF-8 (cut short if it doesn't fit)
+    char *str = (char[MAX_TEMP]) { 0 }, *utf = str, *end = str + MAX_TEMP - 1;
     while (len--) {
         uint16_t u = *uni++;
+        if (utf + (u < 0x80 ? 1 : u < 0x800 ? 2 : 3) > end) break;
         if (u < 0x80) {
             *utf++ = (char)          u;
         } else if (u < 0x800) {
@@ -583,59 +1428,700 @@ void show_string_blocking(endpoint_t *ep, uint8_t index) {
     }
     *utf++ = 0;
 
-    printf("[String #%u]: \"%s\"\n", index, str);
+    enum_info("[String #%u]: \"%s\"\n", index, str);
+}
+
+// ==[ Descriptor Cache ]=======================================================
+
+// Devices seen before are recognized by their device descriptor and serial
+// number, and configured from the descriptors kept here instead of reading
+// them again (the other strings are only kept to show them). The cache is in
+// RAM, and with USER_CACHE_FLASH also in the flash sector at that offset, so
+// it survives a reboot. When it's full, the least recently used entry goes.
+
+typedef struct cache cache_t;
+
+enum { // Strings in each entry (same order as in next_string)
+    CACHE_MANUFACTURER,
+    CACHE_PRODUCT,
+    CACHE_SERIAL,
+    CACHE_STRINGS,
+};
+
+static uint32_t cache_hits, cache_misses; // Enumerations with and without it
+
+#if USER_CACHE
+
+enum {
+    CACHE_CONFIG = 512,        // Largest configuration descriptor kept
+    CACHE_STRING =  64,        // Largest string descriptor kept
+    CACHE_MAGIC  = 0x48434350, // "PCCH" marks a saved cache
+    CACHE_VERSION = 1,         // Layout of a saved cache (bump when it changes)
+};
+
+struct cache {
+    uint16_t vid     ; // Key: idVendor
+    uint16_t pid     ; // Key: idProduct
+    uint16_t version ; // Key: bcdDevice
+    bool     ready   ; // Complete and usable
+    bool     filling ; // Being filled while a device enumerates
+    uint32_t used    ; // Last use (the least recently used entry is replaced)
+    uint8_t  device[sizeof(usb_device_descriptor_t)];
+    uint8_t  config[CACHE_CONFIG];
+    uint8_t  string[CACHE_STRINGS][CACHE_STRING]; // Serial is a key (0 = none)
+};
+
+typedef union {
+    struct {
+        uint32_t magic; // CACHE_MAGIC when saved (erased flash reads 0xffffffff)
+        uint32_t version; // CACHE_VERSION when saved
+        uint32_t size ; // Size of this union when saved
+        uint32_t clock; // Last use handed out
+        cache_t  entry[USER_CACHE];
+    };
+    uint8_t page[(16 + USER_CACHE * sizeof(cache_t) + 255) & ~255]; // In pages
+} cache_table_t;
+
+static cache_table_t cache;
+
+static bool cache_dirty; // Changed since it was saved
+
+#if USER_CACHE_FLASH
+_Static_assert(USER_CACHE_FLASH % FLASH_SECTOR_SIZE == 0,
+               "USER_CACHE_FLASH must be at the start of a flash sector");
+_Static_assert(sizeof(cache.page) <= FLASH_SECTOR_SIZE,
+               "The descriptor cache does not fit in a flash sector");
+#endif
+
+// An entry is only used if what it holds fits where it goes, since a stale or
+// corrupted one (from flash, or RAM written over) would overrun ctrl_buf
+SDK_INLINE bool cache_valid(const cache_t *c) {
+    const usb_configuration_descriptor_t *cfg =
+        (const usb_configuration_descriptor_t *) c->config;
+    if (cfg->bLength         != sizeof(usb_configuration_descriptor_t) ||
+        cfg->bDescriptorType != USB_DT_CONFIG                          ||
+        cfg->wTotalLength     < sizeof(usb_configuration_descriptor_t) ||
+        cfg->wTotalLength     > CACHE_CONFIG                           ||
+        cfg->wTotalLength     > MAX_CTRL) return false;
+    for (uint8_t n = 0; n < CACHE_STRINGS; n++)
+        if (c->string[n][0] > CACHE_STRING) return false;
+    return true;
+}
+
+// Start with the cache that was saved in flash, if there is one
+void cache_init() {
+    memclr(&cache, sizeof(cache));
+    cache_dirty = false;
+#if USER_CACHE_FLASH
+    const cache_table_t *saved = (const cache_table_t *)
+                                 (XIP_BASE + USER_CACHE_FLASH);
+    if (saved->magic   != CACHE_MAGIC   ||
+        saved->version != CACHE_VERSION ||
+        saved->size    != sizeof(cache_table_t)) return;
+    memcpy(&cache, saved, sizeof(cache));
+    for (uint8_t i = 0; i < USER_CACHE; i++) {
+        cache_t *c = &cache.entry[i];
+        c->filling = false;
+        if (c->ready && !cache_valid(c)) memclr(c, sizeof(cache_t));
+    }
+    drv_debug("Descriptor cache loaded from flash\n");
+#endif
+}
+
+// Save the cache to flash if it changed. This takes about 50 ms with interrupts
+// disabled, so it waits until every device is mounted.
+void cache_save() {
+    if (!cache_dirty) return;
+    cache_dirty = false;
+#if USER_CACHE_FLASH
+    cache.magic   = CACHE_MAGIC;
+    cache.version = CACHE_VERSION;
+    cache.size    = sizeof(cache_table_t);
+
+    uint32_t irq = save_and_disable_interrupts(); // Flash can't run code now
+    flash_range_erase  (USER_CACHE_FLASH, FLASH_SECTOR_SIZE);
+    flash_range_program(USER_CACHE_FLASH, cache.page, sizeof(cache.page));
+    restore_interrupts(irq);
+#endif
+}
+
+// Find the entry for a device descriptor (its serial number is checked next).
+// One that matches but doesn't hold together is dropped, and it's a miss.
+cache_t *cache_find(usb_device_descriptor_t *d) {
+    for (uint8_t i = 0; i < USER_CACHE; i++) {
+        cache_t *c = &cache.entry[i];
+        if (!c->ready || c->vid != d->idVendor || c->pid != d->idProduct ||
+            c->version != d->bcdDevice || memcmp(c->device, d, sizeof(c->device)))
+            continue;
+        if (cache_valid(c)) return c;
+        drv_error("Descriptor cache entry %u is corrupted\n", i);
+        memclr(c, sizeof(cache_t));
+        cache_dirty = true;
+    }
+    return NULL;
+}
+
+// Start filling an entry for a device that is not in the cache yet
+void cache_new(device_t *dev, usb_device_descriptor_t *d) {
+    cache_t *c = NULL;
+
+    cache_misses++;
+    for (uint8_t i = 0; i < USER_CACHE; i++) {
+        cache_t *e = &cache.entry[i];
+        if (e->filling) continue;
+        if (!c || !e->ready || (c->ready && e->used < c->used)) c = e;
+        if (!e->ready) break;
+    }
+    dev->cache = c;
+    if (!c) return; // Every entry is being filled
+
+    memclr(c, sizeof(cache_t));
+    c->vid     = d->idVendor;
+    c->pid     = d->idProduct;
+    c->version = d->bcdDevice;
+    c->filling = true;
+    memcpy(c->device, d, sizeof(c->device));
+}
+
+// Check the serial number of a device against its entry, and if it's another
+// one of the same product, start filling a new entry for it
+bool cache_serial(device_t *dev, uint8_t *buf, uint32_t len) {
+    uint8_t *str = dev->cache->string[CACHE_SERIAL];
+    if (len && len == *str && !memcmp(str, buf, len)) return true;
+
+    cache_new(dev, (usb_device_descriptor_t *) dev->cache->device);
+    return false;
+}
+
+// A device was recognized, copy its configuration descriptor into buf
+void cache_hit(device_t *dev, uint8_t *buf) {
+    uint8_t *cfg = dev->cache->config;
+
+    memcpy(buf, cfg, ((usb_configuration_descriptor_t *) cfg)->wTotalLength);
+    dev->cache->used = ++cache.clock;
+    cache_hits++;
+}
+
+// Show the strings of a recognized device, returns false if it's not one
+bool cache_show_strings(device_t *dev, const uint8_t *index) {
+    if (!dev->cache || dev->cache->filling) return false;
+
+    for (uint8_t n = 0; n < CACHE_STRINGS; n++) {
+        uint8_t *str = dev->cache->string[n];
+        if (index[n]) show_string(index[n], str, *str);
+    }
+    return true;
+}
+
+// Stop filling the entry of a device
+void cache_drop(device_t *dev) {
+    cache_t *c = dev->cache;
+    if (c && c->filling) memclr(c, sizeof(cache_t));
+    dev->cache = NULL;
+}
+
+SDK_INLINE bool cache_filling(device_t *dev) {
+    return dev->cache && dev->cache->filling;
+}
+
+void cache_config(device_t *dev, uint8_t *buf, uint16_t len) {
+    if (!cache_filling(dev)) return;
+    if (len > CACHE_CONFIG) {
+        cache_drop(dev);
+    } else {
+        memcpy(dev->cache->config, buf, len);
+    }
+}
+
+// Keep a string, the other strings can be cut short since they're only shown
+void cache_string(device_t *dev, uint8_t n, uint8_t *buf, uint32_t len) {
+    if (!cache_filling(dev) || !len) return;
+    if (len > CACHE_STRING && n == CACHE_SERIAL) {
+        cache_drop(dev); // Too long to check
+        return;
+    }
+    len = MIN(len, CACHE_STRING);
+    memcpy(dev->cache->string[n], buf, len);
+    dev->cache->string[n][0] = len;
+}
+
+// The device is configured, so its entry is complete
+void cache_done(device_t *dev) {
+    if (!cache_filling(dev)) return;
+    dev->cache->filling = false;
+    dev->cache->ready   = true;
+    dev->cache->used    = ++cache.clock;
+    cache_dirty = true;
 }
 
+#else // No descriptor cache
+
+SDK_INLINE void     cache_init() {}
+SDK_INLINE cache_t *cache_find(usb_device_descriptor_t *d) { return NULL; }
+SDK_INLINE void     cache_new(device_t *dev, usb_device_descriptor_t *d) {}
+SDK_INLINE bool     cache_serial(device_t *dev, uint8_t *buf, uint32_t len) { return false; }
+SDK_INLINE void     cache_hit(device_t *dev, uint8_t *buf) {}
+SDK_INLINE bool     cache_show_strings(device_t *dev, const uint8_t *index) { return false; }
+SDK_INLINE void     cache_drop(device_t *dev) {}
+SDK_INLINE void     cache_config(device_t *dev, uint8_t *buf, uint16_t len) {}
+SDK_INLINE void     cache_string(device_t *dev, uint8_t n, uint8_t *buf,
+                                 uint32_t len) {}
+SDK_INLINE void     cache_done(device_t *dev) {}
+SDK_INLINE void     cache_save() {}
+
+#endif
+
 // ==[ Classes ]================================================================
 
 void cdch_init() {
-    printf("CDC Host Driver Initialized\n");
+    drv_info("CDC Host Driver Initialized\n");
 }
 
 bool cdch_open(uint8_t dev_addr, const usb_interface_descriptor_t *ifd,
                uint16_t len) {
-    printf("CDC Host Driver Opened\n");
+    if (ifd->bInterfaceClass != USB_CLASS_CDC) return false;
+
+    drv_info("CDC Host Driver Opened\n");
     return true;
 }
 
 bool cdch_config(uint8_t dev_addr, uint8_t itf_num) {
-    printf("CDC Host Driver Configured\n");
+    drv_info("CDC Host Driver Configured\n");
     return true;
 }
 
 bool cdch_cb(uint8_t dev_addr, uint8_t ep_addr, // Ugh... xfer_result_t result,
              uint32_t xferred_bytes) {
-    printf("CDC Host Driver Callback\n");
+    drv_info("CDC Host Driver Callback\n");
     return true;
 }
 
 void cdch_close(uint8_t dev_addr) {
-    printf("CDC Host Driver Closed\n");
+    drv_info("CDC Host Driver Closed\n");
 }
 
-// ==[ Drivers ]================================================================
+#if USER_HUBS
+
+// Hubs power their ports, then report port changes on a polled status change
+// endpoint. Each hub works through its requests on EP0 one step at a time, as
+// each request's callback (or a delay, see call_later) takes the next step. A
+// newly connected port is reset and its device enumerated through dev0, so
+// only one port of one hub is worked on at a time (dev0 is shared). Once the
+// device has its own address, the next port is worked on while it finishes
+// enumerating. Each hub's status endpoint is polled again once its changes are
+// handled.
+
+enum { // Hub steps, each taken when the request or delay before it is done
+    HUB_IDLE,
+    HUB_GET_DESCRIPTOR, // Got the hub descriptor
+    HUB_POWER_PORT,     // Powered on a port
+    HUB_SCAN_PORT,      // Got the status of a port after the power was good
+    HUB_PORT_STATUS,    // Got the status of a port with changes
+    HUB_PORT_CLEAR,     // Acknowledged a change
+    HUB_PORT_RESET,     // Started a reset
+    HUB_RESET_STATUS,   // Waited for the reset to finish
+    HUB_RESET_CHECK,    // Got the status of the port being reset
+    HUB_RESET_DONE,     // Acknowledged the reset
+    HUB_RECOVERED,      // Waited for reset recovery
+};
 
 typedef struct {
-  const char *name;
-  void (* const init  )(void);
-  bool (* const open  )(uint8_t dev_addr, const usb_interface_descriptor_t *ifd,
-                        uint16_t len);
-  bool (* const config)(uint8_t dev_addr, uint8_t itf_num);
-  bool (* const cb    )(uint8_t dev_addr, uint8_t ep_addr, // Ugh... xfer_result_t result,
-                        uint32_t xferred_bytes);
-  void (* const close )(uint8_t dev_addr);
-} driver_t;
+    uint8_t     dev_addr ; // Hub device address (0 = free)
+    uint8_t     ports    ; // Number of downstream ports
+    bool        ready    ; // Ports are powered and scanned
+    uint8_t     changes  ; // Ports with changes to handle (bit 0 is the hub)
+    endpoint_t *status   ; // Status change endpoint
+    uint8_t     report[1]; // Status change bitmap
+
+    // Working through the steps
+    uint8_t     step     ; // Next step (HUB_*)
+    uint8_t     port     ; // Port being worked on
+    uint16_t    delay    ; // Power on to power good time in ms
+    uint8_t     polls    ; // Status polls left while a port is reset
+    uint16_t    wStatus  ; // Port status
+    uint16_t    wChange  ; // Port changes
+    uint16_t    acks     ; // Port changes left to acknowledge
+    later_t     wait     ; // Until the next step (see hub_wait)
+} hub_t;
+
+static hub_t   hubs[USER_HUBS];
+static bool    hub_busy; // Working on a port, or its new device is at address 0
+static hub_t  *hub_cur ; // The hub with that port
+static later_t hub_kick; // Other hubs go on once a busy one is closed
+
+void start_enumeration(uint8_t speed, uint8_t hub_addr, uint8_t hub_port);
+void remove_device(uint8_t dev_addr);
+void mount_begin();
+void mount_end();
+void hub_step(void *arg);
+void hub_next_port();
+void hub_work(); // Forward declarations
+
+SDK_INLINE hub_t *get_hub(uint8_t dev_addr) {
+    for (uint8_t i = 0; i < USER_HUBS; i++)
+        if (hubs[i].dev_addr == dev_addr) return &hubs[i];
+    panic("Device %u is not a hub", dev_addr);
+    return NULL;
+}
 
-static const driver_t drivers[] = {
-    {
-        .name   = "CDC",
-        .init   = cdch_init,
-        .open   = cdch_open,
-        .config = cdch_config,
-        .cb     = cdch_cb,
-        .close  = cdch_close,
-    }
-};
+// Each hub request comes back here
+void hub_done(endpoint_t *ep, uint8_t status, uint8_t *buf, uint32_t len) {
+    hub_t *hub = get_hub(ep->dev_addr);
+
+    // Leave the port for its next change, or go on with the ports so far
+    if (status) {
+        drv_error("Hub %u request failed (status %u)\n", hub->dev_addr, status);
+        hub->step = HUB_IDLE;
+        if (hub->ready) {
+            hub_next_port();
+        } else {
+            hub->ready = true;
+            hub_work();
+            mount_end(); // Counted since hubh_config()
+        }
+        return;
+    }
+    hub_step(hub);
+}
+
+// Send a hub class request, hub_done() takes the next step (data is in ctrl_buf)
+void hub_request(hub_t *hub, uint8_t type, uint8_t request,
+                 uint16_t value, uint16_t index, uint16_t len) {
+    control_transfer(find_endpoint(hub->dev_addr, 0), &((usb_setup_packet_t) {
+        .bmRequestType = type | USB_REQ_TYPE_TYPE_CLASS,
+        .bRequest      = request,
+        .wValue        = value,
+        .wIndex        = index,
+        .wLength       = len,
+    }), hub_done);
+}
+
+SDK_INLINE void set_port_feature(hub_t *hub, uint8_t port, uint8_t feat) {
+    hub_request(hub, USB_DIR_OUT | USB_REQ_TYPE_RECIPIENT_OTHER,
+                USB_REQUEST_SET_FEATURE, feat, port, 0);
+}
+
+SDK_INLINE void clear_port_feature(hub_t *hub, uint8_t port, uint8_t feat) {
+    hub_request(hub, USB_DIR_OUT | USB_REQ_TYPE_RECIPIENT_OTHER,
+                USB_REQUEST_CLEAR_FEATURE, feat, port, 0);
+}
+
+SDK_INLINE void get_port_status(hub_t *hub, uint8_t port) {
+    hub_request(hub, USB_DIR_IN | USB_REQ_TYPE_RECIPIENT_OTHER,
+                USB_REQUEST_GET_STATUS, 0, port, sizeof(usb_hub_port_status_t));
+}
+
+// The port status that came back from get_port_status()
+SDK_INLINE usb_hub_port_status_t port_status() {
+    usb_hub_port_status_t ps;
+    memcpy(&ps, ctrl_buf, sizeof(ps));
+    return ps;
+}
+
+// Wait, then take the next step
+SDK_INLINE void hub_wait(hub_t *hub, uint8_t step, uint32_t ms) {
+    hub->step = step;
+    call_later(&hub->wait, hub_step, hub, ms);
+}
+
+// Take the next step on a hub, which starts a request or waits
+void hub_step(void *arg) {
+    hub_t *hub = (hub_t *) arg;
+
+    switch (hub->step) {
+
+        // Power on each port, then wait until the power is good
+        case HUB_GET_DESCRIPTOR: {
+            usb_hub_descriptor_t *hd = (usb_hub_descriptor_t *) ctrl_buf;
+            hub->ports = MIN(hd->bNbrPorts, MAX_PORTS);
+            hub->delay = hd->bPwrOn2PwrGood * 2;
+            hub->port  = 0;
+            hub->step  = HUB_POWER_PORT;
+
+            drv_info("Hub %u has %u ports\n", hub->dev_addr, hub->ports);
+        }   // Fall through
+
+        case HUB_POWER_PORT:
+            if (hub->port < hub->ports) {
+                set_port_feature(hub, ++hub->port, USB_HUB_PORT_POWER);
+                break;
+            }
+            hub->port = 0;
+            hub_wait(hub, HUB_SCAN_PORT, hub->delay);
+            break;
+
+        // Ports with a device attached have a connection change, which
+        // hub_work() handles before it polls the status change endpoint
+        case HUB_SCAN_PORT:
+            if (hub->port) {
+                usb_hub_port_status_t ps = port_status();
+                if (ps.wPortChange & (1u << USB_HUB_PORT_CONNECTION))
+                    hub->changes |= 1u << hub->port;
+            }
+            if (hub->port < hub->ports) {
+                get_port_status(hub, ++hub->port);
+                break;
+            }
+            hub->step  = HUB_IDLE;
+            hub->ready = true;
+            hub_work();
+            mount_end(); // Counted since hubh_config()
+            break;
+
+        // Acknowledge every change (C_PORT_CONNECTION ... C_PORT_RESET)
+        case HUB_PORT_STATUS: {
+            usb_hub_port_status_t ps = port_status();
+            hub->wStatus = ps.wPortStatus;
+            hub->wChange = ps.wPortChange;
+            hub->acks    = ps.wPortChange & ((2u << (USB_HUB_C_PORT_RESET - 16)) - 1);
+            hub->step    = HUB_PORT_CLEAR;
+
+            drv_debug("Hub %u port %u status 0x%04x change 0x%04x\n",
+                      hub->dev_addr, hub->port, hub->wStatus, hub->wChange);
+        }   // Fall through
+
+        case HUB_PORT_CLEAR: {
+            if (hub->acks) {
+                uint8_t bit = __builtin_ctz(hub->acks);
+                hub->acks &= ~(1u << bit);
+                clear_port_feature(hub, hub->port, USB_HUB_C_PORT_CONNECTION + bit);
+                break;
+            }
+            hub->step = HUB_IDLE;
+            if (!(hub->wChange & (1u << USB_HUB_PORT_CONNECTION))) {
+                hub_next_port();
+                break;
+            }
+
+            // A connect or disconnect replaces whatever was on the port
+            for (uint8_t i = 1; i < MAX_DEVICES; i++) {
+                device_t *dev = &devices[i];
+                if (dev->state && dev->hub_addr == hub->dev_addr &&
+                    dev->hub_port == hub->port) remove_device(i);
+            }
+            if (!(hub->wStatus & (1u << USB_HUB_PORT_CONNECTION))) {
+                hub_next_port();
+                break;
+            }
+
+            // Reset the port, which enables it with the device at address zero
+            hub->polls = 10;
+            hub->step  = HUB_PORT_RESET;
+            set_port_feature(hub, hub->port, USB_HUB_PORT_RESET);
+        }   break;
+
+        case HUB_PORT_RESET:
+            hub_wait(hub, HUB_RESET_STATUS, 10); // Resets take 10 to 20 ms
+            break;
+
+        case HUB_RESET_STATUS:
+            hub->step = HUB_RESET_CHECK;
+            get_port_status(hub, hub->port);
+            break;
+
+        case HUB_RESET_CHECK: {
+            usb_hub_port_status_t ps = port_status();
+            if (ps.wPortChange & (1u << (USB_HUB_C_PORT_RESET - 16))) {
+                hub->wStatus = ps.wPortStatus;
+                hub->step    = HUB_RESET_DONE;
+                clear_port_feature(hub, hub->port, USB_HUB_C_PORT_RESET);
+            } else if (--hub->polls) {
+                hub_wait(hub, HUB_RESET_STATUS, 10);
+            } else {
+                drv_error("Hub %u port %u did not finish its reset\n",
+                          hub->dev_addr, hub->port);
+                hub->step = HUB_IDLE;
+                hub_next_port();
+            }
+        }   break;
+
+        case HUB_RESET_DONE:
+            if (!(hub->wStatus & (1u << USB_HUB_PORT_ENABLE))) {
+                drv_error("Hub %u port %u is not enabled\n",
+                          hub->dev_addr, hub->port);
+                hub->step = HUB_IDLE;
+                hub_next_port();
+                break;
+            }
+            hub_wait(hub, HUB_RECOVERED, RECOVERY_MS);
+            break;
+
+        // Enumerate the device, hubh_resume() moves on once it has an address
+        case HUB_RECOVERED: {
+            bool ls = hub->wStatus & (1u << USB_HUB_PORT_LOW_SPEED);
+            hub->step = HUB_IDLE;
+            start_enumeration(ls ? LOW_SPEED : FULL_SPEED, hub->dev_addr,
+                              hub->port);
+        }   break;
+
+        default:
+            panic("Hub %u has no step %u", hub->dev_addr, hub->step);
+            break;
+    }
+}
+
+// Work on the next port with changes, or finish when no hub has any left
+void hub_next_port() {
+    for (uint8_t i = 0; i < USER_HUBS; i++) {
+        hub_t *hub = &hubs[i];
+        if (!hub->ready) continue;
+
+        while (hub->changes) {
+            uint8_t port = __builtin_ctz(hub->changes);
+            hub->changes &= ~(1u << port);
+            if (!port || port > hub->ports) continue; // Ignore the hub
+            hub->port = port;
+            hub->step = HUB_PORT_STATUS;
+            hub_cur   = hub;
+            get_port_status(hub, port);
+            return;
+        }
+
+        // Look for more changes
+        if (!hub->status->active)
+            interrupt_transfer(hub->status, hub->report, sizeof(hub->report));
+    }
+
+    hub_busy = false;
+    hub_cur  = NULL;
+    mount_end();
+}
+
+// Handle the port changes of all hubs, pausing while a new device has address
+// zero. Devices behind the ports count as being mounted until this is done.
+void hub_work() {
+    if (hub_busy) return;
+    hub_busy = true;
+    mount_begin();
+    hub_next_port();
+}
+
+// Called when a device has its address, so hubs can move on to the next port
+void hubh_resume() {
+    if (!hub_busy) return;
+    hub_next_port();
+}
+
+// Status change endpoint callback
+void hubh_status(endpoint_t *ep, uint8_t status, uint8_t *buf, uint32_t len) {
+    hub_t *hub = get_hub(ep->dev_addr);
+
+    if (!status && len) hub->changes |= buf[0];
+    hub_work();
+}
+
+void hubh_init() {
+    drv_info("Hub Driver Initialized\n");
+}
+
+bool hubh_open(uint8_t dev_addr, const usb_interface_descriptor_t *ifd,
+               uint16_t len) {
+    if (ifd->bInterfaceClass != USB_CLASS_HUB) return false;
+
+    // Find the status change endpoint
+    uint8_t *cur = (uint8_t *) ifd, *end = cur + len;
+    while (cur < end && cur[1] != USB_DT_ENDPOINT) cur += *cur;
+    if (cur >= end) {
+        drv_error("Hub %u has no status change endpoint\n", dev_addr);
+        return false;
+    }
+
+    for (uint8_t i = 0; i < USER_HUBS; i++) {
+        hub_t *hub = &hubs[i];
+        if (hub->dev_addr) continue;
+
+        *hub = (hub_t) { .dev_addr = dev_addr };
+        hub->status = next_endpoint(dev_addr, (usb_endpoint_descriptor_t *) cur,
+                                    hub->report);
+        ep_info(hub->status)->cb = hubh_status;
+        drv_info("Hub Driver Opened\n");
+        return true;
+    }
+    drv_error("No free hubs remaining\n");
+    return false;
+}
+
+bool hubh_config(uint8_t dev_addr, uint8_t itf_num) {
+    hub_t *hub = get_hub(dev_addr);
+
+    // Get the hub descriptor, hub_step() powers and scans the ports from there
+    mount_begin(); // Devices behind its ports count as mounting until then
+    hub->step = HUB_GET_DESCRIPTOR;
+    hub_request(hub, USB_DIR_IN | USB_REQ_TYPE_RECIPIENT_DEVICE,
+                USB_REQUEST_GET_DESCRIPTOR, MAKE_U16(USB_DT_HUB, 0), 0,
+                sizeof(usb_hub_descriptor_t));
+    return true;
+}
+
+bool hubh_cb(uint8_t dev_addr, uint8_t ep_addr, // Ugh... xfer_result_t result,
+             uint32_t xferred_bytes) {
+    return true;
+}
+
+void hub_kicked(void *arg) {
+    hub_work();
+}
+
+// A hub that goes away takes the work on its ports with it. What it counted
+// as mounting is over, and if it was the busy one, the other hubs go on with
+// their changes (once the removal is done).
+void hubh_close(uint8_t dev_addr) {
+    hub_t *hub  = get_hub(dev_addr);
+    bool   busy = hub_busy && hub_cur == hub;
+
+    cancel_later(&hub->wait);
+    if (!hub->ready && hub->step != HUB_IDLE)
+        mount_end(); // Counted since hubh_config()
+    memclr(hub, sizeof(hub_t));
+    if (busy) {
+        hub_busy = false;
+        hub_cur  = NULL;
+        mount_end(); // Counted since hub_work()
+        call_later(&hub_kick, hub_kicked, NULL, 0);
+    }
+    drv_info("Hub Driver Closed\n");
+}
+
+#else // No hubs, only the device on the root port
+
+SDK_INLINE void hub_work() {}
+SDK_INLINE void hubh_resume() {}
+
+#endif
+
+// ==[ Drivers ]================================================================
+
+typedef struct {
+  const char *name;
+  void (* const init  )(void);
+  bool (* const open  )(uint8_t dev_addr, const usb_interface_descriptor_t *ifd,
+                        uint16_t len);
+  bool (* const config)(uint8_t dev_addr, uint8_t itf_num);
+  bool (* const cb    )(uint8_t dev_addr, uint8_t ep_addr, // Ugh... xfer_result_t result,
+                        uint32_t xferred_bytes);
+  void (* const close )(uint8_t dev_addr);
+} driver_t;
+
+static const driver_t drivers[] = {
+    {
+        .name   = "CDC",
+        .init   = cdch_init,
+        .open   = cdch_open,
+        .config = cdch_config,
+        .cb     = cdch_cb,
+        .close  = cdch_close,
+    },
+#if USER_HUBS
+    {
+        .name   = "Hub",
+        .init   = hubh_init,
+        .open   = hubh_open,
+        .config = hubh_config,
+        .cb     = hubh_cb,
+        .close  = hubh_close,
+    },
+#endif
+};
 
 enum {
     DRIVER_COUNT = sizeof(drivers) / sizeof(driver_t)
@@ -683,7 +2169,9 @@ void enable_drivers(endpoint_t *ep) {
         uint8_t ias = 1; // Number of interface associations
 
         // Debug output
+#if LOG_DRV >= LOG_DEBUG
         hexdump("|DRV", cur, *cur, 1);
+#endif
 
         // Optional: Interface Assocation Descriptor (IAD)
         if (cur[1] == USB_DT_INTERFACE_ASSOCIATION) {
@@ -713,26 +2201,21 @@ void enable_drivers(endpoint_t *ep) {
 
         // Try to find a driver for this interface
         for (uint8_t i = 0; i < DRIVER_COUNT; i++) {
-//             driver_t *driver = &drivers[i];
-//
-//             if (driver->open(dev_addr, cur, len)) {
-//                 printf("  %s driver opened\n", driver->name);
-//
-//                 // Bind each interface association to the driver
-//                 for (uint8_t j = 0; j < ias; j++) {
-//                     uint8_t k = cur->bInterfaceNumber + j;
-//                     dev->itf2drv[k] = i; // TODO: This needs to start with an invalid value
-//                 }
-//
-//                 // Bind all endpoints to the driver
-//                 endpoint_bind_driver(dev->ep2drv, cur, len, i);
-//
-//                 break;
-//             }
+            const driver_t *driver = &drivers[i];
+
+            if (driver->open(ep->dev_addr, ifd, len)) {
+
+                // Bind each interface association to the driver
+                for (uint8_t j = 0; j < ias; j++) {
+                    uint8_t k = ifd->bInterfaceNumber + j;
+                    if (k < MAX_INTERFACES) dev->itf2drv[k] = i + 1;
+                }
+                break;
+            }
 
             // Complain if we didn't find a matching driver
             if (i == DRIVER_COUNT - 1) {
-                printf("Interface %u skipped: class=%u subclass=%u protocol=%u\n",
+                drv_info("Interface %u skipped: class=%u subclass=%u protocol=%u\n",
                     ifd->bInterfaceNumber,
                     ifd->bInterfaceClass,
                     ifd->bInterfaceSubClass,
@@ -742,7 +2225,43 @@ void enable_drivers(endpoint_t *ep) {
         }
     }
 
-    printf("Whoa... that was cool\n");
+    drv_debug("Whoa... that was cool\n");
+}
+
+// Let the drivers bound to each interface configure it
+void configure_drivers(uint8_t dev_addr) {
+    device_t *dev = get_device(dev_addr);
+
+    for (uint8_t i = 0; i < MAX_INTERFACES; i++)
+        if (dev->itf2drv[i]) drivers[dev->itf2drv[i] - 1].config(dev_addr, i);
+}
+
+// Forget a device that is gone, along with its drivers, its endpoints, and
+// any devices behind it (when it's a hub)
+void remove_device(uint8_t dev_addr) {
+    device_t *dev  = get_device(dev_addr);
+    uint32_t  done = 0; // Drivers already closed
+
+    for (uint8_t i = 1; i < MAX_DEVICES; i++)
+        if (devices[i].state && devices[i].hub_addr == dev_addr) remove_device(i);
+
+    for (uint8_t i = 0; i < MAX_INTERFACES; i++) {
+        uint8_t drv = dev->itf2drv[i];
+        if (!drv || (done & (1u << drv))) continue;
+        done |= 1u << drv;
+        drivers[drv - 1].close(dev_addr);
+    }
+
+    for (uint8_t n = 0; n < 16; n++) {
+        for (uint8_t dir = 0; dir < 2; dir++) {
+            uint8_t i = ep_table[dev_addr][n][dir];
+            if (i) free_endpoint(&eps[i]);
+        }
+    }
+
+    cache_drop(dev);
+    reset_device(dev_addr);
+    enum_info("Device %u removed\n", dev_addr);
 }
 
 // ==[ Enumeration ]============================================================
@@ -755,18 +2274,51 @@ enum {
     ENUMERATION_GET_CONFIG_SHORT,
     ENUMERATION_GET_CONFIG_FULL,
     ENUMERATION_SET_CONFIG,
+    ENUMERATION_GET_STRING,
+    ENUMERATION_GET_SERIAL, // Checking a cached device
     ENUMERATION_END,
 };
 
+void enumerate(endpoint_t *ep, uint8_t status, uint8_t *buf, uint32_t len);
+
+// Device descriptor read on dev0 by the fast path (bLength is 0 without it)
+static usb_device_descriptor_t dev0_desc;
+
 void get_device_descriptor(endpoint_t *ep) {
-    printf("Get device descriptor\n");
+    enum_debug("Get device descriptor\n");
 
     uint8_t len = ep->dev_addr ? sizeof(usb_device_descriptor_t) : 8;
-    get_descriptor(ep, USB_DT_DEVICE, len);
+
+    // The fast path asks dev0 for all of it. Full speed devices can send up
+    // to 64 bytes per packet, and one with a smaller bMaxPacketSize0 ends the
+    // transfer early with a short packet, but always sends the first 8 bytes.
+    if (USER_FAST_ENUM && !ep->dev_addr) {
+        len         = sizeof(usb_device_descriptor_t);
+        ep->maxsize = dev0->speed == FULL_SPEED ? 64 : 8;
+    }
+    get_descriptor(ep, USB_DT_DEVICE, len, enumerate);
+}
+
+// The device gets ADDRESS_MS to take its new address before it's asked for
+// anything there (dev0 is still enumerating, unless it was unplugged since)
+static later_t addressing;
+
+void address_recovered(void *arg) {
+    if (dev0->state != DEVICE_ENUMERATING ||
+        dev0->step  != ENUMERATION_SET_ADDRESS) return;
+    enumerate(epx, TRANSFER_SUCCESS, NULL, 0);
+}
+
+void address_set(endpoint_t *ep, uint8_t status, uint8_t *buf, uint32_t len) {
+    if (status) {
+        enumerate(ep, status, buf, len);
+        return;
+    }
+    call_later(&addressing, address_recovered, NULL, ADDRESS_MS);
 }
 
 void set_device_address(endpoint_t *ep) {
-    printf("Set device address to %u\n", ep->dev_addr);
+    enum_debug("Set device address to %u\n", ep->dev_addr);
 
     // TODO: Allow devices to change their address (not just from zero)
     control_transfer(epx, &((usb_setup_packet_t) {
@@ -777,17 +2329,28 @@ void set_device_address(endpoint_t *ep) {
         .wValue        = ep->dev_addr,
         .wIndex        = 0,
         .wLength       = 0,
-    }));
+    }), address_set);
+}
+
+void get_configuration_descriptor(endpoint_t *ep, uint16_t len) {
+    enum_debug("Get configuration descriptor\n");
+
+    get_descriptor(ep, USB_DT_CONFIG, len, enumerate);
 }
 
-void get_configuration_descriptor(endpoint_t *ep, uint8_t len) {
-    printf("Get configuration descriptor\n");
+// Start reading the configuration descriptor. The fast path asks for all of
+// it at once, and only reads it again if it didn't fit.
+void read_configuration(endpoint_t *ep) {
+    uint16_t len = USER_FAST_ENUM ? MAX_CTRL
+                 : sizeof(usb_configuration_descriptor_t);
 
-    get_descriptor(ep, USB_DT_CONFIG, len);
+    enum_debug("Starting GET_CONFIG_SHORT (%u bytes)\n", len);
+    get_device(ep->dev_addr)->step = ENUMERATION_GET_CONFIG_SHORT;
+    get_configuration_descriptor(ep, len);
 }
 
 void set_configuration(endpoint_t *ep, uint16_t cfg) {
-    printf("Set configuration to %u\n", cfg);
+    enum_debug("Set configuration to %u\n", cfg);
 
     control_transfer(ep, &((usb_setup_packet_t) {
         .bmRequestType = USB_DIR_OUT
@@ -797,38 +2360,165 @@ void set_configuration(endpoint_t *ep, uint16_t cfg) {
         .wValue        = cfg,
         .wIndex        = 0,
         .wLength       = 0,
-    }));
+    }), enumerate);
 }
 
-void enumerate(void *arg) {
-    endpoint_t *ep = (endpoint_t *) arg;
+// Devices being mounted (enumerating, or waiting on a hub port to do so)
+static uint8_t  mounting;
+static uint64_t mount_start; // When the first of them started
 
-    // Prepare to advance the enumeration
-    static uint8_t step;
-    static uint8_t new_addr;
+void mount_begin() {
+    if (!mounting++) mount_start = time_us_64();
+}
 
-    if (!ep) step = ENUMERATION_START;
+// Show how long it took once every device is mounted
+void mount_end() {
+    if (!mounting || --mounting) return;
 
-    // TODO: We need a way to ensure only one device enumerating at a time!
+    uint32_t us = time_us_64() - mount_start;
+    enum_info("All devices mounted in %u.%03u ms\n", us / 1000, us % 1000);
+    cache_save();
+}
 
-    switch (step++) {
+// Configure a device from its cache entry instead of reading its descriptors
+void use_cache(endpoint_t *ep) {
+    device_t *dev = get_device(ep->dev_addr);
+
+    enum_info("Descriptors cached, skipping to SET_CONFIG\n");
+    cache_hit(dev, ep->user_buf); // Drivers look at it in ctrl_buf
+    show_configuration_descriptor(ep->user_buf);
+    enable_drivers(ep);
+
+    enum_debug("Starting SET_CONFIG\n");
+    dev->step = ENUMERATION_SET_CONFIG;
+    set_configuration(ep, 1);
+}
+
+// The device is ready, let its drivers configure it
+void finish_enumeration(endpoint_t *ep) {
+    device_t *dev = get_device(ep->dev_addr);
+    dev->state = DEVICE_ACTIVE;
+    dev->step  = ENUMERATION_END;
+    if (!dev->pending) cache_done(dev); // Or once the serial number is read
+
+    configure_drivers(ep->dev_addr);
+    hub_work(); // New hubs look at their ports
+    dev->mounting = false;
+    mount_end();
+}
+
+// A string read by the fast path is back
+void got_string(endpoint_t *ep, uint8_t status, uint8_t *buf, uint32_t len) {
+    device_t *dev   = get_device(ep->dev_addr);
+    uint8_t   index = dev->setup.wValue & 0xff; // Low byte is the index
+    uint8_t   n     = index == dev->serial  ? CACHE_SERIAL
+                    : index == dev->product ? CACHE_PRODUCT
+                    :                         CACHE_MANUFACTURER;
+
+    if (status) {
+        enum_error("String #%u of device %u failed (status %u)\n",
+                   index, ep->dev_addr, status);
+        cache_drop(dev); // The serial number may be the one that's missing
+    } else {
+        show_string(index, buf, len);
+        cache_string(dev, n, buf, len);
+    }
+    if (--dev->pending) return;
+
+    cache_done(dev);
+    if (!mounting) cache_save();
+}
+
+// Get the next string, or finish when there are none left. Strings are only
+// fetched to show them, and the serial number to cache the device. The fast
+// path queues them all at once and finishes right away, so they go out back
+// to back without holding up the device's drivers.
+void next_string(endpoint_t *ep) {
+    device_t *dev = get_device(ep->dev_addr);
+    uint8_t   index[] = { dev->manufacturer, dev->product, dev->serial };
+
+    // A cached device has its strings already
+    if (cache_show_strings(dev, index)) dev->strings = sizeof(index);
+
+    while (dev->strings < sizeof(index)) {
+        uint8_t n = dev->strings++;
+        bool    show = LOG_ENUM >= LOG_INFO;
+        bool    keep = n == CACHE_SERIAL && dev->cache;
+        if (!index[n] || !(show || keep)) continue;
+
+        if (USER_FAST_ENUM) {
+            dev->pending++;
+            get_string_descriptor(ep, index[n], got_string);
+            continue;
+        }
+        dev->step = ENUMERATION_GET_STRING;
+        get_string_descriptor(ep, index[n], enumerate);
+        return;
+    }
+    finish_enumeration(ep);
+}
+
+// Give up on a device when one of its control transfers failed even after the
+// retries. It's left unused until it's plugged in again, but a string that
+// failed is only left out.
+void enumeration_failed(endpoint_t *ep, uint8_t status) {
+    device_t *cur = get_device(ep->dev_addr);
+
+    if (cur->step == ENUMERATION_GET_STRING) {
+        enum_error("String #%u of device %u failed (status %u)\n",
+                   cur->setup.wValue & 0xff, ep->dev_addr, status);
+        cache_drop(cur); // The serial number may be the one that's missing
+        next_string(ep);
+        return;
+    }
+
+    // Dev0 frees up address zero for the next hub port, along with the device
+    // that had an address coming
+    uint8_t dev_addr = ep->dev_addr ? ep->dev_addr : dev0->new_addr;
+    enum_error("Enumeration of device %u failed (status %u)\n", dev_addr,
+               status);
+    if (dev_addr) remove_device(dev_addr); // Either one ends its mounting
+    if (!ep->dev_addr) {
+        reset_device(0);
+        hubh_resume();
+    }
+}
+
+// Advance the enumeration of the device that ep belongs to, called as each of
+// its control transfers is done (dev0 starts with ep set to epx)
+void enumerate(endpoint_t *ep, uint8_t status, uint8_t *buf, uint32_t len) {
+    device_t *cur = get_device(ep->dev_addr);
+
+    if (status) {
+        enumeration_failed(ep, status);
+        return;
+    }
+
+    switch (cur->step++) {
 
         case ENUMERATION_START:
-            printf("Enumeration started\n");
+            enum_info("Enumeration started\n");
 
-            printf("Starting GET_MAXSIZE\n");
+            enum_debug("Starting GET_MAXSIZE\n");
             get_device_descriptor(epx); // TODO: We need to make sure we snag the value right when it comes back
             break;
 
         case ENUMERATION_GET_MAXSIZE: {
-            uint8_t maxsize0 =
-                ((usb_device_descriptor_t *) epx->user_buf)->bMaxPacketSize0;
+            uint8_t maxsize0 = ((usb_device_descriptor_t *) buf)->bMaxPacketSize0;
 
-            // Allocate a new device
-            new_addr      = next_dev_addr();
+            // Keep the device descriptor if the fast path got all of it
+            dev0_desc.bLength = 0;
+            if (len == sizeof(dev0_desc)) memcpy(&dev0_desc, buf, len);
+
+            // Allocate a new device, which takes over after SET_ADDRESS
+            uint8_t new_addr = next_dev_addr();
             device_t *dev = get_device(new_addr);
             dev->state    = DEVICE_ENUMERATING;
             dev->speed    = dev0->speed;
+            dev->hub_addr = dev0->hub_addr;
+            dev->hub_port = dev0->hub_port;
+            dev->step     = ENUMERATION_GET_DEVICE;
+            dev0->new_addr = new_addr;
 
             // Allocate EP0 on the new device (uses the shared ctrl_buf buffer)
             endpoint_t *ep = next_endpoint(new_addr, &((usb_endpoint_descriptor_t) {
@@ -841,67 +2531,196 @@ void enumerate(void *arg) {
             }), ctrl_buf);
             ep->dev_addr = new_addr;
 
-            printf("Starting SET_ADDRESS\n");
+            enum_debug("Starting SET_ADDRESS\n");
             set_device_address(ep);
         }   break;
 
         case ENUMERATION_SET_ADDRESS: {
-            endpoint_t *ep  = find_endpoint(new_addr, 0);
+            endpoint_t *ep  = find_endpoint(dev0->new_addr, 0);
             device_t   *dev = get_device(ep->dev_addr);
 
-            dev0->state = DEVICE_ALLOCATED;
-            dev->state  = DEVICE_ADDRESSED;
+            dev0->state    = DEVICE_ALLOCATED;
+            dev->state     = DEVICE_ADDRESSED;
+            dev->mounting  = dev0->mounting; // It's counted from here on
+            dev0->mounting = false;
+            usb_device_descriptor_t d = dev0_desc; // Before dev0 is used again
+            hubh_resume(); // Address zero is free for the next hub port
+
+            // The fast path may have the device descriptor already
+            if (d.bLength) {
+                enum_debug("Device descriptor already read, skipping GET_DEVICE\n");
+                enumerate(ep, TRANSFER_SUCCESS, (uint8_t *) &d, sizeof(d));
+                break;
+            }
 
-            printf("Starting GET_DEVICE\n");
+            enum_debug("Starting GET_DEVICE\n");
             get_device_descriptor(ep);
         }   break;
 
         case ENUMERATION_GET_DEVICE: {
-            show_device_descriptor(ep->user_buf);
-            uint8_t len = sizeof(usb_configuration_descriptor_t);
+            usb_device_descriptor_t *d = (usb_device_descriptor_t *) buf;
+            show_device_descriptor(d);
+
+            // Keep what identifies the device
+            cur->class        = d->bDeviceClass;
+            cur->subclass     = d->bDeviceSubClass;
+            cur->protocol     = d->bDeviceProtocol;
+            cur->vid          = d->idVendor;
+            cur->pid          = d->idProduct;
+            cur->version      = d->bcdDevice;
+            cur->manufacturer = d->iManufacturer;
+            cur->product      = d->iProduct;
+            cur->serial       = d->iSerialNumber;
+
+            // A device seen before skips to SET_CONFIG once its serial matches
+            cur->cache = cache_find(d);
+            if (cur->cache && cur->serial) {
+                enum_debug("Starting GET_SERIAL\n");
+                cur->step = ENUMERATION_GET_SERIAL;
+                get_string_descriptor(ep, cur->serial, enumerate);
+                break;
+            } else if (cur->cache) {
+                use_cache(ep);
+                break;
+            }
+            cache_new(cur, d);
+            read_configuration(ep);
+        }   break;
 
-            printf("Starting GET_CONFIG_SHORT (%u bytes)\n", len);
-            get_configuration_descriptor(ep, len);
+        case ENUMERATION_GET_SERIAL: {
+            if (cache_serial(cur, buf, len)) {
+                use_cache(ep);
+                break;
+            }
+            read_configuration(ep);
         }   break;
 
         case ENUMERATION_GET_CONFIG_SHORT: {
-            uint8_t len =
-                ((usb_configuration_descriptor_t *) ep->user_buf)->wTotalLength;
-            if (len > MAX_TEMP) {
-                show_configuration_descriptor(ep->user_buf);
-                panic("Configuration descriptor too large");
+            uint16_t size = ((usb_configuration_descriptor_t *) buf)->wTotalLength;
+            if (size > MAX_CTRL) {
+                show_configuration_descriptor(buf);
+                enum_error("Configuration descriptor too large (%u bytes, %u"
+                           " fit)\n", size, MAX_CTRL);
+                enumeration_failed(ep, TRANSFER_INVALID);
+                break;
+            }
+
+            // A read that got all of it doesn't need another one
+            if (len >= size) {
+                enum_debug("Configuration descriptor complete (%u bytes)\n", size);
+                enumerate(ep, status, buf, size);
+                break;
             }
 
-            printf("Starting GET_CONFIG_FULL (%u bytes)\n", len);
-            get_configuration_descriptor(ep, len);
+            enum_debug("Starting GET_CONFIG_FULL (%u bytes)\n", size);
+            get_configuration_descriptor(ep, size);
         }   break;
 
         case ENUMERATION_GET_CONFIG_FULL: {
-            show_configuration_descriptor(ep->user_buf);
+            show_configuration_descriptor(buf);
+            cache_config(cur, buf, len);
             enable_drivers(ep);
 
-            printf("Starting SET_CONFIG\n");
+            enum_debug("Starting SET_CONFIG\n");
             set_configuration(ep, 1);
         }   break;
 
         case ENUMERATION_SET_CONFIG:
-            device_t *dev = get_device(ep->dev_addr);
-            dev->state = DEVICE_ACTIVE;
+            enum_info("Enumeration completed\n");
+            next_string(ep);
+            break;
+
+        case ENUMERATION_GET_STRING:
+            show_string(cur->setup.wValue & 0xff, buf, len); // Low byte is the index
+            cache_string(cur, cur->strings - 1, buf, len);
+            next_string(ep);
+            break;
+    }
+}
+
+// Start enumerating a new device, which answers at address zero until then
+void start_enumeration(uint8_t speed, uint8_t hub_addr, uint8_t hub_port) {
+    mount_begin();
+    reset_device(0);
+    dev0->mounting = true;
+    dev0->state    = DEVICE_ENUMERATING;
+    dev0->speed    = speed;
+    dev0->hub_addr = hub_addr;
+    dev0->hub_port = hub_port;
+
+    // Show the device connection and speed
+    char *str = speed == LOW_SPEED ? "low" : "full";
+    if (hub_addr) {
+        enum_info("Device connected to hub %u port %u (%s speed)\n",
+                  hub_addr, hub_port, str);
+    } else {
+        enum_info("Device connected (%s speed)\n", str);
+    }
+
+    enumerate(epx, TRANSFER_SUCCESS, NULL, 0); // Starts at ENUMERATION_START
+}
+
+// A device on the root port is left to settle, then the port is reset, and it
+// gets time to recover before it's enumerated. Each step waits on a timer, so
+// usb_task() goes on meanwhile, and a connect or disconnect that comes first
+// (a bouncing plug) starts it over or ends it.
+
+enum { // Root port steps, each taken when the wait before it is over
+    ROOT_IDLE,
+    ROOT_DEBOUNCE, // The connection was stable for ATTACH_MS
+    ROOT_RESET,    // The bus reset is over
+    ROOT_RECOVERY, // Waited for reset recovery
+};
+
+static struct {
+    uint8_t step ; // Next step (ROOT_*)
+    uint8_t speed; // Speed of the device
+    later_t wait ; // Until the next step
+} root;
 
-            printf("Enumeration completed\n");
+void root_step(void *arg); // Forward declaration
 
-            show_string_blocking(ep, 1);
-            show_string_blocking(ep, 2);
-            show_string_blocking(ep, 3);
+// Wait, then take the next step
+SDK_INLINE void root_wait(uint8_t step, uint32_t ms) {
+    root.step = step;
+    call_later(&root.wait, root_step, NULL, ms);
+}
+
+// Take the next step on the root port
+void root_step(void *arg) {
+    switch (root.step) {
+        case ROOT_DEBOUNCE:
+            enum_debug("Resetting the root port\n");
+            usb_hw_set->sie_ctrl = USB_SIE_CTRL_RESET_BUS_BITS;
+            root_wait(ROOT_RESET, RESET_MS);
+            break;
+
+        case ROOT_RESET:
+            root_wait(ROOT_RECOVERY, RECOVERY_MS);
+            break;
 
+        case ROOT_RECOVERY:
+            root.step = ROOT_IDLE;
+            start_enumeration(root.speed, 0, 0);
             break;
     }
 }
 
+// Start over on a connect, or stop on a disconnect (speed is DISCONNECTED)
+void root_connect(uint8_t speed) {
+    root.speed = speed;
+    if (speed) {
+        root_wait(ROOT_DEBOUNCE, ATTACH_MS);
+    } else {
+        root.step = ROOT_IDLE;
+        cancel_later(&root.wait);
+    }
+}
+
 // ==[ Setup USB Host ]=========================================================
 
 void setup_usb_host() {
-    printf("USB host reset\n\n");
+    xfer_info("USB host reset\n\n");
 
     // Reset controller
     reset_block       (RESETS_RESET_USBCTRL_BITS);
@@ -930,11 +2749,15 @@ void setup_usb_host() {
 
     irq_set_enabled(USBCTRL_IRQ, true);
 
-    printf( "┌───────┬──────┬─────────────────────────────────────┬────────────┐\n");
     reset_devices();
     reset_endpoints();
+    cache_init();
+
+#if LOG_ISR >= LOG_DEBUG
+    printf( "┌───────┬──────┬─────────────────────────────────────┬────────────┐\n");
     bindump("│INT", usb_hw->inte);
     printf( "└───────┴──────┴─────────────────────────────────────┴────────────┘\n");
+#endif
 }
 
 // ==[ Tasks ]==================================================================
@@ -961,15 +2784,122 @@ typedef struct {
 
         struct {
             endpoint_t *ep;     // TODO: Risky to just sent this pointer?
-            uint16_t    len;    // TODO: Should we point to a safe buffer of this length?
-            uint8_t     status; // TODO: Are we even using this?
+            uint8_t    *buf;    // Caller's buffer (the next one can be active)
+            uint32_t    len;    // Bytes transferred (into the caller's buffer)
+            uint8_t     status; // Passed on to the callback (TRANSFER_*)
         } transfer;
     };
 } task_t;
 
 static uint32_t guid = 1;
 
-static queue_t *queue = &((queue_t) { 0 });
+// Tasks pass from isr_usbctrl to usb_task through rings with one producer
+// and one consumer, so neither side takes a lock or waits for the other. Each
+// side only writes its own index, and they run freely through all 32 bits, so
+// head - tail is the number waiting even after they wrap. Adding is a copy and
+// a store, which keeps the ISR short and bounded even when a ring is full.
+//
+// There is a ring for each priority lane. Every pass of usb_task() serves the
+// lanes in order, each up to its budget, so finished transfers are handed on
+// first, while a burst of hot-plug work still can't hold them up for long and
+// can't be starved by them either.
+enum {
+    LANE_TRANSFER, // Transfers on configured devices (their status stage is done)
+    LANE_DRIVER  , // Callbacks and hub work (port changes, hub requests)
+    LANE_ENUM    , // Connects, disconnects and enumeration
+    MAX_LANES    ,
+};
+
+static const uint8_t lane_budget[MAX_LANES] = { // Tasks per pass
+    [LANE_TRANSFER] = 16,
+    [LANE_DRIVER  ] =  4,
+    [LANE_ENUM    ] =  1,
+};
+
+typedef struct {
+    task_t            slot[MAX_TASKS];
+    volatile uint32_t head ; // Tasks ever added   (isr_usbctrl only)
+    volatile uint32_t tail ; // Tasks ever removed (usb_task only)
+    uint32_t          high ; // Most tasks waiting at once
+    uint32_t          drops; // Tasks dropped because the ring was full
+} lane_t;
+
+static lane_t lanes[MAX_LANES];
+
+SDK_INLINE bool tasks_empty() {
+    for (uint8_t i = 0; i < MAX_LANES; i++)
+        if (lanes[i].head != lanes[i].tail) return false;
+    return true;
+}
+
+// Pick the lane for a task (isr_usbctrl reads device state set by usb_task,
+// but a device can't change state while its control transfer is active)
+SDK_INLINE uint8_t task_lane(const task_t *task) {
+    if (task->type == TASK_CALLBACK) return LANE_DRIVER;
+    if (task->type == TASK_CONNECT ) return LANE_ENUM;
+
+    device_t *dev = get_device(task->transfer.ep->dev_addr);
+    if (dev->state != DEVICE_ACTIVE ) return LANE_ENUM;
+    if (dev->class == USB_CLASS_HUB ) return LANE_DRIVER;
+    return LANE_TRANSFER;
+}
+
+// Add a task from isr_usbctrl, returns false if it was dropped
+SDK_INLINE bool task_add(const task_t *task) {
+    lane_t  *lane = &lanes[task_lane(task)];
+    uint32_t head = lane->head;
+    uint32_t used = head - __atomic_load_n(&lane->tail, __ATOMIC_ACQUIRE);
+
+    if (used == MAX_TASKS) {
+        lane->drops++;
+#if !USER_TASK_DROP
+        panic("Task ring overflow");
+#endif
+        return false;
+    }
+    lane->slot[head & (MAX_TASKS - 1)] = *task;
+    __atomic_store_n(&lane->head, head + 1, __ATOMIC_RELEASE);
+    if (used >= lane->high) lane->high = used + 1;
+    return true;
+}
+
+// Take the next task from a lane in usb_task, returns false if there isn't one
+SDK_INLINE bool task_remove(uint8_t i, task_t *task) {
+    lane_t  *lane = &lanes[i];
+    uint32_t tail = lane->tail;
+
+    if (__atomic_load_n(&lane->head, __ATOMIC_ACQUIRE) == tail) return false;
+    *task = lane->slot[tail & (MAX_TASKS - 1)];
+    __atomic_store_n(&lane->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Take the next task, serving each lane up to its budget in this pass (lane
+// and done start at 0 for each pass)
+SDK_INLINE bool task_next(task_t *task, uint8_t *lane, uint8_t *done) {
+    for (; *lane < MAX_LANES; (*lane)++, *done = 0) {
+        if (*done < lane_budget[*lane] && task_remove(*lane, task)) {
+            (*done)++;
+            return true;
+        }
+    }
+    if (tasks_empty()) tight_loop_contents(); // New tasks come from the ISR
+    return false;
+}
+
+// Lanes let newer tasks overtake older ones, so a task can still be waiting
+// for an endpoint that a later one freed. Those are dropped when it's freed
+// (only usb_task touches the waiting slots, and only it frees endpoints).
+void tasks_forget(endpoint_t *ep) {
+    for (uint8_t i = 0; i < MAX_LANES; i++) {
+        uint32_t head = __atomic_load_n(&lanes[i].head, __ATOMIC_ACQUIRE);
+        for (uint32_t k = lanes[i].tail; k != head; k++) {
+            task_t *task = &lanes[i].slot[k & (MAX_TASKS - 1)];
+            if (task->type == TASK_TRANSFER && task->transfer.ep == ep)
+                task->transfer.ep = NULL;
+        }
+    }
+}
 
 SDK_INLINE const char *task_name(uint8_t type) {
     switch (type) {
@@ -982,89 +2912,197 @@ SDK_INLINE const char *task_name(uint8_t type) {
 }
 
 SDK_INLINE const char *callback_name(void (*fn) (void *)) {
-    if (fn == enumerate   ) return "enumerate";
     if (fn == transfer_zlp) return "transfer_zlp";
-    printf("Calling unknown callback function\n");
+    xfer_error("Calling unknown callback function\n");
     return "";
 }
 
 void usb_task() {
-    task_t task;
+    task_t  task;
+    uint8_t lane = 0, done = 0;
 
-    while (queue_try_remove(queue, &task)) {
+    // Only here, so callbacks can use ctrl_buf before EPX moves on
+    epx_next();
+    call_due();
+
+    while (task_next(&task, &lane, &done)) {
         uint8_t type = task.type;
-        printf("\n=> %u) New task, %s\n\n", task.guid, task_name(type)); // ~3 ms (sprintf was ~31 μs, ring_printf was 37 μs)
+        trace_flush(); // Show what the ISR did before this task was queued
+        xfer_debug("\n=> %u) New task, %s\n\n", task.guid, task_name(type)); // ~3 ms (sprintf was ~31 μs, ring_printf was 37 μs)
         switch (type) {
 
             case TASK_CALLBACK: {
-                printf("Calling %s\n", callback_name(task.callback.fn));
+                xfer_debug("Calling %s\n", callback_name(task.callback.fn));
                 task.callback.fn(task.callback.arg);
             }   break;
 
             case TASK_CONNECT: {
-                static uint64_t last_attempt;
 
-                // For now, ignore rapid device connects
-                if (last_attempt && (time_us_64() - last_attempt < 1000000)) {
-                    printf("Connections allowed only once every second\n");
-                    break;
+                // A disconnect takes everything on the root port with it
+                root_connect(task.connect.speed);
+                if (!task.connect.speed) {
+                    enum_info("Device disconnected\n");
+                    for (uint8_t i = 1; i < MAX_DEVICES; i++)
+                        if (devices[i].state && !devices[i].hub_addr)
+                            remove_device(i);
+                    reset_device(0);
                 }
-                last_attempt = time_us_64();
-
-                // Initialize dev0
-                reset_device(0); // TODO: Is this really necessary?
-                dev0->state = DEVICE_ENUMERATING;
-                dev0->speed = task.connect.speed;
-
-                // Show the device connection and speed
-                char *str = dev0->speed == LOW_SPEED ? "low" : "full";
-                printf("Device connected (%s speed)\n", str);
-
-                // Start enumeration
-                enumerate(NULL);
-
             }   break;
 
             case TASK_TRANSFER: {
                 endpoint_t *ep  = task.transfer.ep;
-                uint16_t    len = task.transfer.len;
-
-                // Handle the transfer
-                device_t *dev = get_device(ep->dev_addr);
-                if (len) {
-                    printf("Calling transfer_zlp\n");
-                    transfer_zlp(ep);
-                } else if (dev->state < DEVICE_ACTIVE) {
-                    printf("Calling enumerate\n");
-                    enumerate(ep);
+                uint32_t    len = task.transfer.len;
+
+                // The endpoint was freed by a task that overtook this one
+                if (!ep) {
+                    xfer_debug("Endpoint is gone\n");
+                    break;
+                }
+
+                // EPX is free (the ISR already did the status stage)
+                bool     ctl  = ep->type == USB_TRANSFER_TYPE_CONTROL;
+                uint32_t save = save_and_disable_interrupts();
+                if (ctl && ep == epx_owner) epx_owner = NULL;
+                restore_interrupts(save);
+
+                // A failed transfer halted its endpoint (the callback can
+                // queue more transfers, they start once the halt is cleared)
+                if (task.transfer.status && !ctl) clear_halt(ep);
+
+                // Let the caller know the transfer is done
+                endpoint_c cb = ep_info(ep)->cb;
+                if (cb) {
+                    xfer_debug("Calling endpoint callback\n");
+                    cb(ep, task.transfer.status, task.transfer.buf, len);
                 } else {
-                    printf("Transfer completed\n");
+                    xfer_debug("Transfer completed\n");
                 }
+
+                // The callback is done with ctrl_buf, so the next one can go
+                if (ctl && ep_info(ep)->configured) control_next(ep);
+
+                // Nothing left on the endpoint to watch
+                if (!ep->active) cancel_later(&ep_info(ep)->deadline);
            }   break;
 
             default:
-                printf("Unknown task queued\n");
+                xfer_error("Unknown task queued\n");
                 break;
         }
         // printf("=> %u) Finish task: %s\n", task.guid, task_name(type));
     }
+    trace_flush();
 }
 
 // ==[ Interrupts ]=============================================================
 
-SDK_INLINE void printf_interrupts(uint32_t ints) {
-    if (ints & USB_INTS_HOST_CONN_DIS_BITS   ) printf(", device"  );
-    if (ints & USB_INTS_STALL_BITS           ) printf(", stall"   );
-    if (ints & USB_INTS_BUFF_STATUS_BITS     ) printf(", buffer"  );
-    if (ints & USB_INTS_TRANS_COMPLETE_BITS  ) printf(", last"    );
-    if (ints & USB_INTS_ERROR_RX_TIMEOUT_BITS) printf(", timeout" );
-    if (ints & USB_INTS_ERROR_DATA_SEQ_BITS  ) printf(", dataseq" );
-    if (ints & USB_INTS_HOST_RESUME_BITS     ) printf(", power"   );
+// Finish a transfer and queue its task, returns true if data was recorded
+// (the trace then shows its length rather than a ZLP)
+bool complete_transfer(endpoint_t *ep, uint8_t status) {
+
+    // Get the transfer length (actual bytes transferred)
+    uint32_t len = ep->bytes_done;
+    uint8_t *buf = ep->user_buf;
+
+    // Debug output
+    trace_t *t = trace_new(TRACE_XFER, ep, status, guid);
+    if (t) t->reg[0] = len;
+    if (len && buf) trace_data(TRACE_XDATA, ep, buf, MIN(len, TRACE_SHOW));
+
+    // Clear the endpoint (since its complete)
+    endpoint_info_t *info = ep_info(ep);
+    info->bytes += len;
+    info->tries  = 0;
+    clear_endpoint(ep);
+
+    // Control transfers go on from their data stage to the status stage (a ZLP
+    // the other way) right here, and usb_task() only hears about the whole
+    // transfer, with the length of its data stage (or what it got of it)
+    if (ep->type == USB_TRANSFER_TYPE_CONTROL) {
+        device_t *dev = get_device(ep->dev_addr);
+        if (!status && !ep->zlp && dev->setup.wLength) {
+            dev->ctrl_len = len;
+            ep->zlp       = true;
+            transfer_zlp(ep); // Keeps EPX
+            return len != 0;
+        }
+        if (ep->zlp) len = dev->ctrl_len;
+        ep->zlp = false;
+    }
+    info->xfers++;
+
+    // Queue the transfer task
+    task_add(&((task_t) {
+        .type            = TASK_TRANSFER,
+        .guid            = guid++,
+        .transfer.ep     = ep,
+        .transfer.buf    = buf,
+        .transfer.len    = len,
+        .transfer.status = status,
+    }));
+
+    // A failed transfer halts the endpoint until usb_task() has cleared it,
+    // otherwise the next queued transfer waits for its turn
+    if (status && ep->type != USB_TRANSFER_TYPE_CONTROL) {
+        ep->active = true;
+    } else if (dequeue_transfer(ep)) {
+        ep->active = true;
+        epx_wait(ep);
+    }
+
+    // Bulk data is in the caller's buffer, so hand on EPX right away
+    if (ep == epx_owner && ep->type == USB_TRANSFER_TYPE_BULK) {
+        epx_owner = NULL;
+        epx_next();
+    }
+
+    return len != 0;
+}
+
+// The endpoint's turn on EPX is over, let the next one in line have it
+void yield_epx(endpoint_t *ep) {
+    epx_owner = NULL;
+    epx_wait(ep);
+    epx_next();
+}
+
+// A transaction failed. EPX and the polled endpoints share the error flags,
+// so first see whose it was: a polled slot that failed has its bit set in
+// EP_STATUS_STALL_NAK (laid out like BUFF_STATUS), and the hardware tries it
+// again at its next interval. Otherwise it was EPX's, if the endpoint in the
+// DAR still owns it. Its transfer goes on from where it stopped, right away
+// the first time or after a bad DATA0/DATA1 (which is a packet the device sent
+// again since it missed our ACK), and after a backoff that doubles each time
+// for timeouts. A stall, or running out of retries, ends the transfer with
+// that status.
+void transfer_error(endpoint_t *ep, uint8_t status) {
+    uint32_t bits = usb_hw->ep_nak_stall_status & ~3u; // Polled slots only
+    if (bits) usb_hw_clear->ep_nak_stall_status = bits;
+    if (bits || !ep || ep != epx_owner || !ep->active ||
+        later_waiting(&retry)) {
+        xfer_stats.polled++;
+        return;
+    }
+
+    endpoint_info_t *info = ep_info(ep);
+    rewind_buffers(ep);
+    if (status != TRANSFER_STALLED && info->tries < USER_RETRIES) {
+        uint8_t tries = info->tries++;
+        xfer_stats.retries++;
+        trace_new(TRACE_RETRY, ep, status, tries + 1);
+        if (status == TRANSFER_TIMEOUT && tries) {
+            call_later(&retry, retry_over, ep, RETRY_MS << (tries - 1));
+        } else {
+            transfer_retry(ep);
+        }
+        return;
+    }
+    xfer_stats.failures++;
+    complete_transfer(ep, status);
 }
 
 // Interrupt handler
 void isr_usbctrl() {
-    task_t task;
 
     // Load some registers into local variables
     uint32_t ints = usb_hw->ints;
@@ -1075,29 +3113,26 @@ void isr_usbctrl() {
 
     // Fix RP2040-E4 by shifting buffer control registers for affected buffers
     if (!dub && (usb_hw->buf_cpu_should_handle & 1u)) bcr >>= 16; // Fix EPX
-    // TODO: Add a similar fix for all polled endpoints
 
     // Get device address and endpoint information
     uint8_t dev_addr =  dar & USB_ADDR_ENDP_ADDRESS_BITS;
     uint8_t ep_addr  = (dar & USB_ADDR_ENDP_ENDPOINT_BITS) >>
                               USB_ADDR_ENDP_ENDPOINT_LSB;
-    endpoint_t *ep = find_endpoint(dev_addr, ep_addr);
-
-    // Show system state
-    printf( "\n=> %u) New ISR", guid++);
-    printf_interrupts(ints);
-    printf( "\n\n");
-    printf( "┌───────┬──────┬─────────────────────────────────────┬────────────┐\n");
-    printf( "│Frame  │ %4u │ %-35s", usb_hw->sof_rd, "Interrupt Handler");
-    show_endpoint(ep);
-    printf( "├───────┼──────┼─────────────────────────────────────┼────────────┤\n");
-    bindump("│INTR", usb_hw->intr);
-    bindump("│INTS", ints);
-    bindump("│DAR" , dar);
-    bindump("│SSR" , usb_hw->sie_status);
-    bindump("│SCR" , usb_hw->sie_ctrl);
-    bindump("│ECR" , ecr);
-    bindump("│BCR" , bcr);
+    if (usb_hw->sie_ctrl & USB_SIE_CTRL_RECEIVE_DATA_BITS) // Direction is not
+        ep_addr |= USB_DIR_IN;                             // part of the DAR
+    endpoint_t *ep = lookup_endpoint(dev_addr, ep_addr); // NULL if it was freed
+
+    // Record system state (tools/tracedump shows it like the old printf boxes)
+    trace_t *t = trace_new(TRACE_ISR, ep, 0, guid++);
+    if (t) {
+        t->reg[0] = usb_hw->intr;
+        t->reg[1] = ints;
+        t->reg[2] = dar;
+        t->reg[3] = usb_hw->sie_status;
+        t->reg[4] = usb_hw->sie_ctrl;
+        t->reg[5] = ecr;
+        t->reg[6] = bcr;
+    }
     bool flat = false; // For the last line of debug output
 
     // Connection (attach or detach)
@@ -1115,16 +3150,23 @@ void isr_usbctrl() {
         if (speed) {
 
             // Show connection info
-            printf( "├───────┼──────┼─────────────────────────────────────┼────────────┤\n");
-            printf( "│CONNECT│ %-4s │ %-35s │ Task #%-4u │\n", "", "New device connected", guid);
+            trace_new(TRACE_CONNECT, ep, 0, guid);
 
-            queue_add_blocking(queue, &((task_t) { // ~20 μs
+            task_add(&((task_t) { // ~20 μs
                 .type          = TASK_CONNECT,
                 .guid          = guid++,
                 .connect.speed = speed,
             }));
         } else {
-            reset_epx(); // TODO: There's more to do here
+            usb_hw->dev_addr_ctrl = 0; // The device and its endpoints are gone
+            usb_hw->int_ep_ctrl   = 0; // Stop polling them right away
+            reset_epx();
+
+            task_add(&((task_t) { // Speed 0 is a disconnect
+                .type          = TASK_CONNECT,
+                .guid          = guid++,
+                .connect.speed = DISCONNECTED,
+            }));
         }
     }
 
@@ -1134,16 +3176,8 @@ void isr_usbctrl() {
 
         usb_hw_clear->sie_status = USB_SIE_STATUS_STALL_REC_BITS;
 
-        printf("Stall detected\n");
-
-//         // Queue the stalled transfer
-//         queue_add_blocking(queue, &((task_t) {
-//             .type            = TASK_TRANSFER,
-//             .guid            = guid++,
-//             .transfer.ep     = ep,  // TODO: Need to flesh this out
-//             .transfer.len    = 999, // TODO: Need to flesh this out
-//             .transfer.status = TRANSFER_STALLED,
-//         }));
+        trace_new(TRACE_STALL, ep, 0, 0);
+        transfer_error(ep, TRANSFER_STALLED);
     }
 
     // Buffer processing is needed
@@ -1152,25 +3186,39 @@ void isr_usbctrl() {
 
         // Find the buffer(s) that are ready
         uint32_t bits = usb_hw->buf_status;
-        uint32_t mask = 1u;
 
         // Show single/double buffer status of EPX and which buffers are ready
-        printf( "├───────┼──────┼─────────────────────────────────────┼────────────┤\n");
-        bindump(dub ? "│BUF/2" : "│BUF/1", bits);
-
-        // Lookup the endpoint
-        handle_buffers(ep); usb_hw_clear->buf_status = 0x1; bits ^= 0x1; // TODO: TOTAL HACK!
-
-//         // Check the polled endpoints (IN and OUT)
-//         for (uint8_t i = 0; i < MAX_ENDPOINTS && bits; i++) {
-//             for (uint8_t j = 0; j < 2; j++) {
-//                 mask = 1 << (i * 2 + j);
-//                 if (bits &  mask) {
-//                     bits ^= mask;
-//                     handle_buffers(&eps[i]);
-//                 }
-//             }
-//         }
+        t = trace_new(TRACE_BUFFERS, ep, dub, 0);
+        if (t) t->reg[0] = bits;
+
+        // EPX uses bit 0
+        if (bits &  1u) {
+            bits ^= 1u;
+            if (ep) handle_buffers(ep, 1u);
+            usb_hw_clear->buf_status = 1u;
+        }
+
+        // Polled slot i uses bit 2(i+1) for IN and 2(i+1)+1 for OUT
+        for (uint8_t i = 0; i < MAX_POLLED && bits; i++) {
+            uint32_t mask = bits & (3u << (i * 2 + 2));
+            if (!mask) continue;
+            bits ^= mask;
+
+            // The slot was freed after its buffer was done, so just ack it
+            if (!polled[i]) {
+                usb_hw_clear->buf_status = mask;
+                continue;
+            }
+
+            // Polled endpoints have no TRANS_COMPLETE, so finish them here
+            // (early if their ring has no room for the next packet)
+            handle_buffers(polled[i], mask);
+            usb_hw_clear->buf_status = mask;
+            if (!polled[i]->bytes_left)
+                flat = complete_transfer(polled[i], TRANSFER_SUCCESS);
+            else if (polled[i]->yielding)
+                flat = complete_transfer(polled[i], TRANSFER_INVALID);
+        }
 
         // Panic if we missed any buffers
         if (bits) panic("Unhandled buffer mask: %032b", bits);
@@ -1182,35 +3230,17 @@ void isr_usbctrl() {
 
         usb_hw_clear->sie_status = USB_SIE_STATUS_TRANS_COMPLETE_BITS;
 
-        // Panic if the endpoint is not active
-        if (!ep->active) panic("Endpoints must be active to be completed");
-
-        // Get the transfer length (actual bytes transferred)
-        uint16_t len = ep->bytes_done;
+        // Panic if the endpoint is not active (unless it was freed)
+        if (ep && !ep->active) panic("Endpoints must be active to be completed");
 
-        // Debug output
-        if (len) {
-            printf( "├───────┼──────┼─────────────────────────────────────┴────────────┤\n");
-            printf( "│XFER\t│ %4u │ Device %-28u   Task #%-4u │\n", len, ep->dev_addr, guid);
-            hexdump("│Data", temp_buf, len, 1); // TODO: We should use the base buffer address for this endpoint
-            flat = true;
+        // A transfer with bytes left was cut short to give others a turn
+        if (!ep) {
+            // Its endpoint was freed meanwhile, so there's nothing to finish
+        } else if (ep->bytes_left) {
+            yield_epx(ep);
         } else {
-            char *str = ep_in(ep) ? "IN" : "OUT";
-            printf( "├───────┼──────┼─────────────────────────────────────┼────────────┤\n");
-            printf( "│ZLP\t│ %-4s │ Device %-28u │ Task #%-4u │\n", str, ep->dev_addr, guid);
+            flat = complete_transfer(ep, TRANSFER_SUCCESS);
         }
-
-        // Clear the endpoint (since its complete)
-        clear_endpoint(ep);
-
-        // Queue the transfer task
-        queue_add_blocking(queue, &((task_t) {
-            .type            = TASK_TRANSFER,
-            .guid            = guid++,
-            .transfer.ep     = ep,
-            .transfer.len    = len,
-            .transfer.status = TRANSFER_SUCCESS, // TODO: Is this needed?
-        }));
     }
 
     // Receive timeout (waited too long without seeing an ACK)
@@ -1219,9 +3249,8 @@ void isr_usbctrl() {
 
         usb_hw_clear->sie_status = USB_SIE_STATUS_RX_TIMEOUT_BITS;
 
-        printf("Receive timeout\n");
-
-        panic("Timed out waiting for data");
+        trace_new(TRACE_TIMEOUT, ep, 0, 0);
+        transfer_error(ep, TRANSFER_TIMEOUT);
     }
 
     // Data error (IN packet from device has wrong data PID)
@@ -1230,7 +3259,8 @@ void isr_usbctrl() {
 
         usb_hw_clear->sie_status = USB_SIE_STATUS_DATA_SEQ_ERROR_BITS;
 
-        panic("Data sequence error");
+        trace_new(TRACE_SEQ, ep, 0, 0);
+        transfer_error(ep, TRANSFER_FAILED);
     }
 
     // Device resumed (device initiated)
@@ -1239,7 +3269,7 @@ void isr_usbctrl() {
 
         usb_hw_clear->sie_status = USB_SIE_STATUS_RESUME_BITS;
 
-        printf("Device initiated resume\n");
+        trace_new(TRACE_RESUME, ep, 0, 0);
     }
 
     // Were any interrupts missed?
@@ -1248,19 +3278,61 @@ void isr_usbctrl() {
     // TODO: How should we deal with NAKs seen in the SSR?
     // usb_hw_clear->sie_status = 1 << 28u; // Clear the NAK???
 
-    printf("└───────┴──────┴─────────────────────────────────────%s────────────┘\n", flat ? "─" : "┴");
+    trace_new(TRACE_END, ep, flat, 0);
 }
 
 // ==[ Main ]===================================================================
 
+#if USER_CORE1
+
+// USB runs on core1, which arduino-pico starts with setup1() and loop1(). The
+// interrupt is taken by the core that enabled it, so isr_usbctrl, usb_task(),
+// the callbacks and the class drivers all stay on core1, and work on core0
+// can't delay them. Core0 keeps the console and whatever the application adds
+// to loop(). Data goes across in rings (see endpoint_ring), which either core
+// can use, and a reader on core0 is woken by the writer on core1.
+static volatile bool core0_ready; // The console is set up
+
 void setup() {
+#if USER_DRAIN
+    drain_init(USER_DRAIN_UART, USER_DRAIN_TX, USER_DRAIN, USER_DRAIN_RING);
+#endif
+    printf("\033[2J\033[H\n==[ USB host example]==\n\n");
+    core0_ready = true;
+}
+
+void setup1() {
+    while (!core0_ready) tight_loop_contents();
+    setup_usb_host();
+}
+
+void loop() {
+#if USER_DRAIN
+    drain_task();
+#endif
+}
+
+void loop1() {
+    usb_task();
+}
+
+#else
+
+void setup() {
+#if USER_DRAIN
+    drain_init(USER_DRAIN_UART, USER_DRAIN_TX, USER_DRAIN, USER_DRAIN_RING);
+#endif
     printf("\033[2J\033[H\n==[ USB host example]==\n\n");
     setup_usb_host();
 
-    queue_init(queue, sizeof(task_t), 64);
 }
 
 void loop() {
     usb_task();
+#if USER_DRAIN
+    drain_task();
+#endif
 }
 
+#endif
+
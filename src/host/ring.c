@@ -17,16 +17,11 @@
 #include "hardware/sync.h"
 #include "pico/assert.h"
 #include "pico/lock_core.h"
+#include "pico/time.h"
 
-// ==[ Init, Reset, Destroy ]===================================================
+#include "ring.h"
 
-typedef struct {
-    lock_core_t core;
-    uint8_t    *data;
-    uint16_t    size;
-    uint16_t    wptr;
-    uint16_t    rptr;
-} ring_t;
+// ==[ Init, Reset, Destroy ]===================================================
 
 void ring_init_with_spin_lock(ring_t *r, uint size, uint spin_lock_num) {
     assert(r);
@@ -36,6 +31,8 @@ void ring_init_with_spin_lock(ring_t *r, uint size, uint spin_lock_num) {
     r->size = (uint16_t) size;
     r->wptr = 0;
     r->rptr = 0;
+    r->low  = (uint16_t) size - 2; // Writers wake whenever there is room
+    r->high = 1;                   // Readers wake whenever there is data
 }
 
 ring_t *ring_new(uint size) {
@@ -44,6 +41,12 @@ ring_t *ring_new(uint size) {
     return r;
 }
 
+ring_t *ring_new_framed(uint size) {
+    ring_t *r = ring_new(size);
+    r->framed = true;
+    return r;
+}
+
 void ring_reset(ring_t *r) {
     uint32_t save = spin_lock_blocking(r->core.spin_lock);
     r->wptr = 0;
@@ -53,21 +56,24 @@ void ring_reset(ring_t *r) {
 
 void ring_destroy(ring_t *r) {
     uint32_t save = spin_lock_blocking(r->core.spin_lock);
-    free(r->data);
-    free(r);
+    uint8_t *data = r->data;
+    r->data = NULL;
     spin_unlock(r->core.spin_lock, save);
+    free(data);
+    free(r);
 }
 
 // ==[ Used, Free, Empty, Full ]================================================
 
 static inline uint16_t ring_used_unsafe(ring_t *r) {
     int32_t used = (int32_t) r->wptr - (int32_t) r->rptr;
-    if (used < 0) used += r->size + 1;
+    if (used < 0) used += r->size;
     return (uint16_t) used;
 }
 
+// One byte stays free, so that a full ring is not mistaken for an empty one
 static inline uint16_t ring_free_unsafe(ring_t *r) {
-    return r->size - ring_used_unsafe(r);
+    return r->size - 1 - ring_used_unsafe(r);
 }
 
 static inline uint16_t ring_used(ring_t *r) {
@@ -92,14 +98,51 @@ static inline bool ring_is_full(ring_t *r) {
     return ring_free(r) == 0;
 }
 
+// ==[ Watermarks ]=============================================================
+
+// A blocked writer waits for used <= low and a blocked reader for used >= high,
+// so with high above low + 1 both could wait for each other forever
+void ring_set_watermarks(ring_t *r, uint16_t low, uint16_t high) {
+    if (!high || high > r->size - 1 || low > r->size - 2)
+        panic("Ring watermarks %u and %u don't fit %u bytes", low, high,
+              r->size);
+    if (high > low + 1)
+        panic("Ring high watermark %u is above low %u + 1", high, low);
+    uint32_t save = spin_lock_blocking(r->core.spin_lock);
+    r->low  = low;
+    r->high = high;
+    spin_unlock(r->core.spin_lock, save);
+}
+
+// Unlock after adding data, waking readers only when it reaches high
+static inline void ring_unlock_added(ring_t *r, uint16_t was, uint32_t save) {
+    if (was < r->high && ring_used_unsafe(r) >= r->high) {
+        lock_internal_spin_unlock_with_notify(&r->core, save);
+    } else {
+        spin_unlock(r->core.spin_lock, save);
+    }
+}
+
+// Unlock after taking data, waking writers only when it drops to low
+static inline void ring_unlock_taken(ring_t *r, uint16_t was, uint32_t save) {
+    if (was > r->low && ring_used_unsafe(r) <= r->low) {
+        lock_internal_spin_unlock_with_notify(&r->core, save);
+    } else {
+        spin_unlock(r->core.spin_lock, save);
+    }
+}
+
 // ==[ Internal ]===============================================================
 
+// Blocked writers wait until the ring has drained to its low watermark, and
+// blocked readers until it has filled to its high watermark (or the timeout)
 static uint16_t
 ring_write_internal(ring_t *r, const void *ptr, uint16_t len, bool block) {
     do {
         uint32_t save = spin_lock_blocking(r->core.spin_lock);
+        uint16_t was = ring_used_unsafe(r);
         uint16_t cnt = ring_free_unsafe(r);
-        if (cnt) {
+        if (cnt && (!block || was <= r->low)) {
             if (len = MIN(len, cnt)) {
                 uint16_t sip = MIN(r->size - r->wptr, len);
                 if (sip < len) {
@@ -109,9 +152,10 @@ ring_write_internal(ring_t *r, const void *ptr, uint16_t len, bool block) {
                 } else {
                     memcpy(r->data + r->wptr, ptr, len);
                     r->wptr += len;
+                    if (r->wptr == r->size) r->wptr = 0;
                 }
             }
-            lock_internal_spin_unlock_with_notify(&r->core, save);
+            ring_unlock_added(r, was, save);
             return len;
         }
         if (block) {
@@ -124,11 +168,12 @@ ring_write_internal(ring_t *r, const void *ptr, uint16_t len, bool block) {
 }
 
 static uint16_t
-ring_read_internal(ring_t *r, const void *ptr, uint16_t len, bool block) {
+ring_read_internal(ring_t *r, const void *ptr, uint16_t len,
+                   absolute_time_t until) { // nil_time means don't block
     do {
         uint32_t save = spin_lock_blocking(r->core.spin_lock);
         uint16_t cnt = ring_used_unsafe(r);
-        if (cnt) {
+        if (cnt && (is_nil_time(until) || cnt >= r->high)) {
             if (len = MIN(len, cnt)) {
                 uint16_t sip = MIN(r->size - r->rptr, len);
                 if (sip < len) {
@@ -138,17 +183,19 @@ ring_read_internal(ring_t *r, const void *ptr, uint16_t len, bool block) {
                 } else {
                     memcpy((void *) ptr, r->data + r->rptr, len);
                     r->rptr += len;
+                    if (r->rptr == r->size) r->rptr = 0;
                 }
             }
-            lock_internal_spin_unlock_with_notify(&r->core, save);
+            ring_unlock_taken(r, cnt, save);
             return len;
         }
-        if (block) {
-            lock_internal_spin_unlock_with_wait(&r->core, save);
-        } else {
+        if (is_nil_time(until)) {
             spin_unlock(r->core.spin_lock, save);
             return 0;
         }
+        if (lock_internal_spin_unlock_with_best_effort_wait_or_timeout(
+                &r->core, save, until)) // Timed out, take what is there
+            return ring_read_internal(r, ptr, len, nil_time);
     } while (true);
 }
 
@@ -159,7 +206,7 @@ uint16_t ring_try_write(ring_t *r, const void *ptr, uint16_t len) {
 }
 
 uint16_t ring_try_read(ring_t *r, void *ptr, uint16_t len) {
-    return ring_read_internal(r, ptr, len, false);
+    return ring_read_internal(r, ptr, len, nil_time);
 }
 
 // ==[ Blocking ]===============================================================
@@ -169,27 +216,281 @@ uint16_t ring_write_blocking(ring_t *r, const void *ptr, uint16_t len) {
 }
 
 uint16_t ring_read_blocking(ring_t *r, void *ptr, uint16_t len) {
-    return ring_read_internal(r, ptr, len, true);
+    return ring_read_internal(r, ptr, len, at_the_end_of_time);
+}
+
+// Wait until the high watermark is reached or timeout_us has passed, then read
+// what is there (which may be nothing)
+uint16_t ring_read_timeout_us(ring_t *r, void *ptr, uint16_t len,
+                              uint32_t timeout_us) {
+    return ring_read_internal(r, ptr, len, make_timeout_time_us(timeout_us));
+}
+
+// ==[ Zero-copy ]==============================================================
+
+// Split len bytes starting at pos into what fits before the end, and the rest
+static inline void ring_spans(ring_t *r, ring_span_t span[2], uint16_t pos,
+                              uint16_t len) {
+    uint16_t sip = MIN(r->size - pos, len);
+    span[0] = (ring_span_t) { r->data + pos, sip       };
+    span[1] = (ring_span_t) { r->data      , len - sip };
+}
+
+uint16_t ring_reserve(ring_t *r, ring_span_t span[2], uint16_t len) {
+    uint32_t save = spin_lock_blocking(r->core.spin_lock);
+    len = MIN(len, ring_free_unsafe(r));
+    ring_spans(r, span, r->wptr, len);
+    spin_unlock(r->core.spin_lock, save);
+    return len;
+}
+
+void ring_commit(ring_t *r, uint16_t len) {
+    uint32_t save = spin_lock_blocking(r->core.spin_lock);
+    uint16_t was  = ring_used_unsafe(r);
+    if (len > ring_free_unsafe(r)) panic("Ring commit beyond reserve");
+    r->wptr = (r->wptr + len) % r->size;
+    ring_unlock_added(r, was, save);
+}
+
+uint16_t ring_peek(ring_t *r, ring_span_t span[2], uint16_t len) {
+    uint32_t save = spin_lock_blocking(r->core.spin_lock);
+    len = MIN(len, ring_used_unsafe(r));
+    ring_spans(r, span, r->rptr, len);
+    spin_unlock(r->core.spin_lock, save);
+    return len;
+}
+
+void ring_consume(ring_t *r, uint16_t len) {
+    uint32_t save = spin_lock_blocking(r->core.spin_lock);
+    uint16_t was  = ring_used_unsafe(r);
+    if (len > was) panic("Ring consume beyond peek");
+    r->rptr = (r->rptr + len) % r->size;
+    ring_unlock_taken(r, was, save);
+}
+
+// Write all of it or nothing, for producers that must neither wait nor split
+bool ring_try_write_all(ring_t *r, const void *ptr, uint16_t len) {
+    ring_span_t span[2];
+
+    uint32_t save = spin_lock_blocking(r->core.spin_lock);
+    uint16_t was  = ring_used_unsafe(r);
+    bool     fits = len <= ring_free_unsafe(r);
+    if (fits) {
+        ring_spans(r, span, r->wptr, len);
+        memcpy(span[0].ptr, ptr, span[0].len);
+        memcpy(span[1].ptr, (const uint8_t *) ptr + span[0].len, span[1].len);
+        r->wptr = (r->wptr + len) % r->size;
+    }
+    ring_unlock_added(r, was, save);
+    return fits;
+}
+
+// ==[ Records ]================================================================
+
+// Copy into or out of the ring at pos (wrapping), and return the next pos
+static uint16_t ring_put(ring_t *r, uint16_t pos, const void *ptr,
+                         uint16_t len) {
+    ring_span_t span[2];
+    ring_spans(r, span, pos, len);
+    memcpy(span[0].ptr, ptr, span[0].len);
+    memcpy(span[1].ptr, (const uint8_t *) ptr + span[0].len, span[1].len);
+    return (pos + len) % r->size;
+}
+
+static uint16_t ring_get(ring_t *r, uint16_t pos, void *ptr, uint16_t len) {
+    ring_span_t span[2];
+    ring_spans(r, span, pos, len);
+    memcpy(ptr, span[0].ptr, span[0].len);
+    memcpy((uint8_t *) ptr + span[0].len, span[1].ptr, span[1].len);
+    return (pos + len) % r->size;
+}
+
+// Length of the record at rptr (there must be one)
+static inline uint16_t ring_record_len(ring_t *r) {
+    uint8_t hdr[RING_RECORD_HEADER];
+    ring_get(r, r->rptr, hdr, RING_RECORD_HEADER);
+    return hdr[0] | hdr[1] << 8;
+}
+
+// Write a whole record or nothing. The header, the data and the new wptr all
+// go in under one lock, so any number of writers can share the ring.
+bool ring_write_record(ring_t *r, const void *ptr, uint16_t len) {
+    uint8_t hdr[RING_RECORD_HEADER] = { len & 0xff, len >> 8 };
+
+    uint32_t save = spin_lock_blocking(r->core.spin_lock);
+    uint16_t was  = ring_used_unsafe(r);
+    bool     fits = RING_RECORD_HEADER + len <= ring_free_unsafe(r);
+    if (fits) {
+        uint16_t pos = ring_put(r, r->wptr, hdr, RING_RECORD_HEADER);
+        r->wptr = ring_put(r, pos, ptr, len);
+    }
+    ring_unlock_added(r, was, save);
+    return fits;
+}
+
+// Read one record, returns its length (0 when there are none, or it's empty)
+uint16_t ring_read_record(ring_t *r, void *ptr, uint16_t size) {
+    uint16_t len;
+    return ring_read_records(r, ptr, size, &len, 1) ? len : 0;
+}
+
+// Read whole records into buf until it or lens is full, returns the count
+uint16_t ring_read_records(ring_t *r, void *buf, uint16_t size,
+                           uint16_t *lens, uint16_t max) {
+    uint16_t cnt = 0, off = 0;
+
+    uint32_t save = spin_lock_blocking(r->core.spin_lock);
+    uint16_t was  = ring_used_unsafe(r);
+    while (cnt < max && ring_used_unsafe(r)) {
+        uint16_t len = ring_record_len(r);
+        if (len > size - off) {
+            if (!cnt) panic("Record of %u bytes is larger than %u", len, size);
+            break;
+        }
+        uint16_t pos = (r->rptr + RING_RECORD_HEADER) % r->size;
+        r->rptr = ring_get(r, pos, (uint8_t *) buf + off, len);
+        lens[cnt++] = len;
+        off += len;
+    }
+    ring_unlock_taken(r, was, save);
+    return cnt;
+}
+
+// Reserve a record of len bytes (its header is filled in) and return the spans
+// for its data, or false if it doesn't fit. Only for a ring with one writer,
+// since the lock is let go before the record is committed.
+bool ring_reserve_record(ring_t *r, ring_span_t span[2], uint16_t len) {
+    uint8_t hdr[RING_RECORD_HEADER] = { len & 0xff, len >> 8 };
+
+    uint32_t save = spin_lock_blocking(r->core.spin_lock);
+    if (ring_free_unsafe(r) < RING_RECORD_HEADER + len) {
+        spin_unlock(r->core.spin_lock, save);
+        return false;
+    }
+    ring_spans(r, span, ring_put(r, r->wptr, hdr, RING_RECORD_HEADER), len);
+    spin_unlock(r->core.spin_lock, save);
+    return true;
+}
+
+void ring_commit_record(ring_t *r, uint16_t len) {
+    ring_commit(r, RING_RECORD_HEADER + len);
 }
 
 // ==[ String printing ]========================================================
 
 #if 1
 
+#include <stdio.h>
 #include <stdarg.h>
 
 #define RING_BUFFER_SIZE ((1 << 8) - 1)
 
-static char ring_buffer[RING_BUFFER_SIZE];
+// Scratch for each core, one for thread code and one for interrupt handlers,
+// so callers on the other core or in an ISR don't format over each other
+static char ring_buffer[NUM_CORES][2][RING_BUFFER_SIZE];
 
 uint16_t ring_printf(ring_t *r, const char *fmt, ...) {
+    char *buf = ring_buffer[get_core_num()][__get_current_exception() != 0];
     va_list args;
     va_start(args, fmt);
-    uint16_t len = vsnprintf(ring_buffer, RING_BUFFER_SIZE, fmt, args);
+    int len = vsnprintf(buf, RING_BUFFER_SIZE, fmt, args);
     va_end(args);
-    return ring_write_blocking(r, ring_buffer, len);
+    return ring_write_blocking(r, buf, MIN(MAX(len, 0), RING_BUFFER_SIZE - 1));
+}
+
+// Deferred printing stores the format pointer and the argument words as one
+// record, and the consumer formats it later with ring_format
+uint16_t ring_log_words(ring_t *r, const uintptr_t *words, uint8_t count) {
+    if (!r->framed) panic("Deferred printing needs a framed ring");
+    uint16_t len = count * sizeof(uintptr_t);
+    return ring_write_record(r, words, len) ? len : 0;
+}
+
+// Format the next deferred record into buf, returns its length (0 if none)
+uint16_t ring_format(ring_t *r, char *buf, uint16_t size) {
+    uintptr_t w[1 + RING_LOG_ARGS] = { 0 }; // Missing arguments are 0
+    if (!ring_read_record(r, w, sizeof(w))) return 0;
+    int len = snprintf(buf, size, (const char *) w[0], w[1], w[2], w[3], w[4],
+                       w[5], w[6], w[7], w[8]);
+    return size ? MIN(MAX(len, 0), size - 1) : 0;
 }
 
 #endif
 
+// ==[ Lock-free SPSC ]=========================================================
+
+void spsc_init(spsc_t *r, uint32_t size) {
+    assert(r);
+    assert(!r->data);
+    if (!size || (size & (size - 1)))
+        panic("SPSC ring size %u is not a power of 2", size);
+    r->data = (uint8_t *) calloc(size, 1);
+    r->size = size;
+    r->mask = size - 1;
+    r->wptr = 0;
+    r->rptr = 0;
+}
+
+spsc_t *spsc_new(uint32_t size) {
+    spsc_t *r = (spsc_t *) calloc(sizeof(spsc_t), 1);
+    spsc_init(r, size);
+    return r;
+}
+
+void spsc_reset(spsc_t *r) {
+    r->wptr = 0;
+    r->rptr = 0;
+}
+
+void spsc_destroy(spsc_t *r) {
+    free(r->data);
+    free(r);
+}
+
+// The other side's index is loaded with acquire, so the bytes it published are
+// seen too, and ours is stored with release, so our bytes land before it. On
+// the Cortex-M0+ both are a plain load or store with a DMB next to it.
+
+// Producer only: copy in, then publish the new wptr
+uint32_t spsc_try_write(spsc_t *r, const void *ptr, uint32_t len) {
+    uint32_t wptr = r->wptr;           // Ours, nobody else changes it
+    uint32_t rptr = __atomic_load_n(&r->rptr, __ATOMIC_ACQUIRE);
+    if (!(len = MIN(len, r->size - (wptr - rptr)))) return 0;
+    uint32_t pos = wptr & r->mask;
+    uint32_t sip = MIN(r->size - pos, len);
+    memcpy(r->data + pos, ptr, sip);
+    if (sip < len) memcpy(r->data, (const uint8_t *) ptr + sip, len - sip);
+    __atomic_store_n(&r->wptr, wptr + len, __ATOMIC_RELEASE);
+    __sev();                           // Wake a consumer waiting in __wfe()
+    return len;
+}
+
+// Consumer only: copy out, then give the space back by publishing rptr
+uint32_t spsc_try_read(spsc_t *r, void *ptr, uint32_t len) {
+    uint32_t rptr = r->rptr;           // Ours, nobody else changes it
+    uint32_t wptr = __atomic_load_n(&r->wptr, __ATOMIC_ACQUIRE);
+    if (!(len = MIN(len, wptr - rptr))) return 0;
+    uint32_t pos = rptr & r->mask;
+    uint32_t sip = MIN(r->size - pos, len);
+    memcpy(ptr, r->data + pos, sip);
+    if (sip < len) memcpy((uint8_t *) ptr + sip, r->data, len - sip);
+    __atomic_store_n(&r->rptr, rptr + len, __ATOMIC_RELEASE);
+    __sev();                           // Wake a producer waiting in __wfe()
+    return len;
+}
+
+uint32_t spsc_write_blocking(spsc_t *r, const void *ptr, uint32_t len) {
+    uint32_t cnt;
+    if (!len) return 0;
+    while (!(cnt = spsc_try_write(r, ptr, len))) __wfe();
+    return cnt;
+}
+
+uint32_t spsc_read_blocking(spsc_t *r, void *ptr, uint32_t len) {
+    uint32_t cnt;
+    if (!len) return 0;
+    while (!(cnt = spsc_try_read(r, ptr, len))) __wfe();
+    return cnt;
+}
+
 // =============================================================================
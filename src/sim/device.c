@@ -0,0 +1,32 @@
+// =============================================================================
+// device.c: The example device from src/device on the simulated device side
+//
+// The unchanged device code is built against its own controller (sim_device),
+// with its global names prefixed so it can live next to the host code.
+// =============================================================================
+
+#define SIM_CTRL sim_device       // Registers and DPSRAM of the device side
+
+#include "sim.h"                  // Simulated controller
+
+#define hexdump     device_hexdump
+#define setup       device_setup
+#define loop        device_loop
+#define isr_usbctrl device_isr_usbctrl
+
+#include "../device/device.c"     // PicoUSB device example
+
+// ==[ Device CPU ]=============================================================
+
+static void device_main(void) {
+    setup();
+    for (;;) loop();
+}
+
+// Power up the device side, it connects once its code enables the pull-up
+void sim_device_start(void) {
+    sim_device.isr = isr_usbctrl;
+    sim_start(&sim_device_cpu, device_main);
+}
+
+// =============================================================================
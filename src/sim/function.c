@@ -0,0 +1,717 @@
+// =============================================================================
+// function.c: Simulated USB functions to attach to the simulated bus
+//
+// The loopback function looks like the example in src/device/device.c: the
+// same descriptors and strings, and whatever arrives on EP1_OUT is echoed
+// back on EP2_IN. Its EP3_IN interrupt endpoint reports the echo byte counts
+// whenever they change. It answers the standard requests needed for enumeration.
+// Its configuration descriptor can be padded with class specific descriptors
+// to check hosts against long descriptors.
+//
+// The hub function has ports that other functions can be attached to. It
+// answers the hub class requests, reports port changes on its status change
+// endpoint, and passes on the traffic for the functions behind its ports.
+// =============================================================================
+
+#include <stdlib.h>               // For calloc
+#include <string.h>               // For memcpy, memset
+
+#include "pico/stdlib.h"          // Pico stdlib
+
+#include "usb_common.h"           // USB 2.0 definitions
+#include "sim.h"                  // Simulated controller
+
+// ==[ Descriptors ]============================================================
+
+#define EP1_OUT_ADDR (USB_DIR_OUT | 1)
+#define EP2_IN_ADDR  (USB_DIR_IN  | 2)
+#define EP3_IN_ADDR  (USB_DIR_IN  | 3)
+
+static const usb_device_descriptor_t device_descriptor = {
+    .bLength            = sizeof(usb_device_descriptor_t),
+    .bDescriptorType    = USB_DT_DEVICE,
+    .bcdUSB             = 0x0200, // USB 2.0 device
+    .bDeviceClass       = 0,      // Defer to interface descriptor
+    .bDeviceSubClass    = 0,      // No subclass
+    .bDeviceProtocol    = 0,      // No protocol
+    .bMaxPacketSize0    = 64,     // Max packet size for EP0 (can be changed)
+    .idVendor           = 0x0000, // Vendor id
+    .idProduct          = 0x0001, // Product id
+    .bcdDevice          = 0x0001, // Device release number (xx.yy)
+    .iManufacturer      = 1,      // String #1
+    .iProduct           = 2,      // String #2
+    .iSerialNumber      = 3,      // String #3
+    .bNumConfigurations = 1       // One configuration
+};
+
+static const struct {
+    usb_configuration_descriptor_t config;
+    usb_interface_descriptor_t     interface;
+    usb_endpoint_descriptor_t      ep1_out;
+    usb_endpoint_descriptor_t      ep2_in;
+    usb_endpoint_descriptor_t      ep3_in;
+} __packed config_descriptor = {
+    .config = {
+        .bLength             = sizeof(usb_configuration_descriptor_t),
+        .bDescriptorType     = USB_DT_CONFIG,
+        .wTotalLength        = sizeof(config_descriptor),
+        .bNumInterfaces      = 1,    // One interface
+        .bConfigurationValue = 1,    // Configuration 1
+        .iConfiguration      = 4,    // String #4
+        .bmAttributes        = 0xc0, // Attributes: Self-powered
+        .bMaxPower           = 50    // 100ma (Expressed in 2mA units)
+    },
+    .interface = {
+        .bLength            = sizeof(usb_interface_descriptor_t),
+        .bDescriptorType    = USB_DT_INTERFACE,
+        .bInterfaceNumber   = 0,    // Starts at zero
+        .bAlternateSetting  = 0,    // No alternate
+        .bNumEndpoints      = 3,    // Three endpoints (EP0 doesn't count)
+        .bInterfaceClass    = 0xff, // Interface class (0xff = Vendor specific)
+        .bInterfaceSubClass = 0,    // No subclass
+        .bInterfaceProtocol = 0,    // No protocol
+        .iInterface         = 5     // String #5
+    },
+    .ep1_out = {
+        .bLength          = sizeof(usb_endpoint_descriptor_t),
+        .bDescriptorType  = USB_DT_ENDPOINT,
+        .bEndpointAddress = EP1_OUT_ADDR,
+        .bmAttributes     = USB_TRANSFER_TYPE_BULK,
+        .wMaxPacketSize   = 64,
+        .bInterval        = 0
+    },
+    .ep2_in = {
+        .bLength          = sizeof(usb_endpoint_descriptor_t),
+        .bDescriptorType  = USB_DT_ENDPOINT,
+        .bEndpointAddress = EP2_IN_ADDR,
+        .bmAttributes     = USB_TRANSFER_TYPE_BULK,
+        .wMaxPacketSize   = 64,
+        .bInterval        = 0
+    },
+    .ep3_in = {
+        .bLength          = sizeof(usb_endpoint_descriptor_t),
+        .bDescriptorType  = USB_DT_ENDPOINT,
+        .bEndpointAddress = EP3_IN_ADDR,
+        .bmAttributes     = USB_TRANSFER_TYPE_INTERRUPT,
+        .wMaxPacketSize   = 8,
+        .bInterval        = 4 // Polled every 4 ms
+    },
+};
+
+static const char *strings[] = {
+    "PicoUSB", // String #1: Vendor
+    "Demo"   , // String #2: Product
+    "12345"  , // String #3: Serial
+    "Easy"   , // String #4: Configuration
+    "Simple" , // String #5: Interface
+};
+
+// ==[ Control pipe ]===========================================================
+
+enum {
+    CONTROL_IDLE,
+    CONTROL_DATA_IN,
+    CONTROL_DATA_OUT,
+    CONTROL_STATUS_IN,
+    CONTROL_STALL,
+};
+
+// EP0 of a simulated function, along with its standard descriptors
+typedef struct {
+    const usb_device_descriptor_t *device;
+    const uint8_t                 *config_buf; // Configuration descriptor
+    uint16_t                       config_len;
+    const char                   **strings;
+    uint8_t                        strings_count;
+
+    uint8_t  maxsize0;
+    uint8_t  config;
+    uint8_t  new_addr; // Applied after the status stage
+    bool     set_addr;
+
+    uint8_t  stage;
+    uint8_t *data;
+    uint16_t size; // Size of data
+    uint16_t len;
+    uint16_t pos;
+    uint8_t  pid;
+} control_t;
+
+static void control_reset(control_t *ctl) {
+    ctl->config   = 0;
+    ctl->set_addr = false;
+    ctl->stage    = CONTROL_IDLE;
+}
+
+// Prepare the data stage of a standard request, returns false to stall
+static bool control_request(control_t *ctl, usb_setup_packet_t *pkt) {
+    uint8_t type  = pkt->wValue >> 8;
+    uint8_t index = pkt->wValue & 0xff;
+
+    switch (pkt->bRequest) {
+        case USB_REQUEST_GET_DESCRIPTOR:
+            if (type == USB_DT_DEVICE) {
+                usb_device_descriptor_t *dd = (usb_device_descriptor_t *) ctl->data;
+                *dd = *ctl->device;
+                dd->bMaxPacketSize0 = ctl->maxsize0;
+                ctl->len = sizeof(usb_device_descriptor_t);
+            } else if (type == USB_DT_CONFIG) {
+                memcpy(ctl->data, ctl->config_buf, ctl->config_len);
+                ctl->len = ctl->config_len;
+            } else if (type == USB_DT_STRING && index == 0) {
+                ctl->data[0] = 4;             // bLength
+                ctl->data[1] = USB_DT_STRING; // bDescriptorType
+                ctl->data[2] = 0x09;          // Language id: US English
+                ctl->data[3] = 0x04;
+                ctl->len = 4;
+            } else if (type == USB_DT_STRING && index <= ctl->strings_count) {
+                const char *str = ctl->strings[index - 1];
+                ctl->len = 2 + strlen(str) * 2;
+                ctl->data[0] = ctl->len;
+                ctl->data[1] = USB_DT_STRING;
+                for (uint i = 0; str[i]; i++) {
+                    ctl->data[2 + i * 2] = str[i];
+                    ctl->data[3 + i * 2] = 0;
+                }
+            } else {
+                return false;
+            }
+            return true;
+
+        case USB_REQUEST_SET_ADDRESS:
+            ctl->new_addr = pkt->wValue & 0x7f;
+            ctl->set_addr = true;
+            return true;
+
+        case USB_REQUEST_SET_CONFIGURATION:
+            ctl->config = pkt->wValue & 0xff;
+            return true;
+
+        case USB_REQUEST_GET_CONFIGURATION:
+            ctl->data[0] = ctl->config;
+            ctl->len = 1;
+            return true;
+
+        case USB_REQUEST_GET_STATUS:
+            ctl->data[0] = ctl->data[1] = 0;
+            ctl->len = 2;
+            return true;
+    }
+    return false;
+}
+
+// A SETUP is always accepted, even if the request is then stalled (ok = false)
+static uint8_t control_setup(control_t *ctl, usb_setup_packet_t *pkt, bool ok) {
+    ctl->pos = 0;
+    ctl->pid = 1;
+    if (!ok) {
+        ctl->stage = CONTROL_STALL;
+    } else if (!pkt->wLength) {
+        ctl->stage = CONTROL_STATUS_IN;
+    } else if (pkt->bmRequestType & USB_DIR_IN) {
+        ctl->len   = MIN(ctl->len, pkt->wLength);
+        ctl->stage = CONTROL_DATA_IN;
+    } else {
+        ctl->len   = MIN(pkt->wLength, ctl->size);
+        ctl->stage = CONTROL_DATA_OUT;
+    }
+    return SIM_ACK;
+}
+
+// EP0 IN: data stage or status stage
+static uint8_t control_in(control_t *ctl, sim_function_t *fn, uint8_t *buf,
+                          uint16_t *len, uint8_t *pid) {
+    switch (ctl->stage) {
+        case CONTROL_DATA_IN:
+            *len = MIN(ctl->maxsize0, ctl->len - ctl->pos);
+            *pid = ctl->pid;
+            memcpy(buf, ctl->data + ctl->pos, *len);
+            ctl->pos += *len;
+            ctl->pid ^= 1u;
+            return SIM_ACK;
+
+        case CONTROL_STATUS_IN:
+            *len = 0;
+            *pid = 1;
+            ctl->stage = CONTROL_IDLE;
+            if (ctl->set_addr) {
+                fn->address   = ctl->new_addr;
+                ctl->set_addr = false;
+            }
+            return SIM_ACK;
+
+        case CONTROL_STALL:
+            return SIM_STALL;
+    }
+    return SIM_NAK;
+}
+
+// EP0 OUT: data stage or status stage
+static uint8_t control_out(control_t *ctl, const uint8_t *buf, uint16_t len) {
+    switch (ctl->stage) {
+        case CONTROL_DATA_IN: // Host acknowledges the data we sent
+            ctl->stage = CONTROL_IDLE;
+            return SIM_ACK;
+
+        case CONTROL_DATA_OUT:
+            len = MIN(len, ctl->len - ctl->pos);
+            memcpy(ctl->data + ctl->pos, buf, len);
+            ctl->pos += len;
+            if (ctl->pos >= ctl->len) ctl->stage = CONTROL_STATUS_IN;
+            return SIM_ACK;
+
+        case CONTROL_STALL:
+            return SIM_STALL;
+    }
+    return SIM_NAK;
+}
+
+// ==[ Loopback ]===============================================================
+
+enum {
+    CS_INTERFACE = 0x24, // Class specific interface descriptor (padding)
+};
+
+typedef struct {
+    sim_function_t fn;
+    control_t      ctl;
+    uint8_t       *config_buf; // Configuration descriptor (with padding)
+
+    // Echo pipe
+    uint8_t        fifo[SIM_LOOPBACK_FIFO];
+    uint32_t       head;
+    uint32_t       tail;
+    uint8_t        out_pid;
+    uint8_t        in_pid;
+
+    // Status pipe (last reported head and tail of the echo pipe)
+    uint32_t       seen_head;
+    uint32_t       seen_tail;
+    uint8_t        int_pid;
+} loopback_t;
+
+static void loopback_reset(sim_function_t *fn) {
+    loopback_t *lb = (loopback_t *) fn->ctx;
+
+    control_reset(&lb->ctl);
+    lb->head     = lb->tail    = 0;
+    lb->out_pid  = lb->in_pid  = lb->int_pid   = 0;
+    lb->seen_head = lb->seen_tail = 0;
+}
+
+// Handle the requests with side effects on the loopback, then the rest
+static bool loopback_request(loopback_t *lb, usb_setup_packet_t *pkt) {
+    lb->ctl.len = 0;
+
+    switch (pkt->bRequest) {
+        case USB_REQUEST_SET_CONFIGURATION:
+            lb->out_pid = lb->in_pid = lb->int_pid = 0;
+            break;
+
+        case USB_REQUEST_CLEAR_FEATURE:
+            if (pkt->wValue != USB_FEAT_ENDPOINT_HALT) return false;
+            if (pkt->wIndex == EP1_OUT_ADDR) lb->out_pid = 0;
+            if (pkt->wIndex == EP2_IN_ADDR ) lb->in_pid  = 0;
+            if (pkt->wIndex == EP3_IN_ADDR ) lb->int_pid = 0;
+            return true;
+    }
+    return control_request(&lb->ctl, pkt);
+}
+
+static uint8_t loopback_setup(sim_function_t *fn, const uint8_t *buf) {
+    loopback_t         *lb  = (loopback_t *) fn->ctx;
+    usb_setup_packet_t  pkt;
+
+    memcpy(&pkt, buf, sizeof(pkt));
+    return control_setup(&lb->ctl, &pkt, loopback_request(lb, &pkt));
+}
+
+static uint8_t loopback_in(sim_function_t *fn, uint8_t ep_num, uint8_t *buf,
+                           uint16_t *len, uint8_t *pid) {
+    loopback_t *lb = (loopback_t *) fn->ctx;
+
+    if (ep_num == 0) return control_in(&lb->ctl, fn, buf, len, pid);
+
+    // EP2_IN: echo back what arrived on EP1_OUT
+    if (ep_num == (EP2_IN_ADDR & 0x0f)) {
+        uint32_t used = lb->head - lb->tail;
+        if (!used) return SIM_NAK;
+
+        *len = MIN(used, config_descriptor.ep2_in.wMaxPacketSize);
+        *pid = lb->in_pid;
+        for (uint16_t i = 0; i < *len; i++)
+            buf[i] = lb->fifo[lb->tail++ % SIM_LOOPBACK_FIFO];
+        lb->in_pid ^= 1u;
+        return SIM_ACK;
+    }
+
+    // EP3_IN: report bytes in and out of the echo pipe when they change
+    if (ep_num == (EP3_IN_ADDR & 0x0f)) {
+        if (lb->head == lb->seen_head && lb->tail == lb->seen_tail)
+            return SIM_NAK;
+
+        lb->seen_head = lb->head;
+        lb->seen_tail = lb->tail;
+        memcpy(buf    , &lb->head, 4);
+        memcpy(buf + 4, &lb->tail, 4);
+        *len = 8;
+        *pid = lb->int_pid;
+        lb->int_pid ^= 1u;
+        return SIM_ACK;
+    }
+
+    return SIM_STALL;
+}
+
+static uint8_t loopback_out(sim_function_t *fn, uint8_t ep_num,
+                            const uint8_t *buf, uint16_t len, uint8_t pid) {
+    loopback_t *lb = (loopback_t *) fn->ctx;
+
+    if (ep_num == 0) return control_out(&lb->ctl, buf, len);
+
+    // EP1_OUT: hold on to data until it is read back from EP2_IN
+    if (ep_num == (EP1_OUT_ADDR & 0x0f)) {
+        if (pid != lb->out_pid) return SIM_ACK; // Duplicate, ignore it
+        if (SIM_LOOPBACK_FIFO - (lb->head - lb->tail) < len) return SIM_NAK;
+
+        for (uint16_t i = 0; i < len; i++)
+            lb->fifo[lb->head++ % SIM_LOOPBACK_FIFO] = buf[i];
+        lb->out_pid ^= 1u;
+        return SIM_ACK;
+    }
+
+    return SIM_STALL;
+}
+
+sim_function_t *sim_loopback(uint8_t speed, uint8_t maxsize0, uint16_t pad) {
+    loopback_t *lb  = (loopback_t *) calloc(1, sizeof(loopback_t));
+    control_t  *ctl = &lb->ctl;
+
+    // Build the configuration descriptor, padded with class specific ones
+    if (pad == 1) pad = 2; // Descriptors are at least two bytes long
+    pad = MIN(pad, 0xffff - sizeof(config_descriptor));
+    ctl->config_len = sizeof(config_descriptor) + pad;
+    lb->config_buf  = (uint8_t *) calloc(1, ctl->config_len);
+    memcpy(lb->config_buf, &config_descriptor, sizeof(config_descriptor));
+    for (uint8_t *cur = lb->config_buf + sizeof(config_descriptor); pad; ) {
+        uint8_t len = pad <= 255 ? pad : pad - 255 < 2 ? 253 : 255;
+        cur[0] = len;
+        cur[1] = CS_INTERFACE;
+        cur   += len;
+        pad   -= len;
+    }
+    ((usb_configuration_descriptor_t *) lb->config_buf)->wTotalLength =
+        ctl->config_len;
+
+    ctl->device        = &device_descriptor;
+    ctl->config_buf    = lb->config_buf;
+    ctl->strings       = strings;
+    ctl->strings_count = count_of(strings);
+    ctl->size          = MAX(512, ctl->config_len);
+    ctl->data          = (uint8_t *) calloc(1, ctl->size);
+    ctl->maxsize0      = maxsize0;
+
+    lb->fn = (sim_function_t) {
+        .name  = "loopback",
+        .speed = speed,
+        .ctx   = lb,
+        .reset = loopback_reset,
+        .setup = loopback_setup,
+        .in    = loopback_in,
+        .out   = loopback_out,
+    };
+    loopback_reset(&lb->fn);
+
+    return &lb->fn;
+}
+
+// ==[ Hub ]====================================================================
+
+// A full speed hub with up to SIM_HUB_PORTS ports. Ports are powered, reset
+// and cleared with the hub class requests. A reset takes 10 frames, after
+// which the port is enabled and the function behind it answers at address
+// zero. Enabled ports pass on the traffic for the functions behind them.
+
+enum {
+    PORT_CONNECTION = 1u << 0, // wPortStatus and wPortChange bits
+    PORT_ENABLE     = 1u << 1,
+    PORT_RESET      = 1u << 4,
+    PORT_POWER      = 1u << 8,
+    PORT_LOW_SPEED  = 1u << 9,
+    RESET_FRAMES    = 10,
+};
+
+static const usb_device_descriptor_t hub_device_descriptor = {
+    .bLength            = sizeof(usb_device_descriptor_t),
+    .bDescriptorType    = USB_DT_DEVICE,
+    .bcdUSB             = 0x0110, // USB 1.1 (full speed) hub
+    .bDeviceClass       = USB_CLASS_HUB,
+    .bDeviceSubClass    = 0,      // No subclass
+    .bDeviceProtocol    = 0,      // Full speed hub
+    .bMaxPacketSize0    = 64,     // Max packet size for EP0
+    .idVendor           = 0x0000, // Vendor id
+    .idProduct          = 0x0002, // Product id
+    .bcdDevice          = 0x0001, // Device release number (xx.yy)
+    .iManufacturer      = 1,      // String #1
+    .iProduct           = 2,      // String #2
+    .iSerialNumber      = 3,      // String #3
+    .bNumConfigurations = 1       // One configuration
+};
+
+static const struct {
+    usb_configuration_descriptor_t config;
+    usb_interface_descriptor_t     interface;
+    usb_endpoint_descriptor_t      ep1_in;
+} __packed hub_config_descriptor = {
+    .config = {
+        .bLength             = sizeof(usb_configuration_descriptor_t),
+        .bDescriptorType     = USB_DT_CONFIG,
+        .wTotalLength        = sizeof(hub_config_descriptor),
+        .bNumInterfaces      = 1,    // One interface
+        .bConfigurationValue = 1,    // Configuration 1
+        .iConfiguration      = 0,    // No string
+        .bmAttributes        = 0xe0, // Attributes: Self-powered, remote wakeup
+        .bMaxPower           = 50    // 100ma (Expressed in 2mA units)
+    },
+    .interface = {
+        .bLength            = sizeof(usb_interface_descriptor_t),
+        .bDescriptorType    = USB_DT_INTERFACE,
+        .bInterfaceNumber   = 0,    // Starts at zero
+        .bAlternateSetting  = 0,    // No alternate
+        .bNumEndpoints      = 1,    // Status change endpoint
+        .bInterfaceClass    = USB_CLASS_HUB,
+        .bInterfaceSubClass = 0,    // No subclass
+        .bInterfaceProtocol = 0,    // No protocol
+        .iInterface         = 0     // No string
+    },
+    .ep1_in = {
+        .bLength          = sizeof(usb_endpoint_descriptor_t),
+        .bDescriptorType  = USB_DT_ENDPOINT,
+        .bEndpointAddress = USB_DIR_IN | 1,
+        .bmAttributes     = USB_TRANSFER_TYPE_INTERRUPT,
+        .wMaxPacketSize   = 1,
+        .bInterval        = 12 // Polled every 12 ms
+    },
+};
+
+static const char *hub_strings[] = {
+    "PicoUSB", // String #1: Vendor
+    "Hub"    , // String #2: Product
+    "54321"  , // String #3: Serial
+};
+
+typedef struct {
+    sim_function_t *fn    ; // Function attached to the port (NULL = none)
+    uint16_t        status; // wPortStatus
+    uint16_t        change; // wPortChange
+    uint32_t        reset ; // Frame when the port reset ends
+} hub_port_t;
+
+typedef struct {
+    sim_function_t fn;
+    control_t      ctl;
+    uint8_t        ports;
+    hub_port_t     port[SIM_HUB_PORTS + 1]; // Ports start at 1
+    uint8_t        int_pid;
+} hub_t;
+
+static void hub_reset(sim_function_t *fn) {
+    hub_t *hub = (hub_t *) fn->ctx;
+
+    control_reset(&hub->ctl);
+    hub->int_pid = 0;
+    for (uint8_t i = 1; i <= hub->ports; i++) {
+        hub->port[i].status = 0; // Ports are powered off
+        hub->port[i].change = 0;
+    }
+}
+
+// Finish port resets that are due
+static void hub_update(hub_t *hub) {
+    for (uint8_t i = 1; i <= hub->ports; i++) {
+        hub_port_t *p = &hub->port[i];
+
+        if (!(p->status & PORT_RESET) || sim_frame() < p->reset) continue;
+        p->status &= ~PORT_RESET;
+        p->change |=  PORT_RESET;
+        if (!(p->status & PORT_CONNECTION)) continue;
+        p->status |=  PORT_ENABLE;
+        p->fn->address = 0;
+        if (p->fn->reset) p->fn->reset(p->fn);
+    }
+}
+
+// Hub class requests to the hub or to one of its ports
+static bool hub_class_request(hub_t *hub, usb_setup_packet_t *pkt) {
+    uint8_t     recipient = pkt->bmRequestType & 0x1f;
+    uint8_t     feature   = pkt->wValue;
+    hub_port_t *p         = &hub->port[pkt->wIndex & 0xff];
+
+    // Requests to the hub itself
+    if (recipient == USB_REQ_TYPE_RECIPIENT_DEVICE) {
+        switch (pkt->bRequest) {
+            case USB_REQUEST_GET_DESCRIPTOR: {
+                usb_hub_descriptor_t *hd = (usb_hub_descriptor_t *) hub->ctl.data;
+                *hd = (usb_hub_descriptor_t) {
+                    .bDescLength         = sizeof(usb_hub_descriptor_t),
+                    .bDescriptorType     = USB_DT_HUB,
+                    .bNbrPorts           = hub->ports,
+                    .wHubCharacteristics = 0x0001, // Individual port power
+                    .bPwrOn2PwrGood      = 10,     // 20 ms
+                    .PortPwrCtrlMask     = 0xff,
+                };
+                hub->ctl.len = sizeof(usb_hub_descriptor_t);
+            }   return true;
+
+            case USB_REQUEST_GET_STATUS:
+                memset(hub->ctl.data, 0, 4); // Local power is good
+                hub->ctl.len = 4;
+                return true;
+
+            case USB_REQUEST_CLEAR_FEATURE:
+                return true;
+        }
+        return false;
+    }
+
+    // Requests to a port
+    if (!pkt->wIndex || pkt->wIndex > hub->ports) return false;
+
+    switch (pkt->bRequest) {
+        case USB_REQUEST_GET_STATUS:
+            memcpy(hub->ctl.data    , &p->status, 2);
+            memcpy(hub->ctl.data + 2, &p->change, 2);
+            hub->ctl.len = 4;
+            return true;
+
+        case USB_REQUEST_SET_FEATURE:
+            if (feature == USB_HUB_PORT_POWER && !(p->status & PORT_POWER)) {
+                p->status |= PORT_POWER;
+                if (p->fn) {
+                    p->status |= PORT_CONNECTION;
+                    p->change |= PORT_CONNECTION;
+                    if (p->fn->speed == SIM_LOW_SPEED) p->status |= PORT_LOW_SPEED;
+                }
+            } else if (feature == USB_HUB_PORT_RESET && (p->status & PORT_POWER)) {
+                p->status |= PORT_RESET;
+                p->status &= ~PORT_ENABLE;
+                p->reset   = sim_frame() + RESET_FRAMES;
+            }
+            return true;
+
+        case USB_REQUEST_CLEAR_FEATURE:
+            if (feature >= USB_HUB_C_PORT_CONNECTION)
+                p->change &= ~(1u << (feature - USB_HUB_C_PORT_CONNECTION));
+            else if (feature == USB_HUB_PORT_ENABLE)
+                p->status &= ~PORT_ENABLE;
+            else if (feature == USB_HUB_PORT_POWER)
+                p->status = 0;
+            return true;
+    }
+    return false;
+}
+
+static uint8_t hub_setup(sim_function_t *fn, const uint8_t *buf) {
+    hub_t              *hub = (hub_t *) fn->ctx;
+    usb_setup_packet_t  pkt;
+    bool                ok;
+
+    memcpy(&pkt, buf, sizeof(pkt));
+    hub_update(hub);
+
+    hub->ctl.len = 0;
+    if (pkt.bmRequestType & USB_REQ_TYPE_TYPE_CLASS) {
+        ok = hub_class_request(hub, &pkt);
+    } else {
+        if (pkt.bRequest == USB_REQUEST_SET_CONFIGURATION) hub->int_pid = 0;
+        ok = control_request(&hub->ctl, &pkt);
+    }
+    return control_setup(&hub->ctl, &pkt, ok);
+}
+
+static uint8_t hub_in(sim_function_t *fn, uint8_t ep_num, uint8_t *buf,
+                      uint16_t *len, uint8_t *pid) {
+    hub_t *hub = (hub_t *) fn->ctx;
+
+    if (ep_num == 0) return control_in(&hub->ctl, fn, buf, len, pid);
+    if (ep_num != 1) return SIM_STALL;
+
+    // EP1_IN: bitmap of the ports with changes (bit 0 is the hub)
+    hub_update(hub);
+    uint8_t map = 0;
+    for (uint8_t i = 1; i <= hub->ports; i++)
+        if (hub->port[i].change) map |= 1u << i;
+    if (!map) return SIM_NAK;
+
+    buf[0] = map;
+    *len   = 1;
+    *pid   = hub->int_pid;
+    hub->int_pid ^= 1u;
+    return SIM_ACK;
+}
+
+static uint8_t hub_out(sim_function_t *fn, uint8_t ep_num, const uint8_t *buf,
+                       uint16_t len, uint8_t pid) {
+    hub_t *hub = (hub_t *) fn->ctx;
+
+    if (ep_num == 0) return control_out(&hub->ctl, buf, len);
+    return SIM_STALL;
+}
+
+// Find the function behind an enabled port that answers to an address
+static sim_function_t *hub_route(sim_function_t *fn, uint8_t dev_addr,
+                                 bool preamble) {
+    hub_t *hub = (hub_t *) fn->ctx;
+
+    hub_update(hub);
+    for (uint8_t i = 1; i <= hub->ports; i++) {
+        sim_function_t *down = hub->port[i].fn;
+        if (!(hub->port[i].status & PORT_ENABLE)) continue;
+
+        // Low speed packets are only passed on after a preamble
+        if (down->address == dev_addr)
+            return down->speed == SIM_LOW_SPEED && !preamble ? NULL : down;
+        if (down->route && (down = down->route(down, dev_addr, preamble)))
+            return down;
+    }
+    return NULL;
+}
+
+sim_function_t *sim_hub(uint8_t ports) {
+    hub_t     *hub = (hub_t *) calloc(1, sizeof(hub_t));
+    control_t *ctl = &hub->ctl;
+
+    ctl->device        = &hub_device_descriptor;
+    ctl->config_buf    = (const uint8_t *) &hub_config_descriptor;
+    ctl->config_len    = sizeof(hub_config_descriptor);
+    ctl->strings       = hub_strings;
+    ctl->strings_count = count_of(hub_strings);
+    ctl->size          = 256;
+    ctl->data          = (uint8_t *) calloc(1, ctl->size);
+    ctl->maxsize0      = hub_device_descriptor.bMaxPacketSize0;
+
+    hub->ports = MIN(ports, SIM_HUB_PORTS);
+    hub->fn = (sim_function_t) {
+        .name  = "hub",
+        .speed = SIM_FULL_SPEED,
+        .ctx   = hub,
+        .reset = hub_reset,
+        .setup = hub_setup,
+        .in    = hub_in,
+        .out   = hub_out,
+        .route = hub_route,
+    };
+    hub_reset(&hub->fn);
+
+    return &hub->fn;
+}
+
+void sim_hub_attach(sim_function_t *fn, uint8_t port, sim_function_t *down) {
+    hub_t *hub = (hub_t *) fn->ctx;
+
+    if (port < 1 || port > hub->ports) return;
+    hub->port[port].fn = down;
+    down->address = 0;
+}
+
+// =============================================================================
@@ -0,0 +1,756 @@
+// =============================================================================
+// main.c: Run the PicoUSB host on Linux against a simulated rp2040
+//
+// The host code from src/host is built into this program as it is, with no
+// sim-only changes (whatever the sim shows needs fixing is fixed there, for
+// the firmware too), and the SDK it calls is simulated. A loopback function
+// (see function.c) is attached to the simulated root port, or with -d
+// the example device from src/device running on its own simulated controller
+// and CPU. The host enumerates it and bulk data is echoed through EP1_OUT and
+// EP2_IN. With -i, the loopback's EP3_IN interrupt endpoint is polled by the
+// hardware at the same time, reporting the echo byte counts as they change.
+// With -y as well, one poll in that many is lost, while bulk transfers are on
+// EPX when they span several packets (-c), and none of those errors may be
+// taken for theirs.
+// With -u, a hub is attached instead with loopbacks on its ports, and the data
+// is echoed through all of them at once. Each keeps several transfers queued,
+// so their endpoints compete for EPX and the per-endpoint throughput shows how
+// fairly it is shared. With -r, the device (or hub) is unplugged and plugged
+// back in afterwards, so it enumerates again with its descriptors cached. With
+// -f, the RAM cache is cleared first, as after a reboot, so it only has what
+// was saved to flash (when built with -DUSER_CACHE_FLASH=0x1ff000). With -w,
+// each replug is first pulled again that many ms after it went in, partway
+// through enumerating (the root port takes about 120 ms to get there), and
+// every device must still count as mounted once it's back. With -z, the echoed
+// data lands straight in a ring on EP2_IN (see endpoint_ring) and is checked
+// there in place. With -k, the ring is framed, and the packets are read back
+// as records, several at a time. With -s, the ring is smaller than a chunk and
+// the application reads one packet a pass while it fills, so the host has to
+// hold the device off until there's room. With -o, the ring is a lock-free
+// spsc_t (see endpoint_spsc). With -a, the application does that much work on
+// each pass of its loop, which holds up USB unless the host was built with
+// -DUSER_CORE1=1 (then USB runs on core 1, and the application has core 0 to
+// itself). With -x, transactions on EPX go wrong now and then, as on a flaky
+// cable (see sim.c), and the echo picks up after any transfer that still
+// failed. With -t, the loopback is read once more with nothing in it, so the
+// host has to end that transfer when its deadline passes, and a chunk is
+// echoed afterwards to see the endpoint still works.
+//
+// Console output from the host goes to stdout (use -q to discard it), results
+// go to stderr. All times are virtual, so every run gives the same numbers.
+//
+// Usage: sim [-q] [-d] [-v] [-l] [-e] [-i] [-u ports] [-r count] [-f] [-z]
+//            [-w ms] [-k] [-s bytes] [-o] [-t] [-a us] [-x count] [-y count]
+//            [-b baud] [-m maxsize0] [-n bytes] [-c chunk] [-p pad]
+// =============================================================================
+
+#include <stdlib.h>               // For exit
+#include <unistd.h>               // For getopt
+
+#ifndef USER_DEVICES
+#define USER_DEVICES    7         // A loopback on each port of a hub (-u)
+#endif
+#ifndef USER_ENDPOINTS
+#define USER_ENDPOINTS 14         // Their echo endpoints, opened below
+#endif
+
+#include "../host/main.c"         // PicoUSB host (statics are needed below)
+#include "../host/ring.c"         // Rings for the echo (-z)
+#include "../host/drain.c"        // Console output through DMA (USER_DRAIN)
+
+#include "sim.h"                  // Simulated controller
+
+// ==[ Harness ]================================================================
+
+enum {
+    ENUM_LIMIT_MS = 5000, // Give up if enumeration takes longer than this
+    ECHO_LIMIT_MS = 60000,
+    ECHO_RING     = 65535, // Largest ring_t (it holds one byte less)
+    ECHO_BATCH    =    16, // Records read at a time (-k)
+};
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -q          Discard console output (it still costs time)\n"
+        "  -d          Attach the example device from src/device\n"
+        "  -v          Show the device console output (with -d)\n"
+        "  -l          Attach a low speed device\n"
+        "  -e          Emulate RP2040-E4 for single buffered transfers\n"
+        "  -i          Poll the loopback's interrupt endpoint during the echo\n"
+        "  -u ports    Attach loopbacks to a hub with this many ports (max %u)\n"
+        "  -r count    Unplug and plug the device back in this many times\n"
+        "  -f          Clear the RAM descriptor cache before each replug\n"
+        "  -w ms       Pull each replug again this long after it went in\n"
+        "  -z          Echo IN data into a ring and check it there\n"
+        "  -k          Keep IN packets as records in the ring (with -z)\n"
+        "  -s bytes    Ring size, less than a chunk, read a packet per pass (-z)\n"
+        "  -o          Use a lock-free ring (with -z, not -k, -u or -t)\n"
+        "  -t          Read the empty loopback until the deadline ends it\n"
+        "  -a us       Application work per pass of its loop (default 0)\n"
+        "  -x count    One EPX transaction in this many goes wrong (not with -d\n"
+        "              or -u)\n"
+        "  -y count    One poll in this many is lost (with -i, at least 2)\n"
+        "  -b baud     Console speed (default 115200, 0 = free)\n"
+        "  -m maxsize0 Device EP0 max packet size (default 64, 8 at low speed)\n"
+        "  -n bytes    Bytes to echo after enumeration (default 4096)\n"
+        "  -c chunk    Bytes per bulk transfer (default 64, max %u, 64 with -d,\n"
+        "              or a bit less than %u with -z)\n"
+        "  -p pad      Bytes added to the configuration descriptor (default 0)\n",
+        name, SIM_HUB_PORTS, SIM_LOOPBACK_FIFO, ECHO_RING - 1);
+    exit(2);
+}
+
+// The application's share of the CPU, and how long tasks waited for usb_task
+static uint32_t app_ns; // Work the application does per pass of loop() (-a)
+static uint64_t task_wait, task_wait_max, task_waits;
+
+// A reader that falls behind (-s): the application takes at most one packet
+// from the ring per pass of its loop, while the transfer is still filling it
+static ring_t        *drip_ring;
+static spsc_t        *drip_spsc; // Or the lock-free ring (-o)
+static const uint8_t *drip_tx;   // What should come out of the ring next
+static uint32_t       drip_left; // Bytes still to come out
+static uint32_t       drip_errors, drip_passes;
+
+static void drip(void) {
+    if (!drip_left) return;
+    uint8_t     buf[64];
+    uint16_t    len = MIN(64, drip_left);
+    ring_span_t span[2];
+    if (drip_spsc) {
+        if (!(len = spsc_try_read(drip_spsc, buf, len))) return;
+        drip_errors += memcmp(drip_tx, buf, len) != 0;
+    } else if (drip_ring->framed) { // Each packet is one record
+        uint16_t got = ring_read_record(drip_ring, buf, sizeof(buf));
+        if (!got) return;
+        drip_errors += got != len || memcmp(drip_tx, buf, len);
+    } else {
+        if (!(len = ring_peek(drip_ring, span, len))) return;
+        drip_errors += memcmp(drip_tx, span[0].ptr, span[0].len) ||
+                       memcmp(drip_tx + span[0].len, span[1].ptr, span[1].len);
+        ring_consume(drip_ring, len);
+    }
+    drip_tx   += len;
+    drip_left -= len;
+    drip_passes++;
+}
+
+// One pass of the host's main loop. Without USER_CORE1 the application works
+// in the same loop, so usb_task() waits for it (the interrupt handler doesn't,
+// it preempts the work). With it, the application has core 0 to itself and
+// this CPU is core 1.
+static void host_pass(void) {
+    if (!tasks_empty()) {
+        uint64_t wait = sim_time_ns() - sim_host_cpu.isr_end;
+        task_wait    += wait;
+        task_wait_max = MAX(task_wait_max, wait);
+        task_waits++;
+    }
+#if USER_CORE1
+    loop1();
+#else
+    loop();
+    drip();
+    if (app_ns) sim_work_ns(app_ns);
+#endif
+}
+
+#if USER_CORE1
+static void app_main(void) {
+    setup();
+    for (;;) {
+        loop();
+        drip();
+        if (app_ns) sim_work_ns(app_ns); else sim_poll();
+    }
+}
+#endif
+
+// Run the host until nothing is left to do, returns false on timeout
+static bool run_until_idle(uint64_t limit_ns) {
+    while (sim_time_ns() < limit_ns) {
+        host_pass();
+        if (!tasks_empty()) continue;
+
+        bool busy = false; // Polled endpoints wait on the device, not the host
+        for (uint8_t i = 0; i < MAX_ENDPOINTS; i++)
+            busy |= eps[i].active && !eps[i].interval;
+        busy |= wheel_count != 0; // Timers (resets, backoffs, deadlines)
+        if (!busy) return true;
+    }
+    return false;
+}
+
+// How the last transfer went, to pick up after one that failed (-x)
+static uint8_t  xfer_status;
+static uint32_t xfer_len, xfer_failed;
+
+static void on_xfer(endpoint_t *ep, uint8_t status, uint8_t *buf,
+                    uint32_t len) {
+    xfer_status = status;
+    xfer_len    = len;
+}
+
+// Transfer all of it, sending what's left again after a transfer that failed
+// part way. Returns false on timeout.
+static bool transfer_all(endpoint_t *ep, uint8_t *buf, uint32_t len,
+                         uint64_t limit) {
+    for (uint32_t done = 0; done < len; done += xfer_len) {
+        xfer_status = TRANSFER_SUCCESS;
+        xfer_len    = len - done; // All of it, unless on_xfer hears otherwise
+        bulk_transfer(ep, buf ? buf + done : NULL, len - done);
+        if (!run_until_idle(limit)) return false;
+        xfer_failed += xfer_status != TRANSFER_SUCCESS;
+    }
+    return true;
+}
+
+// Interrupt endpoint reports (bytes into and out of the echo pipe)
+static endpoint_t *status;
+static uint8_t     report[8];
+static uint32_t    reports, report_in, report_out;
+
+static void on_report(endpoint_t *ep, uint8_t status, uint8_t *buf,
+                      uint32_t len) {
+    if (len == sizeof(report)) {
+        memcpy(&report_in , buf    , 4);
+        memcpy(&report_out, buf + 4, 4);
+        reports++;
+    }
+    interrupt_transfer(ep, report, sizeof(report)); // Keep polling
+}
+
+// Open the loopback's echo endpoints
+static void open_echo(uint8_t dev_addr, uint8_t *tx, uint8_t *rx,
+                      endpoint_t **out, endpoint_t **in) {
+    *out = next_endpoint(dev_addr, &((usb_endpoint_descriptor_t) {
+        .bLength          = sizeof(usb_endpoint_descriptor_t),
+        .bDescriptorType  = USB_DT_ENDPOINT,
+        .bEndpointAddress = USB_DIR_OUT | 1,
+        .bmAttributes     = USB_TRANSFER_TYPE_BULK,
+        .wMaxPacketSize   = 64,
+        .bInterval        = 0,
+    }), tx);
+    *in  = next_endpoint(dev_addr, &((usb_endpoint_descriptor_t) {
+        .bLength          = sizeof(usb_endpoint_descriptor_t),
+        .bDescriptorType  = USB_DT_ENDPOINT,
+        .bEndpointAddress = USB_DIR_IN | 2,
+        .bmAttributes     = USB_TRANSFER_TYPE_BULK,
+        .wMaxPacketSize   = 64,
+        .bInterval        = 0,
+    }), rx);
+}
+
+// Echo through the loopbacks behind a hub, all at the same time (-u)
+typedef struct {
+    endpoint_t *out, *in;
+    uint8_t    *tx, *rx; // Whole echo (each chunk is sent from and lands here)
+    uint64_t   *t0     ; // When each chunk was sent
+    uint32_t    sent   ; // Bytes queued on EP1_OUT
+    uint32_t    done   ; // Bytes echoed back and checked
+    uint64_t    end    ; // When the last chunk came back
+    ring_t     *ring   ; // Where EP2_IN data lands instead of rx (-z)
+} echo_t;
+
+static echo_t   echoes[SIM_HUB_PORTS];
+static uint8_t  echo_count;
+static uint32_t echo_total, echo_chunk, echo_window; // Window is in chunks
+static uint32_t echo_chunks, echo_errors;
+static uint64_t echo_rtt;
+
+static echo_t *find_echo_ep(endpoint_t *ep) {
+    for (uint8_t i = 0; i < echo_count; i++)
+        if (echoes[i].out == ep || echoes[i].in == ep) return &echoes[i];
+    panic("Unknown echo endpoint");
+    return NULL;
+}
+
+static echo_t *find_echo(uint8_t *buf) {
+    for (uint8_t i = 0; i < echo_count; i++) {
+        echo_t *e = &echoes[i];
+        if ((buf >= e->tx && buf < e->tx + echo_total) ||
+            (buf >= e->rx && buf < e->rx + echo_total)) return e;
+    }
+    panic("Unknown echo buffer");
+    return NULL;
+}
+
+// Queue chunks on EP1_OUT until the window is full
+static void echo_send(echo_t *e) {
+    while (e->sent < echo_total &&
+           e->sent - e->done < echo_window * echo_chunk) {
+        uint32_t len = MIN(echo_chunk, echo_total - e->sent);
+        e->t0[e->sent / echo_chunk] = sim_time_ns();
+        bulk_transfer(e->out, e->tx + e->sent, len);
+        e->sent += len;
+    }
+}
+
+// A chunk is in the loopback, read it back
+static void on_echo_out(endpoint_t *ep, uint8_t status, uint8_t *buf,
+                        uint32_t len) {
+    echo_t *e = find_echo(buf);
+    bulk_transfer(e->in, e->ring ? NULL : e->rx + (buf - e->tx), len);
+}
+
+// Ring bytes a chunk takes, including a record header per packet when framed
+static uint32_t ring_bytes(uint32_t chunk, bool framed) {
+    return chunk + (framed ? (chunk + 63) / 64 * RING_RECORD_HEADER : 0);
+}
+
+// Compare what landed in a ring with what was sent, and free it up
+static bool ring_matches(ring_t *ring, const uint8_t *tx, uint32_t len) {
+    if (ring->framed) { // Whole packets, all but the last one full
+        static uint8_t buf[ECHO_BATCH * 64];
+        uint16_t       lens[ECHO_BATCH];
+        bool           ok = true;
+        while (len && ok) {
+            uint16_t n = ring_read_records(ring, buf, sizeof(buf), lens,
+                                           ECHO_BATCH);
+            uint32_t got = 0;
+            for (uint16_t i = 0; i < n; i++) {
+                ok  &= lens[i] == MIN(64, len - got);
+                got += lens[i];
+            }
+            ok  &= n && got <= len && !memcmp(tx, buf, got);
+            tx  += got;
+            len -= MIN(got, len);
+        }
+        return ok;
+    }
+
+    ring_span_t span[2];
+    bool ok = ring_peek(ring, span, len) == len
+           && !memcmp(tx, span[0].ptr, span[0].len)
+           && !memcmp(tx + span[0].len, span[1].ptr, span[1].len);
+    ring_consume(ring, ring_peek(ring, span, len));
+    return ok;
+}
+
+// The same for a lock-free ring (-o)
+static bool spsc_matches(spsc_t *spsc, const uint8_t *tx, uint32_t len) {
+    static uint8_t buf[ECHO_RING];
+    return spsc_try_read(spsc, buf, len) == len && !memcmp(tx, buf, len);
+}
+
+// A chunk is back, check it and send more
+static void on_echo_in(endpoint_t *ep, uint8_t status, uint8_t *buf,
+                       uint32_t len) {
+    echo_t  *e   = buf ? find_echo(buf) : find_echo_ep(ep);
+    uint32_t off = buf ? buf - e->rx : e->done; // Ring data arrives in order
+
+    if (e->ring ? !ring_matches(e->ring, e->tx + off, len)
+                : memcmp(e->tx + off, buf, len)) echo_errors++;
+    echo_rtt += sim_time_ns() - e->t0[off / echo_chunk];
+    echo_chunks++;
+    e->done += len;
+    if (e->done == echo_total) e->end = sim_time_ns();
+    echo_send(e);
+}
+
+static bool echoes_done() {
+    for (uint8_t i = 0; i < echo_count; i++)
+        if (echoes[i].done < echo_total) return false;
+    return true;
+}
+
+// Count the devices that finished enumerating
+static uint8_t active_devices() {
+    uint8_t count = 0;
+    for (uint8_t i = 1; i < MAX_DEVICES; i++)
+        count += devices[i].state == DEVICE_ACTIVE;
+    return count;
+}
+
+static void show_stats(const char *what, uint64_t ns, uint64_t frames) {
+    fprintf(stderr, "%-12s %10.3f ms %6llu frames\n",
+            what, ns / 1e6, (unsigned long long) frames);
+}
+
+int main(int argc, char **argv) {
+    uint8_t  speed    = SIM_FULL_SPEED;
+    uint8_t  maxsize0 = 0;
+    uint32_t total    = 4096;
+    uint32_t chunk    = 64;
+    uint16_t pad      = 0;
+    bool     cosim    = false;
+    bool     verbose  = false;
+    bool     poll     = false;
+    uint8_t  ports    = 0;
+    uint32_t replugs  = 0;
+    bool     reboot   = false;
+    uint32_t bounce   = 0;
+    bool     zerocopy = false;
+    bool     framed   = false;
+    uint32_t slow     = 0;
+    bool     lockfree = false;
+    bool     stuck    = false;
+    int      opt;
+
+    while ((opt = getopt(argc, argv, "qdvleifzktou:r:w:s:a:x:y:b:m:n:c:p:")) != -1) {
+        switch (opt) {
+            case 'q': sim_options.quiet = true;            break;
+            case 'd': cosim             = true;            break;
+            case 'v': verbose           = true;            break;
+            case 'l': speed             = SIM_LOW_SPEED;   break;
+            case 'e': sim_options.e4    = true;            break;
+            case 'i': poll              = true;            break;
+            case 'u': ports             = atoi(optarg);    break;
+            case 'r': replugs           = atoi(optarg);    break;
+            case 'f': reboot            = true;            break;
+            case 'w': bounce            = atoi(optarg);    break;
+            case 'z': zerocopy          = true;            break;
+            case 'k': framed            = true;            break;
+            case 's': slow              = atoi(optarg);    break;
+            case 'o': lockfree          = true;            break;
+            case 't': stuck             = true;            break;
+            case 'a': app_ns            = atoi(optarg) * 1000; break;
+            case 'x': sim_options.faults = atoi(optarg);   break;
+            case 'y': sim_options.lossy = atoi(optarg);    break;
+            case 'b': sim_options.baud  = atoi(optarg);    break;
+            case 'm': maxsize0          = atoi(optarg);    break;
+            case 'n': total             = atoi(optarg);    break;
+            case 'c': chunk             = atoi(optarg);    break;
+            case 'p': pad               = atoi(optarg);    break;
+            default : usage(argv[0]);
+        }
+    }
+    if (!chunk || chunk > (cosim ? 64 : SIM_LOOPBACK_FIFO)) usage(argv[0]);
+    if (framed && !zerocopy) usage(argv[0]);
+    if (zerocopy && ring_bytes(chunk, framed) >= ECHO_RING) usage(argv[0]);
+    if (slow && (!zerocopy || ports || stuck || slow <= ring_bytes(64, framed)
+                 || slow >= ring_bytes(chunk, framed))) usage(argv[0]);
+    if (lockfree && (!zerocopy || framed || ports || stuck ||
+                     (slow & (slow - 1)))) usage(argv[0]); // Power of 2
+    if (poll && cosim) usage(argv[0]); // src/device has no interrupt endpoint
+    if (sim_options.lossy && (!poll || sim_options.lossy < 2)) usage(argv[0]);
+    if (ports > SIM_HUB_PORTS || (ports && (cosim || poll))) usage(argv[0]);
+    if (replugs && (cosim || poll)) usage(argv[0]);
+    if (bounce && !replugs) usage(argv[0]);
+    if (stuck && (cosim || ports)) usage(argv[0]); // On the loopback's EP2_IN
+    if (sim_options.faults && (cosim || ports)) usage(argv[0]); // Echo in order
+    if (!maxsize0) maxsize0 = speed == SIM_LOW_SPEED ? 8 : 64;
+    if (maxsize0 != 8 && maxsize0 != 16 && maxsize0 != 32 && maxsize0 != 64)
+        usage(argv[0]);
+    if (speed == SIM_LOW_SPEED && maxsize0 != 8) usage(argv[0]); // USB 2.0 5.5.3
+
+    // Power up with a device already plugged in
+    sim_function_t *root;
+    sim_init();
+    if (cosim) {
+        sim_device_cpu.out = verbose ? stdout : NULL;
+        sim_attach(root = sim_device_port());
+        sim_device_start();
+    } else if (ports) {
+        root = sim_hub(ports);
+        for (uint8_t i = 1; i <= ports; i++)
+            sim_hub_attach(root, i, sim_loopback(speed, maxsize0, pad));
+        sim_attach(root);
+    } else {
+        sim_attach(root = sim_loopback(speed, maxsize0, pad));
+    }
+#if USER_CORE1
+    sim_host_cpu.core = 1;
+    sim_start(&sim_app_cpu, app_main);
+    setup1(); // Waits for core 0 to set up the console
+#else
+    setup();
+#endif
+
+    // Enumerate (including the string descriptors), and with a hub, everything
+    // behind it (the hub is device 1, the loopbacks follow)
+    uint64_t limit = sim_time_ns() + (uint64_t) ENUM_LIMIT_MS * 1000000;
+    uint64_t active = 0, first = 0;
+    while (sim_time_ns() < limit && !active) {
+        host_pass();
+        if (!first && sim_stats.transactions) first = sim_time_ns();
+        if (active_devices() == 1 + ports) active = sim_time_ns();
+    }
+    if (!active || !run_until_idle(limit)) {
+        fprintf(stderr, "Enumeration did not complete\n");
+        return 1;
+    }
+    uint64_t enum_ns     = sim_time_ns();
+    uint64_t enum_frames = sim_stats.frames;
+    uint64_t enum_xacts  = sim_stats.transactions;
+    uint64_t enum_busy   = active - first; // From the first transaction
+
+    // Buffers for the echo
+    uint8_t *tx = (uint8_t *) malloc(chunk), *rx = (uint8_t *) malloc(chunk);
+
+    // Let the hardware poll for status reports while the data is echoed
+    if (poll) {
+        status = next_endpoint(1, &((usb_endpoint_descriptor_t) {
+            .bLength          = sizeof(usb_endpoint_descriptor_t),
+            .bDescriptorType  = USB_DT_ENDPOINT,
+            .bEndpointAddress = USB_DIR_IN | 3,
+            .bmAttributes     = USB_TRANSFER_TYPE_INTERRUPT,
+            .wMaxPacketSize   = 8,
+            .bInterval        = 4,
+        }), report);
+        ep_info(status)->cb = on_report;
+        interrupt_transfer(status, report, sizeof(report));
+    }
+
+    // Echo the data, one chunk at a time
+    uint64_t start = sim_time_ns();
+    uint64_t bytes = sim_stats.bytes_in + sim_stats.bytes_out;
+    uint64_t rtt   = 0;
+    uint32_t done  = 0, chunks = 0;
+    limit = start + (uint64_t) ECHO_LIMIT_MS * 1000000;
+    if (ports) {
+        echo_count  = ports;
+        echo_total  = total;
+        echo_chunk  = chunk;
+        echo_window = chunk % 64 ? 1 // Chunks must not share a packet
+                    : MAX(1, MIN(1 + MAX_QUEUED, SIM_LOOPBACK_FIFO / chunk));
+        if (zerocopy) // The ring has room for every chunk in flight
+            echo_window = MIN(echo_window,
+                              (ECHO_RING - 1) / ring_bytes(chunk, framed));
+        for (uint8_t i = 0; i < ports; i++) { // The hub is device 1
+            echo_t *e = &echoes[i];
+            e->tx = (uint8_t  *) malloc(total);
+            e->rx = (uint8_t  *) calloc(1, total);
+            e->t0 = (uint64_t *) calloc(total / chunk + 1, sizeof(uint64_t));
+            for (uint32_t j = 0; j < total; j++) e->tx[j] = (uint8_t) j;
+            open_echo(2 + i, e->tx, e->rx, &e->out, &e->in);
+            ep_info(e->out)->cb = on_echo_out;
+            ep_info(e->in )->cb = on_echo_in;
+            if (zerocopy) endpoint_ring(e->in, e->ring = framed
+                ? ring_new_framed(ECHO_RING) : ring_new(ECHO_RING));
+        }
+        for (uint8_t i = 0; i < ports; i++) echo_send(&echoes[i]);
+        while (!echoes_done() && !echo_errors && sim_time_ns() < limit) host_pass();
+        if (echo_errors) {
+            fprintf(stderr, "Echo mismatch\n");
+            return 1;
+        }
+        done   = echoes_done() ? total : 0;
+        chunks = echo_chunks;
+        rtt    = echo_rtt;
+    }
+    endpoint_t *out = NULL, *in = NULL;
+    ring_t     *ring = NULL;
+    spsc_t     *spsc = NULL;
+    while (!ports && done < total) {
+        if (!done) open_echo(1, tx, rx, &out, &in);
+        if (!done && sim_options.faults) ep_info(out)->cb = ep_info(in)->cb = on_xfer;
+        if (!done && zerocopy && lockfree)
+            endpoint_spsc(in, spsc = spsc_new(slow ? slow : ECHO_RING + 1));
+        else if (!done && zerocopy) endpoint_ring(in, ring = framed
+            ? ring_new_framed(slow ? slow : ECHO_RING)
+            : ring_new       (slow ? slow : ECHO_RING));
+
+        uint32_t len = MIN(chunk, total - done);
+        uint64_t t0  = sim_time_ns();
+
+        for (uint32_t i = 0; i < len; i++) tx[i] = (uint8_t) (done + i);
+        memclr(rx, len);
+
+        if (!transfer_all(out, tx, len, limit)) break;
+        if (slow) drip_ring = ring, drip_spsc = spsc, drip_tx = tx,
+                  drip_left = len;
+        if (!transfer_all(in , zerocopy ? NULL : rx, len, limit)) break;
+        while (drip_left && sim_time_ns() < limit) host_pass();
+
+        if (slow ? drip_left || drip_errors
+                 : spsc ? !spsc_matches(spsc, tx, len)
+                 : ring ? !ring_matches(ring, tx, len) : memcmp(tx, rx, len)) {
+            fprintf(stderr, "Echo mismatch at byte %u\n", done);
+            return 1;
+        }
+        rtt  += sim_time_ns() - t0;
+        done += len;
+        chunks++;
+    }
+    if (done < total) {
+        fprintf(stderr, "Echo did not complete\n");
+        return 1;
+    }
+    uint64_t echo_ns = sim_time_ns() - start;
+    bytes = sim_stats.bytes_in + sim_stats.bytes_out - bytes;
+
+    // The last report can take up to an interval to arrive (two if a poll was
+    // lost), and every poll that was lost must have been seen as one
+    if (poll) {
+        limit = sim_time_ns() + (uint64_t) (sim_options.lossy ? 4 : 2)
+                              * status->interval * 1000000;
+        while (report_out < total && sim_time_ns() < limit) host_pass();
+        if (report_in != total || report_out != total) {
+            fprintf(stderr, "Last report was %u in, %u out\n",
+                    report_in, report_out);
+            return 1;
+        }
+        if (!sim_options.faults && (xfer_stats.polled != sim_stats.lost ||
+                                    xfer_stats.retries)) {
+            fprintf(stderr, "%llu polls lost, but %u errors on polled endpoints"
+                    " and %u retries\n", (unsigned long long) sim_stats.lost,
+                    xfer_stats.polled, xfer_stats.retries);
+            return 1;
+        }
+    }
+
+    // Read the empty loopback, which NAKs until the deadline ends the transfer
+    // (and halts EP2_IN), then echo a chunk to see it goes on from there
+    uint64_t echo_frames = sim_stats.frames - enum_frames;
+    uint64_t stuck_ns    = 0;
+    if (stuck) {
+        uint64_t t0 = sim_time_ns();
+        ep_info(out)->cb = ep_info(in)->cb = on_xfer;
+        xfer_status = TRANSFER_SUCCESS;
+        bulk_transfer(in, ring ? NULL : rx, chunk);
+        if (!run_until_idle(limit) || !xfer_status) { // Or failed (-x)
+            fprintf(stderr, "Stuck transfer did not end\n");
+            return 1;
+        }
+        stuck_ns = sim_time_ns() - t0;
+
+        for (uint32_t i = 0; i < chunk; i++) tx[i] = (uint8_t) ~i;
+        memclr(rx, chunk);
+        if (!transfer_all(out, tx, chunk, limit) ||
+            !transfer_all(in , ring ? NULL : rx, chunk, limit) ||
+            (ring ? !ring_matches(ring, tx, chunk) : memcmp(tx, rx, chunk))) {
+            fprintf(stderr, "Echo failed after the stuck transfer\n");
+            return 1;
+        }
+    }
+
+    // Results
+    fprintf(stderr, "\n");
+    show_stats("Enumeration", enum_ns, enum_frames);
+    fprintf(stderr, "Enumerating  %10llu transactions, mounted %.3f ms after "
+            "the first\n", (unsigned long long) enum_xacts, enum_busy / 1e6);
+    show_stats("Echo", echo_ns, echo_frames);
+    fprintf(stderr, "Echo RTT     %10.3f ms per %u byte chunk\n",
+            chunks ? rtt / 1e6 / chunks : 0, chunk);
+    fprintf(stderr, "Throughput   %10.1f KB/s (both directions)\n",
+            echo_ns ? bytes * 1e9 / echo_ns / 1024 : 0);
+    fprintf(stderr, "Transactions %10llu (%llu NAK, %llu STALL, %llu timeout)\n",
+            (unsigned long long) sim_stats.transactions,
+            (unsigned long long) sim_stats.naks,
+            (unsigned long long) sim_stats.stalls,
+            (unsigned long long) sim_stats.timeouts);
+    fprintf(stderr, "Per frame    %10.1f transactions (busiest %llu)\n",
+            sim_stats.busy_frames ? (double) sim_stats.transactions /
+                                    sim_stats.busy_frames : 0,
+            (unsigned long long) sim_stats.busiest);
+    fprintf(stderr, "Interrupts   %10llu (waited %.3f μs on average, "
+            "%.3f μs at most)\n", (unsigned long long) sim_stats.irqs,
+            sim_stats.irqs ? sim_stats.isr_wait / 1e3 / sim_stats.irqs : 0,
+            sim_stats.isr_wait_max / 1e3);
+    fprintf(stderr, "Task waits   %10llu (%.3f μs on average, %.3f μs at most)"
+            "\n", (unsigned long long) task_waits,
+            task_waits ? task_wait / 1e3 / task_waits : 0, task_wait_max / 1e3);
+    const char *lane_names[MAX_LANES] = { "transfer", "driver", "enum" };
+    for (uint8_t i = 0; i < MAX_LANES; i++)
+        fprintf(stderr, "Tasks %-8s %5u added, at most %u waiting of %u"
+                " (%u dropped)\n", lane_names[i], lanes[i].head, lanes[i].high,
+                MAX_TASKS, lanes[i].drops);
+    if (sim_options.faults)
+        fprintf(stderr, "Faults       %10llu injected, %u retries, %u transfers"
+                " failed (%u in the echo), %u halts cleared\n",
+                (unsigned long long) sim_stats.faults, xfer_stats.retries,
+                xfer_stats.failures, xfer_failed, xfer_stats.halts);
+    if (stuck)
+        fprintf(stderr, "Deadline     %10.3f ms until the stuck read ended (%u"
+                " reaped)\n", stuck_ns / 1e6, xfer_stats.reaped);
+    if (poll)
+        fprintf(stderr, "Reports      %10u every %u ms or more\n",
+                reports, status->interval);
+    if (sim_options.lossy)
+        fprintf(stderr, "Lost polls   %10llu (%u errors on polled endpoints, %u"
+                " retries)\n", (unsigned long long) sim_stats.lost,
+                xfer_stats.polled, xfer_stats.retries);
+    for (uint8_t i = 0; i < echo_count; i++) {
+        echo_t *e = &echoes[i];
+        for (endpoint_t *ep = e->out; ep; ep = ep == e->out ? e->in : NULL) {
+            endpoint_info_t *info = ep_info(ep);
+            fprintf(stderr, "Device %u %-4s %8.1f KB/s (%u transfers, %u turns"
+                    " on EPX, done at %.3f ms)\n", ep->dev_addr,
+                    ep_in(ep) ? "IN" : "OUT",
+                    info->bytes * 1e9 / (e->end - start) / 1024, info->xfers,
+                    info->turns, (e->end - start) / 1e6);
+        }
+    }
+    fprintf(stderr, "Console      %10llu chars at %u baud\n",
+            (unsigned long long) sim_host_cpu.console, sim_options.baud);
+    if (cosim)
+        fprintf(stderr, "Device       %10llu chars at %u baud\n",
+                (unsigned long long) sim_device_cpu.console, sim_options.baud);
+
+    // Plug the device back in, and see how long it takes with the cache (the
+    // endpoints above are gone after this). Debounce, reset and recovery take
+    // the same ~120 ms each time, so what the cache saves shows in the
+    // transactions and the time from the first one.
+    uint64_t replug_ns = 0, replug_frames = 0, replug_xacts = 0, replug_busy = 0;
+    for (uint32_t i = 0; i < replugs; i++) {
+        sim_detach();
+        if (!run_until_idle(sim_time_ns() + (uint64_t) ENUM_LIMIT_MS * 1000000)
+            || active_devices()) {
+            fprintf(stderr, "Devices were not removed\n");
+            return 1;
+        }
+        if (reboot) cache_init(); // Only what was saved to flash is left
+
+        // Pulled again while it's still enumerating
+        if (bounce) {
+            uint64_t t0 = sim_time_ns();
+            sim_attach(root);
+            while (sim_time_ns() < t0 + (uint64_t) bounce * 1000000) host_pass();
+            sim_detach();
+            if (!run_until_idle(sim_time_ns() + (uint64_t) ENUM_LIMIT_MS * 1000000)
+                || active_devices()) {
+                fprintf(stderr, "Devices were not removed after %u ms\n",
+                        bounce);
+                return 1;
+            }
+        }
+
+        uint64_t t0 = sim_time_ns(), f0 = sim_stats.frames;
+        uint64_t x0 = sim_stats.transactions;
+        limit  = t0 + (uint64_t) ENUM_LIMIT_MS * 1000000;
+        active = first = 0;
+        sim_attach(root);
+        while (sim_time_ns() < limit && !active) {
+            host_pass();
+            if (!first && sim_stats.transactions != x0) first = sim_time_ns();
+            if (active_devices() == 1 + ports) active = sim_time_ns();
+        }
+        if (!active || !run_until_idle(limit)) {
+            fprintf(stderr, "Enumeration did not complete after replug\n");
+            return 1;
+        }
+        if (mounting) {
+            fprintf(stderr, "%u devices still count as mounting\n", mounting);
+            return 1;
+        }
+        replug_ns     += active - t0;
+        replug_frames += sim_stats.frames - f0;
+        replug_xacts  += sim_stats.transactions - x0;
+        replug_busy   += active - first;
+    }
+
+    if (replugs) {
+        show_stats("Replug", replug_ns / replugs, replug_frames / replugs);
+        fprintf(stderr, "Replugging   %10llu transactions, mounted %.3f ms "
+                "after the first\n", (unsigned long long) (replug_xacts /
+                replugs), replug_busy / 1e6 / replugs);
+        fprintf(stderr, "Cache        %10u hits, %u misses\n",
+                cache_hits, cache_misses);
+    }
+
+    // Whatever console output is still queued goes out the UART
+    if (USER_DRAIN) {
+        uint64_t t0 = sim_time_ns();
+        drain_flush();
+        fprintf(stderr, "Drain        %10u bytes in %u frames at %u baud, "
+                "%u lines lost (%.3f ms to flush)\n", drain_stats.bytes,
+                drain_stats.frames, USER_DRAIN, drain_stats.lost,
+                (sim_time_ns() - t0) / 1e6);
+    }
+
+    return 0;
+}
+
+// =============================================================================
@@ -0,0 +1,230 @@
+// =============================================================================
+// sdk.c: Pico SDK functions for the simulated rp2040 (Linux build)
+//
+// Anything that waits lets the simulated hardware run, since there is only a
+// single thread and the hardware would otherwise never make progress.
+// =============================================================================
+
+#include <stdio.h>                // For vfprintf
+#include <stdarg.h>               // For va_list
+#include <stdlib.h>               // For exit
+#include <string.h>               // For memcpy
+
+#include "pico/stdlib.h"          // Pico stdlib
+#include "pico/util/queue.h"      // Multicore and IRQ safe queue
+#include "hardware/flash.h"       // Flash programming
+#include "hardware/sync.h"        // Spin locks
+#include "hardware/uart.h"        // UARTs
+#include "hardware/dma.h"         // DMA channels
+
+#include "sim.h"                  // Simulated controller
+
+// ==[ Platform ]===============================================================
+
+spin_lock_t sim_spin_locks[NUM_SPIN_LOCKS];
+uint64_t    sim_events;
+
+void panic(const char *fmt, ...) {
+    va_list args;
+
+    fflush(stdout);
+    fprintf(stderr, "\n*** PANIC *** (%.3f ms, frame %u)\n\n",
+            sim_time_ns() / 1e6, sim_frame());
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+
+    exit(1);
+}
+
+void tight_loop_contents(void) {
+    sim_poll();
+}
+
+// ==[ Time ]===================================================================
+
+uint64_t time_us_64(void) {
+    return sim_time_ns() / 1000;
+}
+
+uint32_t time_us_32(void) {
+    return (uint32_t) time_us_64();
+}
+
+void sleep_us(uint64_t us) {
+    sim_run_until(sim_time_ns() + us * 1000);
+}
+
+void sleep_ms(uint32_t ms) {
+    sleep_us((uint64_t) ms * 1000);
+}
+
+void busy_wait_us(uint64_t us) {
+    sleep_us(us);
+}
+
+// ==[ Queue ]==================================================================
+
+void queue_init(queue_t *q, uint element_size, uint element_count) {
+    q->data          = (uint8_t *) calloc(element_count + 1, element_size);
+    q->element_size  = element_size;
+    q->element_count = element_count;
+    q->wptr          = 0;
+    q->rptr          = 0;
+}
+
+void queue_free(queue_t *q) {
+    free(q->data);
+    q->data = NULL;
+}
+
+uint queue_get_level(queue_t *q) {
+    int32_t level = (int32_t) q->wptr - (int32_t) q->rptr;
+    if (level < 0) level += q->element_count + 1;
+    return level;
+}
+
+static inline uint16_t inc_index(queue_t *q, uint16_t index) {
+    return ++index > q->element_count ? 0 : index;
+}
+
+bool queue_try_add(queue_t *q, const void *data) {
+    if (queue_is_full(q)) return false;
+
+    memcpy(q->data + q->wptr * q->element_size, data, q->element_size);
+    q->wptr = inc_index(q, q->wptr);
+    return true;
+}
+
+bool queue_try_peek(queue_t *q, void *data) {
+    if (queue_is_empty(q)) return false;
+
+    memcpy(data, q->data + q->rptr * q->element_size, q->element_size);
+    return true;
+}
+
+bool queue_try_remove(queue_t *q, void *data) {
+    if (queue_is_empty(q)) sim_poll(); // Entries come from the hardware
+    if (!queue_try_peek(q, data)) return false;
+
+    q->rptr = inc_index(q, q->rptr);
+    return true;
+}
+
+// Nothing can drain the queue while we wait, so a full queue is fatal
+void queue_add_blocking(queue_t *q, const void *data) {
+    if (!queue_try_add(q, data)) panic("Queue is full (%u entries)",
+                                       q->element_count);
+}
+
+void queue_remove_blocking(queue_t *q, void *data) {
+    while (!queue_try_remove(q, data)) ;
+}
+
+// ==[ Flash ]==================================================================
+
+enum {
+    FLASH_ERASE_NS   = 45000000, // Sector erase time
+    FLASH_PROGRAM_NS =   400000, // Page program time
+};
+
+uint8_t sim_flash[PICO_FLASH_SIZE_BYTES];
+
+// Flash comes erased
+__attribute__ ((constructor)) static void flash_init(void) {
+    memset(sim_flash, 0xff, sizeof(sim_flash));
+}
+
+void flash_range_erase(uint32_t offset, size_t count) {
+    if (offset % FLASH_SECTOR_SIZE || count % FLASH_SECTOR_SIZE ||
+        offset + count > sizeof(sim_flash))
+        panic("Flash erase of %zu bytes at 0x%x is not sector aligned",
+              count, offset);
+
+    memset(sim_flash + offset, 0xff, count);
+    sim_cpu_ns((uint64_t) FLASH_ERASE_NS * (count / FLASH_SECTOR_SIZE));
+}
+
+void flash_range_program(uint32_t offset, const uint8_t *data, size_t count) {
+    if (offset % FLASH_PAGE_SIZE || count % FLASH_PAGE_SIZE ||
+        offset + count > sizeof(sim_flash))
+        panic("Flash program of %zu bytes at 0x%x is not page aligned",
+              count, offset);
+
+    for (size_t i = 0; i < count; i++) sim_flash[offset + i] &= data[i];
+    sim_cpu_ns((uint64_t) FLASH_PROGRAM_NS * (count / FLASH_PAGE_SIZE));
+}
+
+// ==[ UART and DMA ]===========================================================
+
+uart_hw_t sim_uart_hw[NUM_UARTS];
+
+static uint32_t uart_baud[NUM_UARTS];
+
+static struct {
+    bool               claimed;
+    dma_channel_config cfg    ;
+    volatile void     *write  ; // Where the bytes go
+    uint64_t           done   ; // When the UART has sent the last of them
+} dma[NUM_DMA_CHANNELS];
+
+uint uart_init(uart_inst_t *uart, uint baudrate) {
+    uart_baud[uart_get_index(uart)] = baudrate;
+    return baudrate;
+}
+
+void uart_tx_wait_blocking(uart_inst_t *uart) {
+    for (uint i = 0; i < NUM_DMA_CHANNELS; i++) {
+        if (dma[i].write != &uart_get_hw(uart)->dr) continue;
+        while (dma_channel_is_busy(i)) tight_loop_contents();
+    }
+}
+
+int dma_claim_unused_channel(bool required) {
+    for (uint i = 0; i < NUM_DMA_CHANNELS; i++) {
+        if (dma[i].claimed) continue;
+        dma[i].claimed = true;
+        return i;
+    }
+    if (required) panic("No DMA channels are free");
+    return -1;
+}
+
+bool dma_channel_is_busy(uint channel) {
+    return sim_time_ns() < dma[channel].done;
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config *config,
+                           volatile void *write_addr,
+                           const volatile void *read_addr,
+                           uint transfer_count, bool trigger) {
+    dma[channel].cfg   = *config;
+    dma[channel].write = write_addr;
+    if (trigger)
+        dma_channel_transfer_from_buffer_now(channel, read_addr,
+                                             transfer_count);
+}
+
+// Send the bytes out the UART the channel was configured for
+void dma_channel_transfer_from_buffer_now(uint channel,
+                                          const volatile void *read_addr,
+                                          uint32_t transfer_count) {
+    dma_channel_config *cfg = &dma[channel].cfg;
+    uint                num = 0;
+
+    while (num < NUM_UARTS && dma[channel].write != &sim_uart_hw[num].dr) num++;
+    if (num == NUM_UARTS || cfg->dreq != uart_get_dreq(uart_get_instance(num),
+                                                       true))
+        panic("DMA channel %u only works with a UART's TX DREQ", channel);
+    if (cfg->size != DMA_SIZE_8 || !cfg->read_inc || cfg->write_inc)
+        panic("DMA channel %u must move bytes from memory", channel);
+    if (!uart_baud[num]) panic("UART%u is not initialized", num);
+    if (dma_channel_is_busy(channel)) panic("DMA channel %u is busy", channel);
+
+    sim_console((const void *) read_addr, transfer_count);
+    dma[channel].done = sim_time_ns() + (uint64_t) transfer_count * 10 *
+                        1000000000 / uart_baud[num];
+}
+
+// =============================================================================
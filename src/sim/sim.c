@@ -0,0 +1,1027 @@
+// =============================================================================
+// sim.c: Simulated rp2040 USB controllers (registers, SIE, bus timing, CPUs)
+//
+// The SIE is modeled one transaction at a time. Each transaction is charged
+// its full speed (or low speed) bit time: token, data, handshake and the
+// turnarounds between them. Transactions never cross the end of a frame.
+//
+// Each simulated CPU has a local clock that moves forward as it does work
+// (console output, interrupt entry) and when it waits. Its register writes
+// take effect on the bus when it next waits, which keeps cause and effect in
+// order even though the code of one CPU runs without interruption.
+//
+// See RP2040 datasheet, § 4.1.2.7 (Host) and § 4.1.2.6 (Device) for the
+// behavior being modeled.
+// =============================================================================
+
+#include <stdio.h>                // For vfprintf
+#include <stdarg.h>               // For va_list
+#include <stdlib.h>               // For malloc
+#include <string.h>               // For memset
+#include <ucontext.h>             // For CPU contexts
+
+#include "pico/stdlib.h"          // Pico stdlib
+#include "hardware/regs/usb.h"    // USB hardware registers
+#include "hardware/structs/usb.h" // USB hardware structs
+#include "hardware/irq.h"         // Interrupts and definitions
+#include "hardware/resets.h"      // Resetting the native USB controller
+
+#include "usb_common.h"           // USB 2.0 definitions
+#include "sim.h"                  // Simulated controller
+
+// ==[ State ]==================================================================
+
+sim_options_t sim_options = {
+    .baud    = 115200, // Matches monitor_speed in platformio.ini
+    .poll_ns =   1000, // About one trip around an idle usb_task() loop
+};
+
+sim_stats_t sim_stats;
+sim_ctrl_t  sim_host       = { .name = "host"  , .cpu  = &sim_host_cpu   };
+sim_ctrl_t  sim_device     = { .name = "device", .cpu  = &sim_device_cpu };
+sim_cpu_t   sim_host_cpu   = { .name = "host"  , .ctrl = &sim_host       };
+sim_cpu_t   sim_device_cpu = { .name = "device", .ctrl = &sim_device     };
+sim_cpu_t   sim_app_cpu    = { .name = "app"                             };
+
+static sim_ctrl_t     *ctrls[] = { &sim_host    , &sim_device     };
+static sim_cpu_t      *cpus [] = { &sim_host_cpu, &sim_device_cpu, &sim_app_cpu };
+
+static sim_cpu_t      *cur;    // CPU whose code is running
+static sim_function_t *port;   // Function attached to the root port
+static uint64_t        now;    // Bus time in ns
+static uint64_t        frame;  // Current frame number
+static uint64_t        busy;   // Transactions sent in the current frame
+
+extern void isr_usbctrl(void);
+
+// ==[ Timing ]=================================================================
+
+enum { // Bit times on the wire (no bit stuffing)
+    TOKEN_BITS     = 35, // SYNC, PID, ADDR, ENDP, CRC5, EOP
+    DATA_BITS      = 35, // SYNC, PID, CRC16, EOP (add 8 per data byte)
+    HANDSHAKE_BITS = 19, // SYNC, PID, EOP
+    TURN_BITS      =  8, // Bus turnaround between packets
+    TIMEOUT_BITS   = 18, // Time the host waits for an answer
+    EOF_BITS       = 32, // No transactions this close to the end of a frame
+    RESET_NS       = 10000000, // Bus reset is held for 10 ms
+    NAK_POLL_US    = 16, // Retry delay after a NAK when NAK_POLL is not set
+};
+
+static inline uint64_t bits_ns(uint32_t bits, uint8_t speed) {
+    uint64_t ns = (uint64_t) bits * 1000 / 12; // 12 Mbps
+    return speed == SIM_LOW_SPEED ? ns * 8 : ns; // 1.5 Mbps
+}
+
+// Move bus time forward, counting any frames that went by
+static void advance(uint64_t ns) {
+    if (ns <= now) return;
+    now = ns;
+    if (now / SIM_FRAME_NS != frame) {
+        frame = now / SIM_FRAME_NS;
+        busy  = 0;
+        sim_stats.frames = frame;
+    }
+}
+
+// Place a transaction of the given length on the bus
+static void bus_time(uint64_t ns) {
+    uint64_t eof = (frame + 1) * SIM_FRAME_NS - bits_ns(EOF_BITS, SIM_FULL_SPEED);
+
+    // Wait for the next frame (and its SOF) if it would run past EOF
+    if (now + ns > eof)
+        advance((frame + 1) * SIM_FRAME_NS + bits_ns(TOKEN_BITS, SIM_FULL_SPEED));
+
+    advance(now + ns);
+    sim_stats.transactions++;
+    if (!busy++) sim_stats.busy_frames++;
+    if (busy > sim_stats.busiest) sim_stats.busiest = busy;
+}
+
+uint64_t sim_time_ns(void) {
+    return cur->t;
+}
+
+uint32_t sim_frame(void) {
+    return (uint32_t) frame;
+}
+
+void sim_cpu_ns(uint64_t ns) {
+    cur->t += ns;
+}
+
+uint get_core_num(void) {
+    return cur->core;
+}
+
+uint __get_current_exception(void) {
+    return cur->in_isr ? 16 + USBCTRL_IRQ : 0; // Exceptions 16+ are IRQs
+}
+
+// ==[ Registers ]==============================================================
+
+#define REG(c, name) ((c)->regs.alias[0].word[offsetof(usb_hw_t, name) / 4])
+
+enum {
+    SIE_STATUS_WC = USB_SIE_STATUS_SUSPENDED_BITS       // Write to clear bits
+                  | USB_SIE_STATUS_RESUME_BITS
+                  | USB_SIE_STATUS_SETUP_REC_BITS
+                  | USB_SIE_STATUS_TRANS_COMPLETE_BITS
+                  | USB_SIE_STATUS_BUS_RESET_BITS
+                  | USB_SIE_STATUS_CRC_ERROR_BITS
+                  | USB_SIE_STATUS_BIT_STUFF_ERROR_BITS
+                  | USB_SIE_STATUS_RX_OVERFLOW_BITS
+                  | USB_SIE_STATUS_RX_TIMEOUT_BITS
+                  | USB_SIE_STATUS_NAK_REC_BITS
+                  | USB_SIE_STATUS_STALL_REC_BITS
+                  | USB_SIE_STATUS_ACK_REC_BITS
+                  | USB_SIE_STATUS_DATA_SEQ_ERROR_BITS,
+};
+
+static inline bool host_mode(sim_ctrl_t *c) {
+    return REG(c, main_ctrl) & USB_MAIN_CTRL_HOST_NDEVICE_BITS;
+}
+
+// Write to clear bits in SIE_STATUS (writing SPEED clears HOST_CONN_DIS)
+static void clear_sie_status(sim_ctrl_t *c, uint32_t bits) {
+    if (bits & USB_SIE_STATUS_SPEED_BITS) c->conn_dis = false;
+    c->sie_status &= ~(bits & SIE_STATUS_WC);
+}
+
+// Calculate the raw interrupt status from the controller state
+static uint32_t calc_intr(sim_ctrl_t *c) {
+    uint32_t s = c->sie_status;
+    uint32_t i = 0;
+
+    if (c->conn_dis                             ) i |= USB_INTR_HOST_CONN_DIS_BITS;
+    if (s & USB_SIE_STATUS_RESUME_BITS          ) i |= USB_INTR_HOST_RESUME_BITS;
+    if (s & USB_SIE_STATUS_TRANS_COMPLETE_BITS  ) i |= USB_INTR_TRANS_COMPLETE_BITS;
+    if (c->buf_status                           ) i |= USB_INTR_BUFF_STATUS_BITS;
+    if (s & USB_SIE_STATUS_DATA_SEQ_ERROR_BITS  ) i |= USB_INTR_ERROR_DATA_SEQ_BITS;
+    if (s & USB_SIE_STATUS_RX_TIMEOUT_BITS      ) i |= USB_INTR_ERROR_RX_TIMEOUT_BITS;
+    if (s & USB_SIE_STATUS_RX_OVERFLOW_BITS     ) i |= USB_INTR_ERROR_RX_OVERFLOW_BITS;
+    if (s & USB_SIE_STATUS_BIT_STUFF_ERROR_BITS ) i |= USB_INTR_ERROR_BIT_STUFF_BITS;
+    if (s & USB_SIE_STATUS_CRC_ERROR_BITS       ) i |= USB_INTR_ERROR_CRC_BITS;
+    if (s & USB_SIE_STATUS_STALL_REC_BITS       ) i |= USB_INTR_STALL_BITS;
+    if (s & USB_SIE_STATUS_BUS_RESET_BITS       ) i |= USB_INTR_BUS_RESET_BITS;
+    if (s & USB_SIE_STATUS_SETUP_REC_BITS       ) i |= USB_INTR_SETUP_REQ_BITS;
+
+    return i;
+}
+
+// Apply CPU writes (direct and through the XOR/SET/CLR aliases)
+static void sync(sim_ctrl_t *c) {
+    sim_regs_t *r = c->regs.alias;
+
+    // Direct writes to write-to-clear registers
+    if (REG(c, sie_status) != c->sie_status)
+        clear_sie_status(c, REG(c, sie_status));
+    if (REG(c, buf_status) != c->buf_status)
+        c->buf_status &= ~REG(c, buf_status);
+    if (REG(c, ep_nak_stall_status) != c->ep_nak_stall_status)
+        c->ep_nak_stall_status &= ~REG(c, ep_nak_stall_status);
+
+    // Atomic aliases
+    for (uint i = 0; i < sizeof(usb_hw_t) / 4; i++) {
+        uint32_t x = r[1].word[i];
+        uint32_t s = r[2].word[i];
+        uint32_t k = r[3].word[i];
+        if (!(x | s | k)) continue;
+        r[1].word[i] = r[2].word[i] = r[3].word[i] = 0;
+
+        if (i == offsetof(usb_hw_t, sie_status) / 4) {
+            clear_sie_status(c, x | s | k);
+        } else if (i == offsetof(usb_hw_t, buf_status) / 4) {
+            c->buf_status &= ~(x | s | k);
+        } else if (i == offsetof(usb_hw_t, ep_nak_stall_status) / 4) {
+            c->ep_nak_stall_status &= ~(x | s | k);
+        } else {
+            r[0].word[i] = ((r[0].word[i] ^ x) | s) & ~k;
+        }
+    }
+
+    REG(c, inte) &= USB_INTR_BITS;
+}
+
+// Publish controller owned registers
+static void publish(sim_ctrl_t *c) {
+    uint32_t intr = calc_intr(c);
+
+    REG(c, sie_status           ) = c->sie_status;
+    REG(c, buf_status           ) = c->buf_status;
+    REG(c, buf_cpu_should_handle) = c->buf_cpu_should_handle;
+    REG(c, ep_nak_stall_status  ) = c->ep_nak_stall_status;
+    REG(c, sof_rd               ) = frame & USB_SOF_RD_BITS;
+    REG(c, intr                 ) = intr;
+    REG(c, ints                 ) = (intr | REG(c, intf)) & REG(c, inte);
+}
+
+// Reset the controller (DPSRAM is not cleared, just like the real thing)
+void sim_reset(sim_ctrl_t *c) {
+    memset(&c->regs, 0, sizeof(c->regs));
+    c->sie_status            = 0;
+    c->buf_status            = 0;
+    c->buf_cpu_should_handle = 0;
+    c->ep_nak_stall_status   = 0;
+    c->conn_dis              = false;
+    c->irq_enabled           = false;
+    c->epx                   = (sim_epx_t) { 0 };
+    memset(c->intep, 0, sizeof(c->intep));
+    publish(c);
+}
+
+// ==[ Interrupts ]=============================================================
+
+// Run the interrupt handler on the controller's CPU until nothing is pending
+static void irq(sim_ctrl_t *c) {
+    sim_cpu_t *cpu = c->cpu;
+
+    for (uint n = 0; ; n++) {
+        sync(c);
+        publish(c);
+        if (cpu->in_isr || !c->irq_enabled || !c->isr || !REG(c, ints)) return;
+        if (n == 1000) panic("Interrupt storm (INTS=0x%08x)", REG(c, ints));
+
+        // The handler starts once the CPU is done with what it was doing
+        uint64_t wait = MAX(cpu->t, now) - now;
+        sim_stats.isr_wait    += wait;
+        sim_stats.isr_wait_max = MAX(sim_stats.isr_wait_max, wait);
+
+        sim_cpu_t *was = cur;
+        uint64_t   t0  = MAX(cpu->t, now);
+        cur         = cpu;
+        cpu->t      = t0 + sim_options.isr_ns;
+        cpu->in_isr = true;
+        sim_stats.irqs++;
+        c->isr();
+        cpu->in_isr  = false;
+        cpu->isr_end = cpu->t;
+        cpu->isr_ns += cpu->t - t0;
+        c->valid    = cpu->t;
+        cur         = was;
+    }
+}
+
+void irq_set_enabled(uint num, bool enabled) {
+    if (num == USBCTRL_IRQ && cur->ctrl) cur->ctrl->irq_enabled = enabled;
+}
+
+bool irq_is_enabled(uint num) {
+    return num == USBCTRL_IRQ && cur->ctrl && cur->ctrl->irq_enabled;
+}
+
+void reset_block(uint32_t bits) {
+    if (bits & RESETS_RESET_USBCTRL_BITS) sim_reset(cur->ctrl);
+}
+
+void unreset_block(uint32_t bits) {
+    ; // Nothing to do
+}
+
+void unreset_block_wait(uint32_t bits) {
+    ; // Nothing to do
+}
+
+// ==[ Faults ]=================================================================
+
+// With sim_options.faults, one EPX transaction in that many goes wrong, as on
+// a flaky cable. They are picked by a fixed pseudo-random sequence, so runs
+// are still repeatable. Any transaction can be lost (the function never sees
+// it, so nothing answers). On endpoints other than EP0, a handshake can be
+// lost instead: an OUT's ACK doesn't make it back, and for an IN, the function
+// misses the host's ACK, so it sends the same packet again next time. Or the
+// endpoint halts, and stalls until the host clears ENDPOINT_HALT. Functions
+// are reached through a stand-in that does this on the way. While a handshake
+// is in doubt, its endpoint is left alone until it's settled. A host can't
+// tell whether an OUT without an ACK got there, so if it gives up on one and
+// sends it again after clearing the halt, the data would arrive twice, and no
+// host could get over that. The function only takes such an OUT once the host
+// sends it again, which it would ACK as a duplicate otherwise.
+
+enum {
+    FAULT_NONE,
+    FAULT_LOST,      // Transaction lost
+    FAULT_HANDSHAKE, // Handshake lost
+    FAULT_HALT,      // Endpoint halted
+};
+
+static uint32_t fault_seed = 1;
+static uint32_t halted[128]; // By address, bit n is EPn OUT and 16 + n is IN
+
+static struct {              // Handshake in doubt
+    bool     armed;
+    uint8_t  dev_addr;
+    uint8_t  ep_addr;
+    uint8_t  pid;            // Packet an IN sends again
+    uint16_t len;
+    uint8_t  data[64];
+} doubt;
+
+static void faults_reset(void) {
+    memset(halted, 0, sizeof(halted));
+    doubt.armed = false;
+}
+
+static inline bool in_doubt(sim_function_t *fn, uint8_t ep_addr) {
+    return doubt.armed && doubt.dev_addr == fn->address
+                       && doubt.ep_addr  == ep_addr;
+}
+
+static inline void lose_handshake(sim_function_t *fn, uint8_t ep_addr) {
+    doubt.armed    = true;
+    doubt.dev_addr = fn->address;
+    doubt.ep_addr  = ep_addr;
+}
+
+// Pick what goes wrong with a transaction, if anything (xorshift32)
+static uint8_t fault(sim_function_t *fn, uint8_t ep_addr) {
+    if (!sim_options.faults || in_doubt(fn, ep_addr)) return FAULT_NONE;
+    fault_seed ^= fault_seed << 13;
+    fault_seed ^= fault_seed >> 17;
+    fault_seed ^= fault_seed <<  5;
+    if (fault_seed % sim_options.faults) return FAULT_NONE;
+
+    sim_stats.faults++;
+    return ep_addr & 0x0f ? FAULT_LOST + (fault_seed >> 16) % 3 : FAULT_LOST;
+}
+
+static inline uint32_t halt_bit(uint8_t ep_num, bool in) {
+    return 1u << ((ep_num & 0x0f) + (in ? 16 : 0));
+}
+
+static uint8_t faulty_setup(sim_function_t *fn, const uint8_t *pkt) {
+    sim_function_t     *real = (sim_function_t *) fn->ctx;
+    usb_setup_packet_t  req;
+
+    if (fault(real, 0)) return SIM_TIMEOUT;
+    uint8_t rc = real->setup(real, pkt);
+
+    // Clearing ENDPOINT_HALT lets the endpoint go on (the function itself
+    // starts it over at DATA0)
+    memcpy(&req, pkt, sizeof(req));
+    if (rc == SIM_ACK && req.bRequest == USB_REQUEST_CLEAR_FEATURE &&
+        req.bmRequestType == (USB_DIR_OUT | USB_REQ_TYPE_RECIPIENT_ENDPOINT) &&
+        req.wValue == USB_FEAT_ENDPOINT_HALT) {
+        halted[real->address] &= ~halt_bit(req.wIndex, req.wIndex & USB_DIR_IN);
+        if (in_doubt(real, req.wIndex)) doubt.armed = false;
+    }
+    return rc;
+}
+
+static uint8_t faulty_in(sim_function_t *fn, uint8_t ep_num, uint8_t *buf,
+                         uint16_t *len, uint8_t *pid) {
+    sim_function_t *real = (sim_function_t *) fn->ctx;
+    uint8_t         what = fault(real, USB_DIR_IN | ep_num);
+    uint32_t       *halt = &halted[real->address];
+
+    if (what == FAULT_LOST) return SIM_TIMEOUT;
+    if (what == FAULT_HALT) *halt |= halt_bit(ep_num, true);
+    if (*halt & halt_bit(ep_num, true)) return SIM_STALL;
+
+    // The function didn't see the ACK for its last packet
+    if (in_doubt(real, USB_DIR_IN | ep_num)) {
+        doubt.armed = false;
+        *len = doubt.len;
+        *pid = doubt.pid;
+        memcpy(buf, doubt.data, *len);
+        return SIM_ACK;
+    }
+
+    uint8_t rc = real->in(real, ep_num, buf, len, pid);
+    if (rc == SIM_ACK && what == FAULT_HANDSHAKE && *len <= sizeof(doubt.data)) {
+        lose_handshake(real, USB_DIR_IN | ep_num);
+        doubt.pid = *pid;
+        doubt.len = *len;
+        memcpy(doubt.data, buf, *len);
+    }
+    return rc;
+}
+
+static uint8_t faulty_out(sim_function_t *fn, uint8_t ep_num,
+                          const uint8_t *buf, uint16_t len, uint8_t pid) {
+    sim_function_t *real = (sim_function_t *) fn->ctx;
+    uint8_t         what = fault(real, ep_num);
+    uint32_t       *halt = &halted[real->address];
+
+    if (what == FAULT_LOST) return SIM_TIMEOUT;
+    if (what == FAULT_HALT) *halt |= halt_bit(ep_num, false);
+    if (*halt & halt_bit(ep_num, false)) return SIM_STALL;
+
+    // Held back until the host sends it again, which settles it
+    if (what == FAULT_HANDSHAKE) {
+        lose_handshake(real, ep_num);
+        return SIM_TIMEOUT;
+    }
+    uint8_t rc = real->out(real, ep_num, buf, len, pid);
+    if (rc == SIM_ACK && in_doubt(real, ep_num)) doubt.armed = false;
+    return rc;
+}
+
+// The stand-in for a function that EPX transactions go through
+static sim_function_t *faulty(sim_function_t *fn) {
+    static sim_function_t stand_in;
+
+    if (!sim_options.faults || !fn) return fn;
+    stand_in = (sim_function_t) {
+        .name    = fn->name,
+        .speed   = fn->speed,
+        .address = fn->address,
+        .ctx     = fn,
+        .setup   = faulty_setup,
+        .in      = faulty_in,
+        .out     = faulty_out,
+    };
+    return &stand_in;
+}
+
+// ==[ Bus ]====================================================================
+
+void sim_attach(sim_function_t *fn) {
+    faults_reset();
+    port = fn;
+    port->address = 0;
+    if (port->reset) port->reset(port);
+}
+
+void sim_detach(void) {
+    port = NULL;
+}
+
+// Find the function that answers to an address, which can be behind hubs
+static sim_function_t *lookup(uint8_t dev_addr, bool preamble) {
+    if (!port || !port->speed) return NULL;
+    if (port->address == dev_addr) return port;
+    return port->route ? port->route(port, dev_addr, preamble) : NULL;
+}
+
+// Bus speed of the packets to a function (a timeout takes as long as the port)
+static uint8_t speed_of(sim_function_t *fn) {
+    return fn ? fn->speed : port ? port->speed : SIM_FULL_SPEED;
+}
+
+// Track connects and disconnects on the root port
+static void host_port(sim_ctrl_t *c) {
+    uint32_t main = REG(c, main_ctrl);
+    bool     host = (main & USB_MAIN_CTRL_CONTROLLER_EN_BITS)
+                 && (main & USB_MAIN_CTRL_HOST_NDEVICE_BITS)
+                 && (REG(c, sie_ctrl) & USB_SIE_CTRL_PULLDOWN_EN_BITS);
+    uint8_t  want = host && port ? port->speed : SIM_DISCONNECTED;
+    uint8_t  seen = (c->sie_status & USB_SIE_STATUS_SPEED_BITS)
+                                  >> USB_SIE_STATUS_SPEED_LSB;
+
+    // VBUS is always present
+    if (REG(c, pwr) & USB_USB_PWR_VBUS_DETECT_BITS)
+        c->sie_status |= USB_SIE_STATUS_VBUS_DETECTED_BITS;
+
+    if (want == seen) return;
+
+    // Idle line state is J (D+ high for full speed, D- high for low speed)
+    uint32_t line = want == SIM_FULL_SPEED ? 1 : want == SIM_LOW_SPEED ? 2 : 0;
+    c->sie_status &= ~(USB_SIE_STATUS_SPEED_BITS | USB_SIE_STATUS_LINE_STATE_BITS);
+    c->sie_status |= want << USB_SIE_STATUS_SPEED_LSB
+                  |  line << USB_SIE_STATUS_LINE_STATE_LSB;
+    c->conn_dis    = true;
+}
+
+// ==[ Host SIE ]===============================================================
+
+// End the current transaction, with TRANS_COMPLETE or an error status
+static void host_finish(sim_ctrl_t *c, uint32_t status) {
+    c->epx.active  = false;
+    c->sie_status |= status;
+}
+
+// Record a completed buffer and raise BUFF_STATUS when required
+static void host_buffer_done(sim_ctrl_t *c, uint32_t ecr, uint8_t half,
+                             bool last) {
+    bool dub = ecr & EP_CTRL_DOUBLE_BUFFERED_BITS;
+
+    // Interrupt per buffer, or only after the second buffer of a pair
+    if (!dub || half || last || (ecr & EP_CTRL_INTERRUPT_PER_BUFFER))
+        c->buf_status |= 1u;
+
+    // Single buffered status lands in the second half on RP2040-E4
+    c->buf_cpu_should_handle = (c->buf_cpu_should_handle & ~1u) | half;
+
+    if (dub || sim_options.e4) c->epx.buf_sel ^= 1u;
+    if (last) host_finish(c, USB_SIE_STATUS_TRANS_COMPLETE_BITS);
+}
+
+// Run the data packet and handshake of an IN or OUT transaction. On ACK, the
+// buffer's half of the BCR is updated. Protocol errors are returned in *error.
+static uint8_t host_data(sim_function_t *fn, bool in, uint8_t ep_num,
+                         uint8_t *buf, uint32_t *ctl, uint8_t speed,
+                         uint32_t *error) {
+    uint16_t len = *ctl & USB_BUF_CTRL_LEN_MASK;
+    uint8_t  pid = *ctl & USB_BUF_CTRL_DATA1_PID ? 1 : 0;
+    uint8_t  rc;
+
+    *error = 0;
+    if (in) {
+        uint8_t  tmp[1024];
+        uint16_t got = sizeof(tmp);
+        uint8_t  rid = 0;
+
+        rc = fn ? fn->in(fn, ep_num, tmp, &got, &rid) : SIM_TIMEOUT;
+        if (rc == SIM_ACK) {
+            bus_time(bits_ns(TOKEN_BITS + TURN_BITS + DATA_BITS + got * 8 +
+                             TURN_BITS + HANDSHAKE_BITS, speed));
+            if (rid != pid) {
+                *error = USB_SIE_STATUS_DATA_SEQ_ERROR_BITS;
+            } else if (got > len) {
+                *error = USB_SIE_STATUS_RX_OVERFLOW_BITS;
+            } else {
+                memcpy(buf, tmp, got);
+                sim_stats.bytes_in += got;
+
+                // Buffer is now full, with the actual length received
+                *ctl = (*ctl & ~(USB_BUF_CTRL_AVAIL | USB_BUF_CTRL_LEN_MASK))
+                     | USB_BUF_CTRL_FULL | got;
+            }
+            return rc;
+        }
+    } else {
+        rc = fn ? fn->out(fn, ep_num, buf, len, pid) : SIM_TIMEOUT;
+        bus_time(bits_ns(TOKEN_BITS + TURN_BITS + DATA_BITS + len * 8 +
+                         TURN_BITS + (rc == SIM_TIMEOUT ? TIMEOUT_BITS
+                                                        : HANDSHAKE_BITS), speed));
+        if (rc == SIM_ACK) {
+            sim_stats.bytes_out += len;
+
+            // Buffer has been sent, so it's empty
+            *ctl &= ~(USB_BUF_CTRL_AVAIL | USB_BUF_CTRL_FULL);
+            return rc;
+        }
+    }
+
+    // An IN without data is just the token and the answer (if any)
+    if (in) bus_time(bits_ns(TOKEN_BITS + (rc == SIM_TIMEOUT ? TIMEOUT_BITS
+                                           : TURN_BITS + HANDSHAKE_BITS), speed));
+    switch (rc) {
+        case SIM_NAK  : sim_stats.naks++    ; break;
+        case SIM_STALL: sim_stats.stalls++  ; break;
+        default       : sim_stats.timeouts++; break;
+    }
+    return rc;
+}
+
+// Poll one interrupt endpoint that is due, returns false if none were. Each
+// one is polled once per interval while its buffer is available, a NAK waits
+// for the next interval. Completed buffers set BUF_STATUS bit 2(i+1) for IN or
+// 2(i+1)+1 for OUT, there is no TRANS_COMPLETE. A stall, timeout or protocol
+// error sets the same bit in EP_STATUS_STALL_NAK, so the host can tell it from
+// one on EPX. With sim_options.lossy, one polled transaction in that many is
+// lost on the way (nothing answers it), while EPX goes on as usual.
+static bool host_poll(sim_ctrl_t *c) {
+    static uint32_t   count;
+    usb_host_dpram_t *dpram = (usb_host_dpram_t *) c->dpram;
+    uint32_t          on    = REG(c, int_ep_ctrl);
+
+    for (uint i = 0; i < USB_HOST_INTERRUPT_ENDPOINTS; i++) {
+        sim_intep_t *p   = &c->intep[i];
+        uint32_t     ecr = dpram->int_ep_ctrl[i].ctrl;
+        uint32_t     bcr = dpram->int_ep_buffer_ctrl[i].ctrl;
+
+        if (!(on & (2u << i)) || p->due > frame) continue;
+        if (!(ecr & EP_CTRL_ENABLE_BITS) || !(bcr & USB_BUF_CTRL_AVAIL)) continue;
+
+        uint32_t dar = c->regs.alias[0].hw.int_ep_addr_ctrl[i];
+        bool     in  = !(dar & USB_ADDR_ENDP1_INTEP_DIR_BITS);
+        uint8_t  ep  = (dar & USB_ADDR_ENDP1_ENDPOINT_BITS)
+                            >> USB_ADDR_ENDP1_ENDPOINT_LSB;
+        uint32_t ms  = ((ecr >> EP_CTRL_HOST_INTERRUPT_INTERVAL_LSB) & 0x3ff) + 1;
+        uint32_t ctl = bcr & 0xffff;
+        uint32_t err;
+        bool     pre = dar & USB_ADDR_ENDP1_INTEP_PREAMBLE_BITS;
+        uint32_t bit = 1u << (i * 2 + 2 + !in);
+        sim_function_t *fn = lookup(dar & USB_ADDR_ENDP1_ADDRESS_BITS, pre);
+        if (sim_options.lossy && ++count % sim_options.lossy == 0) {
+            sim_stats.lost++;
+            fn = NULL;
+        }
+        uint8_t  rc  = host_data(fn, in, ep, c->dpram + (ecr & 0x0fff), &ctl,
+                                 speed_of(fn), &err);
+
+        p->due = frame + ms;
+        if (err || (rc != SIM_ACK && rc != SIM_NAK))
+            c->ep_nak_stall_status |= bit;
+        if (err) {
+            c->sie_status |= err;
+        } else if (rc == SIM_ACK) {
+            if (p->buf_sel) {
+                bcr &= ~USB_BUF_CTRL_AVAIL; // Buffer 0 is used up...
+                bcr  = (bcr & 0x0000ffff) | ctl << 16; // ...status goes to 1
+                c->buf_cpu_should_handle |=  bit;
+            } else {
+                bcr  = (bcr & 0xffff0000) | ctl;
+                c->buf_cpu_should_handle &= ~bit;
+            }
+            dpram->int_ep_buffer_ctrl[i].ctrl = bcr;
+            c->buf_status |= bit;
+            if (sim_options.e4) p->buf_sel ^= 1u;
+        } else if (rc == SIM_STALL) {
+            c->sie_status |= USB_SIE_STATUS_STALL_REC_BITS;
+        } else if (rc == SIM_TIMEOUT) {
+            c->sie_status |= USB_SIE_STATUS_RX_TIMEOUT_BITS;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Run one transaction, returns false if the SIE has nothing to do
+static bool host_step(sim_ctrl_t *c) {
+    usb_host_dpram_t *dpram = (usb_host_dpram_t *) c->dpram;
+    sim_epx_t        *e     = &c->epx;
+    uint32_t          scr   = REG(c, sie_ctrl);
+    uint32_t          ecr   = dpram->epx_ctrl;
+
+    // Bus reset
+    if (scr & USB_SIE_CTRL_RESET_BUS_BITS) {
+        REG(c, sie_ctrl) &= ~USB_SIE_CTRL_RESET_BUS_BITS;
+        if (port) port->address = 0;
+        if (port && port->reset) port->reset(port);
+        faults_reset();
+        advance(now + RESET_NS);
+        return true;
+    }
+
+    // Stop the current transaction
+    if (scr & USB_SIE_CTRL_STOP_TRANS_BITS) {
+        REG(c, sie_ctrl) &= ~USB_SIE_CTRL_STOP_TRANS_BITS;
+        e->active = false;
+    }
+
+    // Latch a new transaction
+    if (scr & USB_SIE_CTRL_START_TRANS_BITS) {
+        uint32_t dar = REG(c, dev_addr_ctrl);
+        bool     dub = ecr & EP_CTRL_DOUBLE_BUFFERED_BITS;
+
+        REG(c, sie_ctrl) &= ~USB_SIE_CTRL_START_TRANS_BITS;
+        *e = (sim_epx_t) {
+            .active   = true,
+            .setup    = scr & USB_SIE_CTRL_SEND_SETUP_BITS,
+            .in       = scr & USB_SIE_CTRL_RECEIVE_DATA_BITS,
+            .dev_addr =  dar & USB_ADDR_ENDP_ADDRESS_BITS,
+            .ep_num   = (dar & USB_ADDR_ENDP_ENDPOINT_BITS)
+                             >> USB_ADDR_ENDP_ENDPOINT_LSB,
+            .buf_sel  = dub || !sim_options.e4 ? 0 : e->buf_sel,
+        };
+    }
+
+    // Polled endpoints take turns with EPX
+    if (host_poll(c)) return true;
+
+    if (!e->active) return false;
+
+    sim_function_t *fn    = faulty(lookup(e->dev_addr,
+                                          scr & USB_SIE_CTRL_PREAMBLE_EN_BITS));
+    uint8_t         speed = speed_of(fn);
+
+    // SETUP stage (always DATA0 and 8 bytes)
+    if (e->setup) {
+        uint8_t rc = fn ? fn->setup(fn, c->dpram) : SIM_TIMEOUT;
+        if (rc == SIM_ACK) {
+            bus_time(bits_ns(TOKEN_BITS + TURN_BITS + DATA_BITS + 64 +
+                             TURN_BITS + HANDSHAKE_BITS, speed));
+            sim_stats.bytes_out += 8;
+            c->sie_status |= USB_SIE_STATUS_ACK_REC_BITS;
+            e->setup = false;
+        } else {
+            bus_time(bits_ns(TOKEN_BITS + DATA_BITS + 64 + TIMEOUT_BITS, speed));
+            sim_stats.timeouts++;
+            host_finish(c, USB_SIE_STATUS_RX_TIMEOUT_BITS);
+        }
+        return true;
+    }
+
+    // Find the buffer to work on (single buffered always programs buffer 0)
+    bool     dub  = ecr & EP_CTRL_DOUBLE_BUFFERED_BITS;
+    uint8_t  half = dub ? e->buf_sel : 0;
+    uint32_t bcr  = dpram->epx_buf_ctrl;
+    uint32_t ctl  = (bcr >> (half * 16)) & 0xffff;
+    if (!(ctl & USB_BUF_CTRL_AVAIL)) return false; // Waiting on the CPU
+
+    uint16_t len  = ctl & USB_BUF_CTRL_LEN_MASK;
+    uint8_t *buf  = c->dpram + (ecr & 0x0fff) + half * 64;
+    bool     last = ctl & USB_BUF_CTRL_LAST;
+    uint8_t  slot = dub ? half : e->buf_sel; // RP2040-E4 writes to buf_sel
+    uint32_t err;
+    uint8_t  rc   = host_data(fn, e->in, e->ep_num, buf, &ctl, speed, &err);
+
+    if (err) {
+        host_finish(c, err);
+        return true;
+    }
+
+    switch (rc) {
+        case SIM_ACK:
+            c->sie_status |= USB_SIE_STATUS_ACK_REC_BITS;
+            if (e->in) // A short packet ends the transfer
+                last = last || (ctl & USB_BUF_CTRL_LEN_MASK) < len;
+            if (slot != half) {
+                bcr &= ~USB_BUF_CTRL_AVAIL; // Buffer 0 is used up...
+                bcr  = (bcr & 0x0000ffff) | ctl << 16; // ...status goes to 1
+            } else {
+                bcr  = (bcr & ~(0xffffu << (half * 16))) | ctl << (half * 16);
+            }
+            dpram->epx_buf_ctrl = bcr;
+            host_buffer_done(c, ecr, slot, last);
+            break;
+
+        case SIM_NAK: { // Retried after NAK_POLL until the function is ready
+            uint32_t poll = REG(c, nak_poll) & 0x3ff;
+            advance(now + (uint64_t) (poll ? poll : NAK_POLL_US) * 1000);
+            c->sie_status |= USB_SIE_STATUS_NAK_REC_BITS;
+        }   break;
+
+        case SIM_STALL:
+            host_finish(c, USB_SIE_STATUS_STALL_REC_BITS);
+            break;
+
+        default:
+            host_finish(c, USB_SIE_STATUS_RX_TIMEOUT_BITS);
+            break;
+    }
+
+    return true;
+}
+
+// ==[ Device SIE ]=============================================================
+
+// A controller in device mode answers the host's transactions like any other
+// function on the bus. Only single buffered endpoints are modeled.
+
+static inline sim_ctrl_t *dev_ctrl(sim_function_t *fn) {
+    return (sim_ctrl_t *) fn->ctx;
+}
+
+// Find the buffer control and data buffer for an endpoint (EP0 is fixed)
+static io_rw_32 *dev_buffer(sim_ctrl_t *c, uint8_t ep_num, bool in,
+                            uint8_t **buf) {
+    usb_device_dpram_t *dpram = (usb_device_dpram_t *) c->dpram;
+
+    if (!ep_num) {
+        *buf = dpram->ep0_buf_a; // EP0 IN and OUT share a buffer
+    } else {
+        uint32_t ecr = in ? dpram->ep_ctrl[ep_num - 1].in
+                          : dpram->ep_ctrl[ep_num - 1].out;
+        if (!(ecr & EP_CTRL_ENABLE_BITS)) return NULL;
+        *buf = c->dpram + (ecr & 0x0fff);
+    }
+    return in ? &dpram->ep_buf_ctrl[ep_num].in : &dpram->ep_buf_ctrl[ep_num].out;
+}
+
+// Record a completed buffer (bit 2n is EPn IN and bit 2n+1 is EPn OUT)
+static void dev_buffer_done(sim_ctrl_t *c, uint8_t ep_num, bool in) {
+    c->buf_status |= 1u << (ep_num * 2 + (in ? 0 : 1));
+}
+
+static void dev_reset(sim_function_t *fn) {
+    sim_ctrl_t *c = dev_ctrl(fn);
+
+    REG(c, dev_addr_ctrl) = 0; // Bus reset clears the device address
+    c->sie_status |= USB_SIE_STATUS_BUS_RESET_BITS;
+}
+
+static uint8_t dev_setup(sim_function_t *fn, const uint8_t *pkt) {
+    sim_ctrl_t *c = dev_ctrl(fn);
+
+    // SETUP packets are always accepted, even if the CPU is busy
+    memcpy(c->dpram, pkt, 8);
+    c->sie_status |= USB_SIE_STATUS_SETUP_REC_BITS;
+    return SIM_ACK;
+}
+
+static uint8_t dev_in(sim_function_t *fn, uint8_t ep_num, uint8_t *buf,
+                      uint16_t *len, uint8_t *pid) {
+    sim_ctrl_t *c = dev_ctrl(fn);
+    uint8_t    *data;
+    io_rw_32   *bcr = dev_buffer(c, ep_num, true, &data);
+
+    if (!bcr) return SIM_TIMEOUT;
+    if (c->valid > now) return SIM_NAK; // The CPU is still getting ready
+
+    uint32_t ctl = *bcr;
+    if ((ctl & USB_BUF_CTRL_STALL) &&
+        (ep_num || (REG(c, ep_stall_arm) & 1u))) return SIM_STALL;
+    if (!(ctl & USB_BUF_CTRL_AVAIL) || !(ctl & USB_BUF_CTRL_FULL))
+        return SIM_NAK;
+
+    *len = ctl & USB_BUF_CTRL_LEN_MASK;
+    *pid = ctl & USB_BUF_CTRL_DATA1_PID ? 1 : 0;
+    memcpy(buf, data, *len);
+
+    // Buffer has been sent, so it's empty
+    *bcr = ctl & ~(USB_BUF_CTRL_AVAIL | USB_BUF_CTRL_FULL);
+    dev_buffer_done(c, ep_num, true);
+    return SIM_ACK;
+}
+
+static uint8_t dev_out(sim_function_t *fn, uint8_t ep_num, const uint8_t *buf,
+                       uint16_t len, uint8_t pid) {
+    sim_ctrl_t *c = dev_ctrl(fn);
+    uint8_t    *data;
+    io_rw_32   *bcr = dev_buffer(c, ep_num, false, &data);
+
+    if (!bcr) return SIM_TIMEOUT;
+    if (c->valid > now) return SIM_NAK; // The CPU is still getting ready
+
+    uint32_t ctl = *bcr;
+    if ((ctl & USB_BUF_CTRL_STALL) &&
+        (ep_num || (REG(c, ep_stall_arm) & 2u))) return SIM_STALL;
+    if (!(ctl & USB_BUF_CTRL_AVAIL) || (ctl & USB_BUF_CTRL_FULL))
+        return SIM_NAK;
+
+    len = MIN(len, ctl & USB_BUF_CTRL_LEN_MASK);
+    memcpy(data, buf, len);
+
+    // Buffer is now full, with the actual length and PID received
+    *bcr = (ctl & ~(USB_BUF_CTRL_AVAIL | USB_BUF_CTRL_LEN_MASK |
+                    USB_BUF_CTRL_DATA1_PID))
+         | USB_BUF_CTRL_FULL | (pid ? USB_BUF_CTRL_DATA1_PID : 0) | len;
+    dev_buffer_done(c, ep_num, false);
+    return SIM_ACK;
+}
+
+// Follow the pull-up (connect) and device address set by the CPU
+static void dev_port(sim_ctrl_t *c) {
+    bool on = (REG(c, main_ctrl) & USB_MAIN_CTRL_CONTROLLER_EN_BITS)
+           && (REG(c, sie_ctrl ) & USB_SIE_CTRL_PULLUP_EN_BITS);
+
+    c->fn.speed   = on ? SIM_FULL_SPEED : SIM_DISCONNECTED;
+    c->fn.address = REG(c, dev_addr_ctrl) & USB_ADDR_ENDP_ADDRESS_BITS;
+}
+
+sim_function_t *sim_device_port(void) {
+    sim_device.fn = (sim_function_t) {
+        .name  = sim_device.name,
+        .ctx   = &sim_device,
+        .reset = dev_reset,
+        .setup = dev_setup,
+        .in    = dev_in,
+        .out   = dev_out,
+    };
+    return &sim_device.fn;
+}
+
+// ==[ Scheduler ]==============================================================
+
+enum {
+    STACK_SIZE = 1 << 20, // Stack for each CPU other than the host
+};
+
+void sim_init(void) {
+    memset(&sim_stats, 0, sizeof(sim_stats));
+    now = frame = busy = 0;
+    port = NULL;
+    fault_seed = 1;
+    faults_reset();
+
+    for (uint i = 0; i < count_of(ctrls); i++) {
+        ctrls[i]->valid = 0;
+        sim_reset(ctrls[i]);
+    }
+    for (uint i = 0; i < count_of(cpus); i++) {
+        cpus[i]->t       = 0;
+        cpus[i]->wake    = 0;
+        cpus[i]->in_isr  = false;
+        cpus[i]->baud    = sim_options.baud;
+        cpus[i]->console = 0;
+        cpus[i]->core    = 0;
+        cpus[i]->isr_end = 0;
+        cpus[i]->isr_ns  = 0;
+        cpus[i]->entry   = NULL;
+        if (!cpus[i]->ctx) cpus[i]->ctx = calloc(1, sizeof(ucontext_t));
+    }
+    sim_host_cpu.out = stdout;
+    sim_app_cpu.out  = stdout;
+    sim_host.isr     = isr_usbctrl;
+
+    // The host runs on the program's own stack
+    cur = &sim_host_cpu;
+}
+
+static void trampoline(void) {
+    cur->entry();
+    panic("CPU %s returned", cur->name);
+}
+
+// Start another CPU, it runs as soon as the host CPU waits
+void sim_start(sim_cpu_t *cpu, void (*entry)(void)) {
+    ucontext_t *ctx = (ucontext_t *) cpu->ctx;
+
+    getcontext(ctx);
+    ctx->uc_stack.ss_sp   = malloc(STACK_SIZE);
+    ctx->uc_stack.ss_size = STACK_SIZE;
+    ctx->uc_link          = NULL;
+    makecontext(ctx, trampoline, 0);
+
+    cpu->entry = entry;
+    cpu->t     = cur->t;
+    cpu->wake  = cur->t;
+}
+
+// Run the bus for one transaction, then deliver any interrupts
+static bool step(void) {
+    for (uint i = 0; i < count_of(ctrls); i++) {
+        sync(ctrls[i]);
+        if (!host_mode(ctrls[i])) dev_port(ctrls[i]);
+    }
+
+    host_port(&sim_host);
+    bool used = host_step(&sim_host);
+
+    for (uint i = 0; i < count_of(ctrls); i++) {
+        publish(ctrls[i]);
+        irq(ctrls[i]);
+    }
+    return used;
+}
+
+// Wait until a point in time while everything else runs. The bus goes first
+// when it has work to do, otherwise the CPU with the earliest clock is next.
+static void wait_until(uint64_t wake) {
+    sim_cpu_t *me = cur;
+
+    if (me->ctrl) me->ctrl->valid = MAX(me->ctrl->valid, me->t);
+    me->wake = MAX(wake, me->t);
+
+    for (;;) {
+        sim_cpu_t *next = &sim_host_cpu;
+        for (uint i = 1; i < count_of(cpus); i++) {
+            if (cpus[i]->entry && cpus[i]->wake < next->wake) next = cpus[i];
+        }
+
+        // The bus can't act on host writes before they land
+        uint64_t due = MAX(now, sim_host.valid);
+        if (due <= next->wake) {
+            advance(due);
+            if (step()) continue;
+        }
+        advance(next->wake);
+
+        // The CPU sees everything the bus did while it was waiting
+        next->t    = MAX(next->t, now);
+        next->wake = 0;
+        if (next == me) return;
+
+        cur = next;
+        swapcontext((ucontext_t *) me->ctx, (ucontext_t *) next->ctx);
+        cur = me; // Another CPU picked us to run again
+        return;
+    }
+}
+
+// Let the hardware and other CPUs run while this CPU polls
+void sim_poll(void) {
+    if (cur->in_isr) return; // Hardware runs between interrupts
+    wait_until(cur->t + sim_options.poll_ns);
+}
+
+// Work in thread mode, which the interrupt handler preempts. The bus and the
+// other CPUs go on meanwhile, and time spent in the handler is added on.
+void sim_work_ns(uint64_t ns) {
+    if (cur->in_isr) { cur->t += ns; return; }
+
+    uint64_t end = cur->t + ns, isr = cur->isr_ns;
+    while (cur->t < end) {
+        wait_until(end);
+        end += cur->isr_ns - isr;
+        isr  = cur->isr_ns;
+    }
+}
+
+// Sleep until a point in time
+void sim_run_until(uint64_t ns) {
+    if (cur->in_isr) { cur->t = MAX(cur->t, ns); return; }
+    wait_until(ns);
+}
+
+// ==[ Console ]================================================================
+
+// Console output that costs the CPU nothing (such as a UART fed by DMA)
+void sim_console(const void *buf, size_t len) {
+    if (cur->out && !sim_options.quiet) fwrite(buf, 1, len, cur->out);
+}
+
+int sim_printf(const char *fmt, ...) {
+    va_list args;
+    char    str[1024];
+
+    va_start(args, fmt);
+    int len = vsnprintf(str, sizeof(str), fmt, args);
+    va_end(args);
+
+    if (len < 0) return len;
+    if (cur->out && !sim_options.quiet) fputs(str, cur->out);
+
+    // Charge the time it takes to send this out a UART (8N1 = 10 bits/char)
+    cur->console      += len;
+    sim_stats.console += len;
+    if (cur->baud)
+        sim_cpu_ns((uint64_t) len * 10 * 1000000000 / cur->baud);
+
+    return len;
+}
+
+// =============================================================================
@@ -0,0 +1,133 @@
+// =============================================================================
+// drainread.c: Read PicoUSB console output sent by DMA in frames (USER_DRAIN)
+//
+// Reads the frames described in include/host/drain.h from a serial port (set
+// to raw mode at the given baud rate, which can be several Mbaud) or from
+// stdin, checks them, and writes their text to stdout. Bytes outside of good
+// frames are skipped, so it starts in the middle of a stream and recovers
+// after line noise. Missing frames and lines the host had to drop are noted
+// on stderr, with totals at the end.
+//
+// Build: gcc -Iinclude/host tools/drainread.c -o drainread
+// Usage: drainread /dev/ttyUSB0 3000000 | tracedump
+//        .pio/build/sim/program | drainread | tracedump
+// =============================================================================
+
+#include <stdio.h>                // For fprintf
+#include <stdlib.h>               // For strtoul
+#include <string.h>               // For memmove
+#include <fcntl.h>                // For open
+#include <unistd.h>               // For read
+#include <sys/ioctl.h>            // For ioctl
+#include <asm/termbits.h>         // For termios2 (any baud rate)
+
+#include "drain.h"                // Frames
+
+enum {
+    FRAME_MAX = sizeof(drain_header_t) + DRAIN_CHUNK + 1,
+};
+
+static uint8_t  buf[65536], crc_table[256];
+static size_t   have;
+static uint64_t frames, bytes, skipped, bad, missing, lost;
+
+// Raw mode at any baud rate (BOTHER takes the rate as is)
+static int open_port(const char *path, unsigned baud) {
+    int fd = open(path, O_RDONLY | O_NOCTTY);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+
+    struct termios2 tio;
+    if (ioctl(fd, TCGETS2, &tio) < 0) {
+        perror("TCGETS2");
+        exit(1);
+    }
+    tio.c_iflag  = 0;
+    tio.c_oflag  = 0;
+    tio.c_lflag  = 0;
+    tio.c_cflag  = CS8 | CREAD | CLOCAL | BOTHER;
+    tio.c_ispeed = tio.c_ospeed = baud;
+    tio.c_cc[VMIN]  = 1;
+    tio.c_cc[VTIME] = 0;
+    if (ioctl(fd, TCSETS2, &tio) < 0) {
+        perror("TCSETS2");
+        exit(1);
+    }
+    return fd;
+}
+
+// Handle every whole frame in buf, returns the bytes used
+static size_t parse(void) {
+    static int last = -1; // Last frame number seen
+    size_t     pos  = 0;
+
+    while (have - pos >= sizeof(drain_header_t)) {
+        uint8_t *p = buf + pos;
+        if (p[0] != DRAIN_SYNC0 || p[1] != DRAIN_SYNC1) {
+            pos++, skipped++;
+            continue;
+        }
+
+        drain_header_t hdr;
+        memcpy(&hdr, p, sizeof(hdr));
+        size_t size = sizeof(hdr) + hdr.len + 1;
+        if (have - pos < size) break; // Wait for the rest
+
+        uint8_t crc = 0;
+        for (size_t i = 0; i < size - 1; i++) crc = crc_table[crc ^ p[i]];
+        if (crc != p[size - 1]) { // Not a frame after all, look further
+            pos++, skipped++, bad++;
+            continue;
+        }
+
+        if (last >= 0 && hdr.seq != (uint8_t) (last + 1)) {
+            uint8_t gap = hdr.seq - (uint8_t) (last + 1);
+            missing += gap;
+            fprintf(stderr, "[drainread: %u frames missing]\n", gap);
+        }
+        if (hdr.lost) {
+            lost += hdr.lost;
+            fflush(stdout);
+            fprintf(stderr, "[drainread: %u lines dropped by the host]\n",
+                    hdr.lost);
+        }
+        last = hdr.seq;
+
+        fwrite(p + sizeof(hdr), 1, hdr.len, stdout);
+        frames++;
+        bytes += hdr.len;
+        pos   += size;
+    }
+    return pos;
+}
+
+int main(int argc, char **argv) {
+    int fd = 0;
+
+    drain_crc_table(crc_table);
+    if (argc == 3) {
+        fd = open_port(argv[1], strtoul(argv[2], NULL, 0));
+    } else if (argc != 1) {
+        fprintf(stderr, "Usage: %s [port baud]\n", argv[0]);
+        return 2;
+    }
+
+    ssize_t got;
+    while ((got = read(fd, buf + have, sizeof(buf) - have)) > 0) {
+        have += got;
+        size_t used = parse();
+        memmove(buf, buf + used, have -= used);
+        fflush(stdout);
+    }
+
+    fprintf(stderr, "[drainread: %llu frames, %llu bytes, %llu missing, "
+            "%llu lines dropped, %llu bytes skipped (%llu bad CRCs)]\n",
+            (unsigned long long) frames, (unsigned long long) bytes,
+            (unsigned long long) missing, (unsigned long long) lost,
+            (unsigned long long) skipped, (unsigned long long) bad);
+    return 0;
+}
+
+// =============================================================================
@@ -0,0 +1,474 @@
+// =============================================================================
+// ringbench.c: Compare the spin-locked and lock-free rings from src/host/ring.c
+//
+// Two patterns are timed, each for ring_t and spsc_t with the same size:
+//
+//   pair:   one thread writes a chunk and reads it back, like an interrupt
+//           handler feeding usb_task() on the same core (ns per write+read)
+//   stream: a producer thread and a consumer thread move a numbered byte
+//           stream through the ring, like core0 feeding core1 (MB/s), and
+//           the consumer checks every byte
+//
+// Then ring_t's high watermark is varied while a producer writes one byte at
+// a time and a consumer waits in ring_read_timeout_us. It shows how often
+// the producer has to wake the consumer (__sev) and how many reads it takes.
+//
+// Then a log line is written with ring_printf (formatted right away) and
+// with ring_log (formatted later by ring_format), to compare what the
+// producer pays for each.
+//
+// Then thread code and a timer signal, standing in for an interrupt handler,
+// ring_log into the same framed ring, and the reader checks that no record
+// was lost or torn.
+//
+// Last, task-sized records are added and removed through the Pico SDK's
+// queue_t (modeled below, as queue.c does it) and through the task ring that
+// isr_usbctrl and usb_task share in src/host/main.c (copied here, since that
+// file only builds for a controller). The add is what the ISR pays per task.
+//
+// This runs on Linux, so the numbers only compare the two rings with each
+// other. With a single CPU, the stream threads take turns and mostly measure
+// how often they have to hand over.
+//
+// Build: gcc -O2 -pthread -Iinclude/sim -Iinclude/host tools/ringbench.c -o ringbench
+// Usage: ringbench [bytes]
+// =============================================================================
+
+#include <stdio.h>                // For printf
+#include <stdarg.h>               // For va_list
+#include <stdlib.h>               // For exit
+#include <time.h>                 // For clock_gettime
+#include <sched.h>                // For sched_yield
+#include <pthread.h>              // For pthread_create
+#include <signal.h>               // For signal
+#include <sys/time.h>             // For setitimer
+
+#include "../src/host/ring.c"     // Rings under test
+
+enum {
+    RING_SIZE = 4096, // Bytes in each ring (a power of 2 for spsc_t)
+    PAIRS     = 1 << 20, // Write+read pairs per chunk size
+};
+
+// ==[ Platform ]===============================================================
+
+spin_lock_t sim_spin_locks[NUM_SPIN_LOCKS];
+uint64_t    sim_events;
+
+void panic(const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+void tight_loop_contents(void) {
+    sched_yield();
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t time_us_64(void) {
+    return (uint64_t) (now() * 1e6);
+}
+
+uint get_core_num(void) {
+    return 0;
+}
+
+uint __get_current_exception(void) {
+    return 0;
+}
+
+// ==[ Pair ]===================================================================
+
+static uint8_t src[RING_SIZE], dst[RING_SIZE];
+
+static double pair_ring(ring_t *r, uint16_t len) {
+    double t = now();
+    for (int i = 0; i < PAIRS; i++) {
+        ring_try_write(r, src, len);
+        ring_try_read(r, dst, len);
+    }
+    return (now() - t) * 1e9 / PAIRS;
+}
+
+static double pair_spsc(spsc_t *r, uint32_t len) {
+    double t = now();
+    for (int i = 0; i < PAIRS; i++) {
+        spsc_try_write(r, src, len);
+        spsc_try_read(r, dst, len);
+    }
+    return (now() - t) * 1e9 / PAIRS;
+}
+
+// ==[ Stream ]=================================================================
+
+typedef struct {
+    ring_t  *ring;
+    spsc_t  *spsc;
+    uint64_t bytes;
+    uint32_t chunk;
+} stream_t;
+
+static void *producer(void *arg) {
+    stream_t *s = arg;
+    uint8_t   buf[RING_SIZE];
+    uint64_t  sent = 0;
+
+    while (sent < s->bytes) {
+        uint32_t len = (uint32_t) MIN(s->chunk, s->bytes - sent);
+        for (uint32_t i = 0; i < len; i++) buf[i] = (uint8_t) (sent + i);
+        uint32_t off = 0;
+        while (off < len) {
+            uint32_t cnt = s->spsc
+                ? spsc_try_write(s->spsc, buf + off, len - off)
+                : ring_try_write(s->ring, buf + off, len - off);
+            if (cnt) off += cnt; else sched_yield();
+        }
+        sent += len;
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    stream_t *s = arg;
+    uint8_t   buf[RING_SIZE];
+    uint64_t  seen = 0;
+
+    while (seen < s->bytes) {
+        uint32_t cnt = s->spsc
+            ? spsc_try_read(s->spsc, buf, s->chunk)
+            : ring_try_read(s->ring, buf, s->chunk);
+        if (!cnt) { sched_yield(); continue; }
+        for (uint32_t i = 0; i < cnt; i++, seen++)
+            if (buf[i] != (uint8_t) seen)
+                panic("Byte %llu is %u, not %u", (unsigned long long) seen,
+                      buf[i], (uint8_t) seen);
+    }
+    return NULL;
+}
+
+static double stream(ring_t *ring, spsc_t *spsc, uint32_t chunk,
+                     uint64_t bytes) {
+    stream_t  s = { ring, spsc, bytes, chunk };
+    pthread_t p, c;
+
+    double t = now();
+    pthread_create(&c, NULL, consumer, &s);
+    pthread_create(&p, NULL, producer, &s);
+    pthread_join(p, NULL);
+    pthread_join(c, NULL);
+    return bytes / (now() - t) / 1e6;
+}
+
+// ==[ Wakeups ]================================================================
+
+typedef struct {
+    ring_t  *ring;
+    uint32_t bytes;
+    uint32_t reads;
+} wakeup_t;
+
+static void *trickle(void *arg) {
+    wakeup_t *w = arg;
+    for (uint32_t i = 0; i < w->bytes; i++) {
+        uint8_t b = (uint8_t) i;
+        while (!ring_try_write(w->ring, &b, 1)) sched_yield();
+        sched_yield(); // Bytes arrive over time, like packets
+    }
+    return NULL;
+}
+
+static void *batch(void *arg) {
+    wakeup_t *w = arg;
+    uint8_t   buf[RING_SIZE];
+    uint32_t  seen = 0;
+
+    while (seen < w->bytes) {
+        uint16_t cnt = ring_read_timeout_us(w->ring, buf, sizeof(buf), 1000);
+        for (uint16_t i = 0; i < cnt; i++, seen++)
+            if (buf[i] != (uint8_t) seen) panic("Byte %u is wrong", seen);
+        w->reads += cnt > 0;
+    }
+    return NULL;
+}
+
+static void wakeups(uint16_t high, uint32_t bytes) {
+    ring_t   *ring = ring_new(RING_SIZE);
+    wakeup_t  w    = { ring, bytes, 0 };
+    pthread_t p, c;
+
+    ring_set_watermarks(ring, RING_SIZE - 2, high);
+    uint64_t events = sim_events;
+    pthread_create(&c, NULL, batch  , &w);
+    pthread_create(&p, NULL, trickle, &w);
+    pthread_join(p, NULL);
+    pthread_join(c, NULL);
+    printf("%5u %12llu %12u\n", high,
+           (unsigned long long) (sim_events - events), w.reads);
+    ring_destroy(ring);
+}
+
+// ==[ Printing ]===============================================================
+
+#define LOG_FMT  "Device %u EP%u %s %u bytes (%x)\n"
+#define LOG_ARGS 3, 2, "IN", 512, 0xbeef
+
+static void printing(void) {
+    ring_t *text = ring_new(RING_SIZE), *logs = ring_new_framed(RING_SIZE);
+    char    want[64], got[64];
+    int     lines = PAIRS / 8;
+
+    snprintf(want, sizeof(want), LOG_FMT, LOG_ARGS);
+    double t = now();
+    for (int i = 0; i < lines; i++) {
+        ring_printf(text, LOG_FMT, LOG_ARGS);
+        ring_try_read(text, got, sizeof(got));
+    }
+    double immediate = (now() - t) * 1e9 / lines;
+
+    double producer = 0, consumer = 0; // In batches that fit in the ring
+    for (int i = 0; i < lines; i += 64) {
+        t = now();
+        for (int j = 0; j < 64; j++) ring_log(logs, LOG_FMT, LOG_ARGS);
+        producer += now() - t;
+        t = now();
+        for (int j = 0; j < 64; j++) ring_format(logs, got, sizeof(got));
+        consumer += now() - t;
+    }
+    if (strcmp(want, got)) panic("ring_format gave %s", got);
+
+    printf("\nring_printf %7.1f ns per line\n", immediate);
+    printf("ring_log    %7.1f ns per line (ring_format %.1f ns later)\n",
+           producer * 1e9 / lines, consumer * 1e9 / lines);
+    ring_destroy(text);
+    ring_destroy(logs);
+}
+
+// ==[ Shared ]=================================================================
+
+// Thread code and an interrupt handler log to the same framed ring. A timer
+// signal stands in for the interrupt and can land anywhere the ring's lock
+// isn't held (on the rp2040, spin_lock_blocking masks interrupts, so one that
+// comes while it's held is skipped here). Each writer numbers its records,
+// and the reader checks that every record is whole and that each writer's
+// arrive in order, none missing.
+
+static const char        shared_fmt[] = "Writer %u record %u\n";
+static ring_t           *shared_ring;
+static volatile uint32_t shared_isr, shared_masked; // Records, skipped
+
+static void shared_irq(int sig) {
+    if (__atomic_load_n(shared_ring->core.spin_lock, __ATOMIC_ACQUIRE)) {
+        shared_masked++;
+        return;
+    }
+    if (ring_log(shared_ring, shared_fmt, 1, shared_isr)) shared_isr++;
+}
+
+// Read and check every record there is, returns how many
+static uint32_t shared_drain(uint32_t next[2]) {
+    uintptr_t words[1 + RING_LOG_ARGS];
+    uint16_t  len;
+    uint32_t  cnt = 0;
+
+    while ((len = ring_read_record(shared_ring, words, sizeof(words)))) {
+        if (len != 3 * sizeof(uintptr_t) || words[0] != (uintptr_t) shared_fmt
+            || words[1] > 1 || words[2] != next[words[1]])
+            panic("Record %u of writer %u is broken (%u bytes)",
+                  next[0] + next[1], words[1], len);
+        next[words[1]]++;
+        cnt++;
+    }
+    return cnt;
+}
+
+static void shared(uint32_t isr_records) {
+    struct itimerval every = { { 0, 20 }, { 0, 20 } }, off = { 0 };
+    uint32_t         next[2] = { 0 }, thread = 0;
+
+    shared_ring = ring_new_framed(256); // Small, so it's often full
+    signal(SIGALRM, shared_irq);
+    setitimer(ITIMER_REAL, &every, NULL);
+    while (shared_isr < isr_records) {
+        if (ring_log(shared_ring, shared_fmt, 0, thread)) thread++;
+        else shared_drain(next);
+    }
+    setitimer(ITIMER_REAL, &off, NULL);
+    shared_drain(next);
+    if (next[0] != thread || next[1] != shared_isr)
+        panic("Read %u and %u records, but %u and %u were written",
+              next[0], next[1], thread, shared_isr);
+    if (ring_used(shared_ring))
+        panic("%u stray bytes in the ring", ring_used(shared_ring));
+
+    printf("\nring_log    %7u records from thread code and %u from a handler"
+           " (%u skipped)\n", thread, shared_isr, shared_masked);
+    ring_destroy(shared_ring);
+}
+
+// ==[ Tasks ]==================================================================
+
+typedef struct { // Same size as task_t in src/host/main.c on the rp2040
+    uint8_t  type;
+    uint32_t guid;
+    uint32_t word[4];
+} task_t;
+
+enum {
+    MAX_TASKS = 64,
+};
+
+// The SDK's queue_t: every call takes the spin lock, copies element_size
+// bytes with memcpy, moves an index that wraps at element_count + 1, and
+// notifies anyone waiting (queue_add_blocking spins here when it's full)
+static struct {
+    lock_core_t core;
+    uint8_t    *data;
+    uint16_t    wptr, rptr, element_size, element_count;
+} queue;
+
+static uint16_t queue_level(void) {
+    int32_t level = (int32_t) queue.wptr - (int32_t) queue.rptr;
+    return level < 0 ? level + queue.element_count + 1 : level;
+}
+
+static uint16_t queue_inc(uint16_t index) {
+    return ++index > queue.element_count ? 0 : index;
+}
+
+__attribute__ ((noinline)) static bool queue_try_add(const void *data) {
+    uint32_t save = spin_lock_blocking(queue.core.spin_lock);
+    if (queue_level() == queue.element_count) {
+        spin_unlock(queue.core.spin_lock, save);
+        return false;
+    }
+    memcpy(queue.data + queue.wptr * queue.element_size, data,
+           queue.element_size);
+    queue.wptr = queue_inc(queue.wptr);
+    lock_internal_spin_unlock_with_notify(&queue.core, save);
+    return true;
+}
+
+__attribute__ ((noinline)) static bool queue_try_remove(void *data) {
+    uint32_t save = spin_lock_blocking(queue.core.spin_lock);
+    if (!queue_level()) {
+        spin_unlock(queue.core.spin_lock, save);
+        return false;
+    }
+    memcpy(data, queue.data + queue.rptr * queue.element_size,
+           queue.element_size);
+    queue.rptr = queue_inc(queue.rptr);
+    lock_internal_spin_unlock_with_notify(&queue.core, save);
+    return true;
+}
+
+// The task ring from src/host/main.c (overflow drops instead of panicking)
+static struct {
+    task_t            slot[MAX_TASKS];
+    volatile uint32_t head ; // Tasks ever added   (isr_usbctrl only)
+    volatile uint32_t tail ; // Tasks ever removed (usb_task only)
+    uint32_t          high ; // Most tasks waiting at once
+    uint32_t          drops; // Tasks dropped because the ring was full
+} tasks;
+
+__attribute__ ((noinline)) static bool task_add(const task_t *task) {
+    uint32_t head = tasks.head;
+    uint32_t used = head - __atomic_load_n(&tasks.tail, __ATOMIC_ACQUIRE);
+
+    if (used == MAX_TASKS) {
+        tasks.drops++;
+        return false;
+    }
+    tasks.slot[head & (MAX_TASKS - 1)] = *task;
+    __atomic_store_n(&tasks.head, head + 1, __ATOMIC_RELEASE);
+    if (used >= tasks.high) tasks.high = used + 1;
+    return true;
+}
+
+__attribute__ ((noinline)) static bool task_remove(task_t *task) {
+    uint32_t tail = tasks.tail;
+
+    if (__atomic_load_n(&tasks.head, __ATOMIC_ACQUIRE) == tail) return false;
+    *task = tasks.slot[tail & (MAX_TASKS - 1)];
+    __atomic_store_n(&tasks.tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Add a burst of tasks (as one interrupt might), then remove them all
+static void task_costs(void) {
+    task_t task = { 0 }, got;
+    int    burst = 32, rounds = PAIRS / burst;
+    double queue_add = 0, queue_remove = 0, ring_add = 0, ring_remove = 0, t;
+
+    lock_init(&queue.core, next_striped_spin_lock_num());
+    queue.data          = calloc(MAX_TASKS + 1, sizeof(task_t));
+    queue.element_size  = sizeof(task_t);
+    queue.element_count = MAX_TASKS;
+
+    for (int i = 0; i < rounds; i++) {
+        t = now();
+        for (int j = 0; j < burst; j++, task.guid++) queue_try_add(&task);
+        queue_add += now() - t;
+        t = now();
+        for (int j = 0; j < burst; j++) queue_try_remove(&got);
+        queue_remove += now() - t;
+
+        t = now();
+        for (int j = 0; j < burst; j++, task.guid++) task_add(&task);
+        ring_add += now() - t;
+        t = now();
+        for (int j = 0; j < burst; j++) task_remove(&got);
+        ring_remove += now() - t;
+    }
+    if (got.guid != task.guid - 1) panic("Task %u came out last", got.guid);
+
+    printf("\nTasks (%u bytes)  add (ISR)    remove\n", (uint) sizeof(task_t));
+    printf("queue_t      %9.1f ns %7.1f ns\n",
+           queue_add * 1e9 / PAIRS, queue_remove * 1e9 / PAIRS);
+    printf("task ring    %9.1f ns %7.1f ns\n",
+           ring_add * 1e9 / PAIRS, ring_remove * 1e9 / PAIRS);
+    free(queue.data);
+}
+
+// ==[ Main ]===================================================================
+
+int main(int argc, char **argv) {
+    uint64_t bytes  = argc > 1 ? strtoull(argv[1], NULL, 0) : 64 << 20;
+    uint32_t chunks[] = { 4, 32, 256 };
+
+    ring_t *ring = ring_new(RING_SIZE);
+    spsc_t *spsc = spsc_new(RING_SIZE);
+
+    printf("Chunk   ring_t pair   spsc_t pair   ring_t stream   spsc_t stream\n");
+    for (int i = 0; i < count_of(chunks); i++) {
+        uint32_t len = chunks[i];
+        double rp = pair_ring(ring, len);
+        double sp = pair_spsc(spsc, len);
+        double rs = stream(ring, NULL, len, bytes);
+        double ss = stream(NULL, spsc, len, bytes);
+        printf("%5u %9.1f ns %10.1f ns %10.1f MB/s %10.1f MB/s\n",
+               len, rp, sp, rs, ss);
+    }
+
+    ring_destroy(ring);
+    spsc_destroy(spsc);
+
+    printf("\n High       Wakeups        Reads   (%u bytes, one at a time)\n",
+           1 << 18);
+    uint16_t highs[] = { 1, 16, 256, 2048 };
+    for (int i = 0; i < count_of(highs); i++) wakeups(highs[i], 1 << 18);
+
+    printing();
+    shared(PAIRS / 128);
+    task_costs();
+    return 0;
+}
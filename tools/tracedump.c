@@ -0,0 +1,184 @@
+// =============================================================================
+// tracedump.c: Decode PicoUSB host trace records into the usual debug output
+//
+// The host sends its ISR trace (see include/host/trace.h) as "#T" lines mixed
+// in with normal console output. This filter copies the console output as is,
+// and rebuilds the box-drawn register and data dumps from the "#T" lines.
+//
+// Build: gcc -Iinclude/sim -Iinclude/host tools/tracedump.c -o tracedump
+// Usage: pio device monitor | tracedump
+//        .pio/build/sim/program | tracedump
+// =============================================================================
+
+#include <stdio.h>                // For printf
+#include <stdbool.h>              // For bool
+#include <stddef.h>               // For size_t
+#include <stdint.h>               // For uint32_t
+#include <string.h>               // For strncmp
+#include <sys/types.h>            // For uint
+
+#include "hardware/regs/usb.h"    // USB hardware registers
+#include "helpers.h"              // Helper functions (bindump)
+#include "trace.h"                // Binary trace records
+
+#define USB_DIR_IN  0x80
+#define count_of(a) (sizeof(a) / sizeof((a)[0]))
+
+// ==[ Output ]=================================================================
+
+static void show_endpoint(const trace_t *t) {
+    const char *dir = t->ep_addr & USB_DIR_IN ? "IN" : "OUT";
+    printf(" │ %-3uEP%-2d%3s │\n", t->dev_addr, t->ep_addr & ~USB_DIR_IN, dir);
+}
+
+static void show_interrupts(uint32_t ints) {
+    if (ints & USB_INTS_HOST_CONN_DIS_BITS   ) printf(", device"  );
+    if (ints & USB_INTS_STALL_BITS           ) printf(", stall"   );
+    if (ints & USB_INTS_BUFF_STATUS_BITS     ) printf(", buffer"  );
+    if (ints & USB_INTS_TRANS_COMPLETE_BITS  ) printf(", last"    );
+    if (ints & USB_INTS_ERROR_RX_TIMEOUT_BITS) printf(", timeout" );
+    if (ints & USB_INTS_ERROR_DATA_SEQ_BITS  ) printf(", dataseq" );
+    if (ints & USB_INTS_HOST_RESUME_BITS     ) printf(", power"   );
+}
+
+// Same as hexdump() in helpers.h, with offsets starting at the record's data
+static void show_data(const char *str, const trace_t *t) {
+    for (uint i = 0; i < t->len; i += 16) {
+        printf("%s\t│ %04x │ ", str, t->num + i);
+        for (uint j = 0; j < 16; j++) {
+            if (i + j < t->len) {
+                printf("%02x ", t->data[i + j]);
+            } else {
+                printf("   ");
+            }
+        }
+        printf(" │ ");
+        for (uint j = 0; j < 16 && i + j < t->len; j++) {
+            uint8_t ch = t->data[i + j];
+            printf("%c", (ch >= 32 && ch <= 126) ? ch : '.');
+        }
+        printf("\n");
+    }
+}
+
+static void show_record(const trace_t *t) {
+    static const char *labels[] = {
+        [TRACE_IN1  ] = "│IN/1" , [TRACE_IN2  ] = "│IN/2" ,
+        [TRACE_OUT1 ] = "│OUT/1", [TRACE_OUT2 ] = "│OUT/2",
+        [TRACE_SETUP] = "│SETUP", [TRACE_XDATA] = "│Data" ,
+    };
+
+    switch (t->event) {
+        case TRACE_ISR:
+            printf( "\n=> %u) New ISR", t->num);
+            show_interrupts(t->reg[1]);
+            printf( "\n\n");
+            printf( "┌───────┬──────┬─────────────────────────────────────┬────────────┐\n");
+            printf( "│Frame  │ %4u │ %-35s", t->frame, "Interrupt Handler");
+            show_endpoint(t);
+            printf( "├───────┼──────┼─────────────────────────────────────┼────────────┤\n");
+            bindump("│INTR", t->reg[0]);
+            bindump("│INTS", t->reg[1]);
+            bindump("│DAR" , t->reg[2]);
+            bindump("│SSR" , t->reg[3]);
+            bindump("│SCR" , t->reg[4]);
+            bindump("│ECR" , t->reg[5]);
+            bindump("│BCR" , t->reg[6]);
+            break;
+
+        case TRACE_START:
+            printf("\n");
+            printf( "┌───────┬──────┬─────────────────────────────────────┬────────────┐\n");
+            printf( "│Frame  │ %4u │ %-35s", t->frame, "Transfer started");
+            show_endpoint(t);
+            printf( "├───────┼──────┼─────────────────────────────────────┼────────────┤\n");
+            bindump("│DAR", t->reg[0]);
+            bindump("│SSR", t->reg[1]);
+            bindump("│SCR", t->reg[2]);
+            bindump("│ECR", t->reg[3]);
+            bindump("│BCR", t->reg[4]);
+            if (t->arg)
+                printf( "├───────┼──────┼─────────────────────────────────────┴────────────┤\n");
+            break;
+
+        case TRACE_CONNECT:
+            printf( "├───────┼──────┼─────────────────────────────────────┼────────────┤\n");
+            printf( "│CONNECT│ %-4s │ %-35s │ Task #%-4u │\n", "", "New device connected", t->num);
+            break;
+
+        case TRACE_STALL:
+            printf("Stall detected\n");
+            break;
+
+        case TRACE_BUFFERS:
+            printf( "├───────┼──────┼─────────────────────────────────────┼────────────┤\n");
+            bindump(t->arg ? "│BUF/2" : "│BUF/1", t->reg[0]);
+            break;
+
+        case TRACE_DATA:
+            if (t->arg < count_of(labels)) show_data(labels[t->arg], t);
+            break;
+
+        case TRACE_XFER:
+            if (t->arg) printf("Transfer failed (status %u)\n", t->arg);
+            if (t->reg[0]) {
+                printf( "├───────┼──────┼─────────────────────────────────────┴────────────┤\n");
+                printf( "│XFER\t│ %4u │ Device %-28u   Task #%-4u │\n", t->reg[0], t->dev_addr, t->num);
+            } else {
+                const char *str = t->ep_addr & USB_DIR_IN ? "IN" : "OUT";
+                printf( "├───────┼──────┼─────────────────────────────────────┼────────────┤\n");
+                printf( "│ZLP\t│ %-4s │ Device %-28u │ Task #%-4u │\n", str, t->dev_addr, t->num);
+            }
+            break;
+
+        case TRACE_TIMEOUT:
+            printf("Receive timeout\n");
+            break;
+
+        case TRACE_RESUME:
+            printf("Device initiated resume\n");
+            break;
+
+        case TRACE_END:
+            printf("└───────┴──────┴─────────────────────────────────────%s────────────┘\n", t->arg ? "─" : "┴");
+            break;
+
+        case TRACE_LOST:
+            printf("\n*** %u trace records lost (ring full) ***\n", t->num);
+            break;
+
+        case TRACE_SEQ:
+            printf("Data sequence error\n");
+            break;
+
+        case TRACE_RETRY:
+            printf("Retry #%u (status %u)\n", t->num, t->arg);
+            break;
+
+        default:
+            printf("#? Unknown trace event %u\n", t->event);
+            break;
+    }
+}
+
+// ==[ Main ]===================================================================
+
+int main(void) {
+    char line[1024];
+
+    while (fgets(line, sizeof(line), stdin)) {
+        trace_t   t;
+        uint32_t *word = (uint32_t *) &t;
+        char     *ptr  = line + 2;
+        int       used = 0;
+        bool      ok   = !strncmp(line, "#T", 2);
+
+        for (uint i = 0; ok && i < TRACE_WORDS; i++, ptr += used)
+            ok = sscanf(ptr, " %8x%n", &word[i], &used) == 1;
+
+        ok ? show_record(&t) : (void) fputs(line, stdout);
+    }
+    return 0;
+}
+
+// =============================================================================